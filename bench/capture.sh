@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Record the stream of uxfs operations from the uxfs_op_* tracepoints
+# into a file that bench/uxreplay can play back. Needs root and the
+# uxfs module loaded. With a command, records for as long as the
+# command runs; without one, until interrupted.
+#
+# Usage: capture.sh out [command [args]]
+#
+# Environment:
+#   BUFKB    per cpu trace buffer size in KB (default 16384); events
+#            are lost if it fills up before it's read
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "usage: capture.sh out [command [args]]" >&2
+	exit 1
+fi
+OUT=$1
+shift
+
+T=/sys/kernel/debug/tracing
+[ -d "$T/events/uxfs" ] || T=/sys/kernel/tracing
+if [ ! -d "$T/events/uxfs" ]; then
+	echo "capture.sh: no uxfs tracepoints, is the module loaded" \
+	     "and debugfs mounted?" >&2
+	exit 1
+fi
+
+enable() {
+	for e in "$T"/events/uxfs/uxfs_op_*; do
+		echo "$1" > "$e/enable"
+	done
+}
+trap 'enable 0' EXIT
+trap 'exit 0' INT TERM
+
+echo "${BUFKB:-16384}" > "$T/buffer_size_kb"
+echo > "$T/trace"
+enable 1
+if [ $# -gt 0 ]; then
+	"$@"
+	enable 0
+	cat "$T/trace" > "$OUT"
+	if grep -q "LOST" "$OUT"; then
+		echo "capture.sh: events were lost, raise BUFKB" >&2
+	fi
+else
+	cat "$T/trace_pipe" > "$OUT"
+fi
@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Build a fresh uxfs image with cmds/mkfs, attach it to a loop device,
+# mount it with the uxfs module and run uxbench against it, or replay
+# a trace taken with capture.sh. Needs root.
+#
+# Usage: run.sh [uxbench or uxreplay options]
+#
+# Environment:
+#   KDIR     kernel build tree (default /lib/modules/`uname -r`/build)
+#   IMAGE    image file to use (default a temporary file)
+#   OUT      file results are appended to (default: stdout only)
+#   NDEVS    stripe the volume over this many loop devices (default 1),
+#            each with its own temporary image after the first
+#   STRIPE   blocks per stripe unit when NDEVS > 1
+#   TRACE    replay this trace with uxreplay instead of running
+#            uxbench, then print the volume's fragmentation report
+#
+# Every run starts from a newly made filesystem and a newly loaded
+# module so that results are comparable between runs.
+
+set -e
+
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+KDIR=${KDIR:-/lib/modules/$(uname -r)/build}
+MNT=$(mktemp -d /tmp/uxbench.mnt.XXXXXX)
+IMAGE=${IMAGE:-$(mktemp /tmp/uxbench.img.XXXXXX)}
+NDEVS=${NDEVS:-1}
+LOOPS=
+MEMBERS=
+
+cleanup() {
+	umount "$MNT" 2>/dev/null || true
+	for l in $LOOPS; do
+		losetup -d "$l" 2>/dev/null || true
+	done
+	rmmod uxfs 2>/dev/null || true
+	rmdir "$MNT" 2>/dev/null || true
+	for m in $MEMBERS; do
+		rm -f "$m"
+	done
+}
+trap cleanup EXIT INT TERM
+
+if [ "$(id -u)" != 0 ]; then
+	echo "run.sh: must be run as root" >&2
+	exit 1
+fi
+
+make -s -C "$TOP/cmds"
+make -s -C "$TOP/bench"
+make -s -C "$KDIR" M="$TOP/kern" modules
+
+# 512 byte blocks: the superblock, inode table and data area.
+dd if=/dev/zero of="$IMAGE" bs=512 count=1024 2>/dev/null
+LOOPS=$(losetup -f --show "$IMAGE")
+i=1
+while [ $i -lt "$NDEVS" ]; do
+	m=$(mktemp /tmp/uxbench.img.XXXXXX)
+	MEMBERS="$MEMBERS $m"
+	dd if=/dev/zero of="$m" bs=512 count=1024 2>/dev/null
+	LOOPS="$LOOPS $(losetup -f --show "$m")"
+	i=$((i + 1))
+done
+"$TOP/cmds/mkfs" ${STRIPE:+-s "$STRIPE"} $LOOPS
+
+rmmod uxfs 2>/dev/null || true
+insmod "$TOP/kern/uxfs.ko"
+mount -t uxfs "${LOOPS%% *}" "$MNT"
+
+{
+	echo "# kernel=$(uname -r) commit=$(git -C "$TOP" rev-parse --short HEAD 2>/dev/null || echo unknown) date=$(date -u +%Y-%m-%dT%H:%M:%SZ) ndevs=$NDEVS"
+	if [ -n "$TRACE" ]; then
+		"$TOP/bench/uxreplay" "$@" "$TRACE" "$MNT"
+		cat "/sys/fs/uxfs/$(basename "${LOOPS%% *}")/frag"
+	else
+		"$TOP/bench/uxbench" -d "$@" "$MNT"
+	fi
+} | if [ -n "$OUT" ]; then tee -a "$OUT"; else cat; fi
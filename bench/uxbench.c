@@ -0,0 +1,578 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- uxbench.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+/*
+ * Workload driver for a mounted uxfs filesystem. Each workload is
+ * run for a number of rounds inside its own scratch directory and
+ * every operation is timed individually. Results are printed one
+ * line per workload as key=value pairs so that runs can be diffed
+ * and parsed by scripts; see run.sh for the full setup.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <linux/fs.h>
+#include <linux/types.h>
+#include "../kern/uxfs.h"
+
+#define UXBENCH_VERSION	1
+
+/*
+ * Largest file uxfs can hold.
+ */
+
+#define FILE_SIZE	(UXFS_DIRECT_BLOCKS * UXFS_BSIZE)
+
+struct result {
+	const char *name;
+	unsigned long n;
+	unsigned long cap;
+	uint64_t *lat;		/* per operation latency, ns */
+	uint64_t wall;		/* time spent in timed sections, ns */
+	uint64_t bytes;
+};
+
+struct pcreate_arg {
+	char dir[1024];
+	int nfiles;
+	struct result res;
+};
+
+char *topdir;
+int rounds = 20;
+int nfiles = UXFS_MAXFILES - 8;
+int nthreads = 4;
+int drop = 0;
+
+uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void die(const char *what, const char *path)
+{
+	fprintf(stderr, "uxbench: %s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+void record(struct result *res, uint64_t ns)
+{
+	if (res->n == res->cap) {
+		res->cap = res->cap ? res->cap * 2 : 1024;
+		res->lat = realloc(res->lat, res->cap * sizeof(uint64_t));
+		if (!res->lat) {
+			fprintf(stderr, "uxbench: out of memory\n");
+			exit(1);
+		}
+	}
+	res->lat[res->n++] = ns;
+}
+
+void merge(struct result *dst, struct result *src)
+{
+	unsigned long i;
+
+	for (i = 0; i < src->n; i++)
+		record(dst, src->lat[i]);
+	dst->bytes += src->bytes;
+	free(src->lat);
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+double pct(struct result *res, double p)
+{
+	unsigned long i;
+
+	if (!res->n)
+		return 0.0;
+	i = (unsigned long)(p / 100.0 * (res->n - 1) + 0.5);
+	return res->lat[i] / 1000.0;
+}
+
+void report(struct result *res)
+{
+	double secs = res->wall / 1e9;
+
+	qsort(res->lat, res->n, sizeof(uint64_t), cmp_u64);
+	printf("workload=%s ops=%lu ops_per_sec=%.1f", res->name, res->n,
+	       secs > 0 ? res->n / secs : 0.0);
+	if (res->bytes)
+		printf(" mb_per_sec=%.2f",
+		       secs > 0 ? res->bytes / secs / (1 << 20) : 0.0);
+	printf(" p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f\n",
+	       pct(res, 50), pct(res, 90), pct(res, 99), pct(res, 100));
+	fflush(stdout);
+	free(res->lat);
+}
+
+/*
+ * Push everything out and, if asked to and allowed to, drop the
+ * page, dentry and inode caches so the next phase goes to uxfs
+ * rather than the VFS caches.
+ */
+
+void settle(void)
+{
+	int fd;
+
+	sync();
+	if (!drop)
+		return;
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		return;
+	write(fd, "3\n", 2);
+	close(fd);
+}
+
+void path_of(char *buf, size_t len, const char *dir, const char *pfx,
+	     int i)
+{
+	snprintf(buf, len, "%s/%s%d", dir, pfx, i);
+}
+
+void make_dir(const char *path)
+{
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		die("mkdir", path);
+}
+
+void create_files(const char *dir, int n, struct result *res)
+{
+	char path[2048];
+	uint64_t t, start = now();
+	int i, fd;
+
+	for (i = 0; i < n; i++) {
+		path_of(path, sizeof(path), dir, "f", i);
+		t = now();
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd < 0)
+			die("create", path);
+		close(fd);
+		if (res)
+			record(res, now() - t);
+	}
+	if (res)
+		res->wall += now() - start;
+}
+
+void unlink_files(const char *dir, int n, struct result *res)
+{
+	char path[2048];
+	uint64_t t, start = now();
+	int i;
+
+	for (i = 0; i < n; i++) {
+		path_of(path, sizeof(path), dir, "f", i);
+		t = now();
+		if (unlink(path) < 0)
+			die("unlink", path);
+		if (res)
+			record(res, now() - t);
+	}
+	if (res)
+		res->wall += now() - start;
+}
+
+void stat_files(const char *dir, const char *pfx, int n, int expect,
+		struct result *res)
+{
+	char path[2048];
+	struct stat st;
+	uint64_t t, start = now();
+	int i, error;
+
+	for (i = 0; i < n; i++) {
+		path_of(path, sizeof(path), dir, pfx, i);
+		t = now();
+		error = stat(path, &st);
+		record(res, now() - t);
+		if ((error == 0) != expect)
+			die("stat", path);
+	}
+	res->wall += now() - start;
+}
+
+/*
+ * Create, look up (hits and misses) and unlink storms in a single
+ * directory holding as many files as the filesystem allows.
+ */
+
+void bench_namespace(void)
+{
+	struct result create = { "create" }, lookup = { "lookup" };
+	struct result miss = { "lookup_miss" }, unl = { "unlink" };
+	char dir[1024];
+	int r;
+
+	snprintf(dir, sizeof(dir), "%s/ns", topdir);
+	make_dir(dir);
+	for (r = 0; r < rounds; r++) {
+		settle();
+		create_files(dir, nfiles, &create);
+		settle();
+		stat_files(dir, "f", nfiles, 1, &lookup);
+		stat_files(dir, "missing", nfiles, 0, &miss);
+		settle();
+		unlink_files(dir, nfiles, &unl);
+	}
+	rmdir(dir);
+	report(&create);
+	report(&lookup);
+	report(&miss);
+	report(&unl);
+}
+
+void *pcreate_thread(void *arg)
+{
+	struct pcreate_arg *pa = arg;
+
+	create_files(pa->dir, pa->nfiles, &pa->res);
+	return NULL;
+}
+
+/*
+ * Parallel creates, one thread per directory.
+ */
+
+void bench_pcreate(void)
+{
+	struct result res = { "pcreate" };
+	struct pcreate_arg *pa;
+	pthread_t *tids;
+	uint64_t start;
+	int r, t, per;
+
+	per = (nfiles - nthreads) / nthreads;
+	if (per < 1) {
+		fprintf(stderr, "uxbench: too many threads for %d files\n",
+			nfiles);
+		return;
+	}
+	pa = calloc(nthreads, sizeof(*pa));
+	tids = calloc(nthreads, sizeof(*tids));
+	for (r = 0; r < rounds; r++) {
+		for (t = 0; t < nthreads; t++) {
+			snprintf(pa[t].dir, sizeof(pa[t].dir), "%s/p%d",
+				 topdir, t);
+			make_dir(pa[t].dir);
+			pa[t].nfiles = per;
+			memset(&pa[t].res, 0, sizeof(pa[t].res));
+		}
+		settle();
+		start = now();
+		for (t = 0; t < nthreads; t++)
+			pthread_create(&tids[t], NULL, pcreate_thread, &pa[t]);
+		for (t = 0; t < nthreads; t++) {
+			pthread_join(tids[t], NULL);
+			merge(&res, &pa[t].res);
+		}
+		res.wall += now() - start;
+		for (t = 0; t < nthreads; t++) {
+			unlink_files(pa[t].dir, per, NULL);
+			rmdir(pa[t].dir);
+		}
+	}
+	free(pa);
+	free(tids);
+	report(&res);
+}
+
+/*
+ * Sequential whole-file writes and reads of maximum sized files
+ * and random single block reads and writes within them.
+ */
+
+void bench_data(void)
+{
+	struct result sw = { "seqwrite" }, sr = { "seqread" };
+	struct result rw = { "randwrite" }, rr = { "randread" };
+	char dir[1024], path[2048], buf[FILE_SIZE];
+	int nf = nfiles < 8 ? nfiles : 8;
+	uint64_t t, start;
+	int r, i, k, fd;
+	off_t off;
+
+	snprintf(dir, sizeof(dir), "%s/data", topdir);
+	make_dir(dir);
+	memset(buf, 0x5a, sizeof(buf));
+	srandom(1);
+	for (r = 0; r < rounds; r++) {
+		settle();
+		start = now();
+		for (i = 0; i < nf; i++) {
+			path_of(path, sizeof(path), dir, "f", i);
+			t = now();
+			fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+			if (fd < 0)
+				die("create", path);
+			if (write(fd, buf, FILE_SIZE) != FILE_SIZE)
+				die("write", path);
+			fsync(fd);
+			close(fd);
+			record(&sw, now() - t);
+			sw.bytes += FILE_SIZE;
+		}
+		sw.wall += now() - start;
+
+		settle();
+		start = now();
+		for (i = 0; i < nf; i++) {
+			path_of(path, sizeof(path), dir, "f", i);
+			t = now();
+			fd = open(path, O_RDONLY);
+			if (fd < 0)
+				die("open", path);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			if (read(fd, buf, FILE_SIZE) != FILE_SIZE)
+				die("read", path);
+			close(fd);
+			record(&sr, now() - t);
+			sr.bytes += FILE_SIZE;
+		}
+		sr.wall += now() - start;
+
+		for (k = 0; k < 2; k++) {
+			struct result *res = k ? &rr : &rw;
+
+			settle();
+			start = now();
+			for (i = 0; i < nf * UXFS_DIRECT_BLOCKS; i++) {
+				path_of(path, sizeof(path), dir, "f",
+					random() % nf);
+				off = (random() % UXFS_DIRECT_BLOCKS) *
+				    UXFS_BSIZE;
+				fd = open(path, k ? O_RDONLY : O_WRONLY);
+				if (fd < 0)
+					die("open", path);
+				t = now();
+				if ((k ? pread(fd, buf, UXFS_BSIZE, off) :
+				     pwrite(fd, buf, UXFS_BSIZE, off)) !=
+				    UXFS_BSIZE)
+					die(k ? "pread" : "pwrite", path);
+				if (!k)
+					fdatasync(fd);
+				record(res, now() - t);
+				res->bytes += UXFS_BSIZE;
+				close(fd);
+			}
+			res->wall += now() - start;
+		}
+		unlink_files(dir, nf, NULL);
+	}
+	rmdir(dir);
+	report(&sw);
+	report(&sr);
+	report(&rw);
+	report(&rr);
+}
+
+/*
+ * Full listings of, and stat() of every file in, a full directory.
+ */
+
+void bench_readdir_stat(void)
+{
+	struct result rd = { "readdir" }, st = { "stat" };
+	char dir[1024];
+	struct dirent *de;
+	uint64_t t, start;
+	DIR *d;
+	int r, n;
+
+	snprintf(dir, sizeof(dir), "%s/rd", topdir);
+	make_dir(dir);
+	create_files(dir, nfiles, NULL);
+	for (r = 0; r < rounds; r++) {
+		settle();
+		start = t = now();
+		d = opendir(dir);
+		if (!d)
+			die("opendir", dir);
+		for (n = 0; (de = readdir(d)) != NULL; n++) ;
+		closedir(d);
+		record(&rd, now() - t);
+		rd.wall += now() - start;
+		if (n < nfiles)
+			fprintf(stderr, "uxbench: readdir returned %d of %d "
+				"entries\n", n, nfiles);
+
+		settle();
+		stat_files(dir, "f", nfiles, 1, &st);
+	}
+	unlink_files(dir, nfiles, NULL);
+	rmdir(dir);
+	report(&rd);
+	report(&st);
+}
+
+/*
+ * Ways of duplicating a maximum sized file: through a user buffer,
+ * with sendfile(2) (splice_write), with the in-kernel copy ioctl
+ * and by sharing the blocks with FICLONE.
+ */
+
+void bench_copy(void)
+{
+	struct result res[4] = {
+		{ "copy_rw" }, { "copy_sendfile" }, { "copy_kernel" },
+		{ "copy_clone" }
+	};
+	struct uxfs_copy_range cr;
+	char dir[1024], src[2048], path[2048], buf[FILE_SIZE];
+	uint64_t t, start;
+	int r, k, sfd, fd;
+	off_t off;
+
+	snprintf(dir, sizeof(dir), "%s/copy", topdir);
+	make_dir(dir);
+	memset(buf, 0x5a, sizeof(buf));
+	path_of(src, sizeof(src), dir, "src", 0);
+	sfd = open(src, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (sfd < 0)
+		die("create", src);
+	if (write(sfd, buf, FILE_SIZE) != FILE_SIZE)
+		die("write", src);
+	fsync(sfd);
+	for (r = 0; r < rounds; r++) {
+		for (k = 0; k < 4; k++) {
+			path_of(path, sizeof(path), dir, "f", k);
+			settle();
+			start = t = now();
+			fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+			if (fd < 0)
+				die("create", path);
+			switch (k) {
+			case 0:
+				if (pread(sfd, buf, FILE_SIZE, 0) != FILE_SIZE ||
+				    write(fd, buf, FILE_SIZE) != FILE_SIZE)
+					die("copy", path);
+				break;
+			case 1:
+				off = 0;
+				if (sendfile(fd, sfd, &off, FILE_SIZE) !=
+				    FILE_SIZE)
+					die("sendfile", path);
+				break;
+			case 2:
+				memset(&cr, 0, sizeof(cr));
+				cr.src_fd = sfd;
+				if (ioctl(fd, UXFS_IOC_COPY_RANGE, &cr) !=
+				    FILE_SIZE)
+					die("UXFS_IOC_COPY_RANGE", path);
+				break;
+			case 3:
+				if (ioctl(fd, FICLONE, sfd) < 0)
+					die("FICLONE", path);
+				break;
+			}
+			fsync(fd);
+			close(fd);
+			record(&res[k], now() - t);
+			res[k].wall += now() - start;
+			res[k].bytes += FILE_SIZE;
+		}
+		unlink_files(dir, 4, NULL);
+	}
+	close(sfd);
+	unlink(src);
+	rmdir(dir);
+	for (k = 0; k < 4; k++)
+		report(&res[k]);
+}
+
+struct workload {
+	const char *name;
+	void (*fn)(void);
+} workloads[] = {
+	{ "namespace", bench_namespace },
+	{ "pcreate", bench_pcreate },
+	{ "data", bench_data },
+	{ "readdir", bench_readdir_stat },
+	{ "copy", bench_copy },
+	{ NULL, NULL }
+};
+
+void usage(void)
+{
+	int i;
+
+	fprintf(stderr, "usage: uxbench [-d] [-r rounds] [-n files] "
+		"[-t threads] [-w workload]... dir\n"
+		"  -d  drop caches between phases (needs root)\n"
+		"workloads:");
+	for (i = 0; workloads[i].name; i++)
+		fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only[16];
+	int nonly = 0, c, i, k;
+
+	while ((c = getopt(argc, argv, "dr:n:t:w:")) != -1) {
+		switch (c) {
+		case 'd':
+			drop = 1;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'w':
+			if (nonly == sizeof(only) / sizeof(only[0]))
+				usage();
+			only[nonly++] = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || rounds < 1 || nfiles < 1 || nthreads < 1)
+		usage();
+	topdir = argv[optind];
+
+	printf("# uxbench version=%d rounds=%d files=%d threads=%d "
+	       "drop_caches=%d\n", UXBENCH_VERSION, rounds, nfiles,
+	       nthreads, drop);
+	for (i = 0; workloads[i].name; i++) {
+		for (k = 0; k < nonly; k++) {
+			if (!strcmp(only[k], workloads[i].name))
+				break;
+		}
+		if (nonly && k == nonly)
+			continue;
+		workloads[i].fn();
+	}
+	return 0;
+}
@@ -0,0 +1,553 @@
+/*--------------------------------------------------------------*/
+/*-------------------------- uxreplay.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+/*
+ * Play back a trace of uxfs operations, as captured by capture.sh
+ * from the uxfs_op_* tracepoints, against a mounted uxfs filesystem
+ * as fast as it will go. Every operation is timed and the results
+ * are printed per operation type in the same key=value format as
+ * uxbench, followed by the layout the files ended up with.
+ *
+ * The trace names files by inode number and directories by inode
+ * number plus name; uxreplay keeps track of which path each traced
+ * inode ended up at. Files and directories that existed before the
+ * trace started are created the first time they're used, and a
+ * file that is read before it was written gets its data written
+ * first, outside the timed section. Operations on directories that
+ * were never looked up in the trace can't be placed and are
+ * skipped, so traces are best taken from a freshly mounted
+ * filesystem or with the caches dropped.
+ */
+
+#define _XOPEN_SOURCE 500
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <linux/types.h>
+#include "../kern/uxfs.h"
+
+enum op {
+	OP_CREATE,
+	OP_LOOKUP,
+	OP_UNLINK,
+	OP_MKDIR,
+	OP_RMDIR,
+	OP_READ,
+	OP_WRITE,
+	OP_NR
+};
+
+const char *op_names[OP_NR] = {
+	"create", "lookup", "unlink", "mkdir", "rmdir", "read", "write",
+};
+
+struct result {
+	unsigned long n;
+	unsigned long cap;
+	uint64_t *lat;		/* per operation latency, ns */
+	uint64_t wall;		/* time spent in timed sections, ns */
+	uint64_t bytes;
+};
+
+/*
+ * What we know about a traced inode.
+ */
+
+enum { N_UNKNOWN, N_FILE, N_DIR };
+
+struct node {
+	char *path;		/* relative to the top directory */
+	int type;
+	int present;		/* exists in the replay */
+	int fd;
+	off_t size;		/* bytes written by the replay */
+};
+
+char *topdir;
+struct node *nodes;
+unsigned long nnodes;
+struct result results[OP_NR];
+unsigned long events, replayed, skipped, failed, prefilled;
+char *iobuf;
+size_t iobuf_len;
+int dev_major = -1, dev_minor = -1;
+int verbose;
+
+uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *xalloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		fprintf(stderr, "uxreplay: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+void record(struct result *res, uint64_t ns)
+{
+	if (res->n == res->cap) {
+		res->cap = res->cap ? res->cap * 2 : 1024;
+		res->lat = xalloc(res->lat, res->cap * sizeof(uint64_t));
+	}
+	res->lat[res->n++] = ns;
+	res->wall += ns;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+double pct(struct result *res, double p)
+{
+	unsigned long i;
+
+	if (!res->n)
+		return 0.0;
+	i = (unsigned long)(p / 100.0 * (res->n - 1) + 0.5);
+	return res->lat[i] / 1000.0;
+}
+
+void report(const char *name, struct result *res)
+{
+	double secs = res->wall / 1e9;
+
+	qsort(res->lat, res->n, sizeof(uint64_t), cmp_u64);
+	printf("op=%s ops=%lu ops_per_sec=%.1f", name, res->n,
+	       secs > 0 ? res->n / secs : 0.0);
+	if (res->bytes)
+		printf(" mb_per_sec=%.2f",
+		       secs > 0 ? res->bytes / secs / (1 << 20) : 0.0);
+	printf(" p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f\n",
+	       pct(res, 50), pct(res, 90), pct(res, 99), pct(res, 100));
+	free(res->lat);
+}
+
+struct node *node_of(unsigned long ino)
+{
+	unsigned long n = nnodes;
+
+	if (ino >= nnodes) {
+		nnodes = ino + 64;
+		nodes = xalloc(nodes, nnodes * sizeof(*nodes));
+		memset(nodes + n, 0, (nnodes - n) * sizeof(*nodes));
+		for (; n < nnodes; n++)
+			nodes[n].fd = -1;
+	}
+	return &nodes[ino];
+}
+
+void node_forget(struct node *np)
+{
+	if (np->fd >= 0)
+		close(np->fd);
+	free(np->path);
+	memset(np, 0, sizeof(*np));
+	np->fd = -1;
+}
+
+/*
+ * Full path of "np", or of "name" in directory "np" if name is
+ * given.
+ */
+
+void full_path(char *buf, size_t len, struct node *np, const char *name)
+{
+	snprintf(buf, len, "%s%s%s%s%s", topdir, *np->path ? "/" : "",
+		 np->path, name ? "/" : "", name ? name : "");
+}
+
+/*
+ * Make sure "np" exists in the replay, as a "type" if we didn't
+ * know yet what it is, along with any directories above it that
+ * were never used themselves. Returns -1 if it can't be made.
+ */
+
+int materialize(struct node *np, int type)
+{
+	char path[4096], *p;
+	int fd;
+
+	if (!np->path)
+		return -1;
+	if (np->type == N_UNKNOWN)
+		np->type = type;
+	if (np->present)
+		return 0;
+	full_path(path, sizeof(path), np, NULL);
+	for (p = path + strlen(topdir) + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (np->type == N_DIR) {
+		if (mkdir(path, 0755) < 0 && errno != EEXIST)
+			return -1;
+	} else {
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			return -1;
+		close(fd);
+	}
+	np->present = 1;
+	return 0;
+}
+
+char *path_join(struct node *dp, const char *name)
+{
+	char *p;
+
+	p = xalloc(NULL, strlen(dp->path) + strlen(name) + 2);
+	sprintf(p, "%s%s%s", dp->path, *dp->path ? "/" : "", name);
+	return p;
+}
+
+int file_fd(struct node *np)
+{
+	char path[4096];
+
+	if (np->fd < 0) {
+		full_path(path, sizeof(path), np, NULL);
+		np->fd = open(path, O_RDWR);
+	}
+	return np->fd;
+}
+
+void grow_iobuf(size_t len)
+{
+	if (len <= iobuf_len)
+		return;
+	iobuf = xalloc(iobuf, len);
+	memset(iobuf + iobuf_len, 'u', len - iobuf_len);
+	iobuf_len = len;
+}
+
+/*
+ * Replay one operation on the name "name" in directory "dir".
+ */
+
+void replay_name(enum op op, unsigned long dir, const char *name, long ret)
+{
+	struct node *dp, *np = NULL;
+	char path[4096];
+	struct stat st;
+	uint64_t start, ns;
+	int fd, error;
+
+	/*
+	 * node_of() may move the table, look the directory up last.
+	 */
+
+	if (ret > 0)
+		node_of(ret);
+	dp = node_of(dir);
+	if (ret > 0)
+		np = &nodes[ret];
+	if (ret < 0 || materialize(dp, N_DIR) < 0) {
+		skipped++;
+		return;
+	}
+	full_path(path, sizeof(path), dp, name);
+	if ((op == OP_UNLINK || op == OP_RMDIR) && np)
+		materialize(np, op == OP_RMDIR ? N_DIR : N_FILE);
+
+	start = now();
+	switch (op) {
+	case OP_CREATE:
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		error = fd < 0;
+		ns = now() - start;
+		if (fd >= 0)
+			close(fd);
+		break;
+	case OP_MKDIR:
+		error = mkdir(path, 0755) < 0;
+		ns = now() - start;
+		break;
+	case OP_LOOKUP:
+		error = lstat(path, &st) < 0 && errno != ENOENT;
+		ns = now() - start;
+		break;
+	case OP_UNLINK:
+		error = unlink(path) < 0;
+		ns = now() - start;
+		break;
+	case OP_RMDIR:
+		error = rmdir(path) < 0;
+		ns = now() - start;
+		break;
+	default:
+		return;
+	}
+
+	/*
+	 * A lookup of something the replay hasn't got yet names an
+	 * inode that existed before the trace; it is made once we
+	 * know what it is.
+	 */
+
+	if (op == OP_LOOKUP && np && !np->path) {
+		np->path = path_join(dp, name);
+		np->present = 0;
+	}
+	if (error && op != OP_LOOKUP) {
+		if (verbose)
+			fprintf(stderr, "uxreplay: %s %s: %s\n", op_names[op],
+				path, strerror(errno));
+		failed++;
+		return;
+	}
+	record(&results[op], ns);
+	replayed++;
+
+	switch (op) {
+	case OP_CREATE:
+	case OP_MKDIR:
+		node_forget(np);
+		np->path = path_join(dp, name);
+		np->type = op == OP_MKDIR ? N_DIR : N_FILE;
+		np->present = 1;
+		break;
+	case OP_UNLINK:
+	case OP_RMDIR:
+		node_forget(np);
+		break;
+	default:
+		break;
+	}
+}
+
+void replay_rw(enum op op, unsigned long ino, off_t pos, size_t len,
+	       ssize_t ret)
+{
+	struct node *np = node_of(ino);
+	uint64_t start, ns;
+	ssize_t n;
+	int fd;
+
+	if (ret <= 0 || materialize(np, N_FILE) < 0 || np->type != N_FILE ||
+	    (fd = file_fd(np)) < 0) {
+		skipped++;
+		return;
+	}
+	grow_iobuf(len);
+
+	/*
+	 * Data the traced file had before the trace started.
+	 */
+
+	if (op == OP_READ && np->size < pos + ret) {
+		if (pwrite(fd, iobuf, pos + ret - np->size, np->size) > 0)
+			prefilled += pos + ret - np->size;
+		np->size = pos + ret;
+	}
+
+	start = now();
+	if (op == OP_READ)
+		n = pread(fd, iobuf, len, pos);
+	else
+		n = pwrite(fd, iobuf, ret, pos);
+	ns = now() - start;
+	if (n < 0) {
+		if (verbose)
+			fprintf(stderr, "uxreplay: %s %s: %s\n", op_names[op],
+				np->path, strerror(errno));
+		failed++;
+		return;
+	}
+	if (op == OP_WRITE && pos + n > np->size)
+		np->size = pos + n;
+	record(&results[op], ns);
+	results[op].bytes += n;
+	replayed++;
+}
+
+/*
+ * Parse one line of trace output, as in
+ *
+ *   cp-1234 [001] .... 12.345: uxfs_op_create: dev 7,0 dir 2 name a ret 5
+ *   cp-1234 [001] .... 12.346: uxfs_op_write: dev 7,0 ino 5 pos 0 len 4096 ret 4096
+ */
+
+void replay_line(char *line)
+{
+	char *p, *ev, *name, *r;
+	unsigned long dir, ino;
+	long long pos;
+	size_t len;
+	long ret;
+	int maj, min, off, i;
+
+	p = strstr(line, "uxfs_op_");
+	if (!p)
+		return;
+	ev = p + strlen("uxfs_op_");
+	p = strchr(ev, ':');
+	if (!p)
+		return;
+	*p++ = '\0';
+	for (i = 0; i < OP_NR && strcmp(ev, op_names[i]); i++)
+		;
+	if (i == OP_NR || sscanf(p, " dev %d,%d %n", &maj, &min, &off) != 2)
+		return;
+	if (dev_major < 0) {
+		dev_major = maj;
+		dev_minor = min;
+	}
+	if (maj != dev_major || min != dev_minor)
+		return;
+	events++;
+	p += off;
+
+	if (i == OP_READ || i == OP_WRITE) {
+		if (sscanf(p, "ino %lu pos %lld len %zu ret %ld", &ino, &pos,
+			   &len, &ret) != 4) {
+			skipped++;
+			return;
+		}
+		replay_rw(i, ino, pos, len, ret);
+		return;
+	}
+
+	/*
+	 * Names can hold spaces, the last " ret " ends one.
+	 */
+
+	if (sscanf(p, "dir %lu name %n", &dir, &off) != 1) {
+		skipped++;
+		return;
+	}
+	name = p + off;
+	for (r = NULL, p = name; (p = strstr(p, " ret ")); p++)
+		r = p;
+	if (!r || sscanf(r, " ret %ld", &ret) != 1) {
+		skipped++;
+		return;
+	}
+	*r = '\0';
+	replay_name(i, dir, name, ret);
+}
+
+/*
+ * Layout of the files the replay left behind.
+ */
+
+unsigned long l_files, l_blocks, l_extents, l_fragmented, l_shared;
+
+int layout_one(const char *path, const struct stat *st, int type,
+	       struct FTW *ftw)
+{
+	struct uxfs_frag f;
+	int fd;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (ioctl(fd, UXFS_IOC_GETFRAG, &f) == 0) {
+		l_files++;
+		l_blocks += f.f_blocks;
+		l_extents += f.f_extents;
+		l_shared += f.f_shared;
+		if (f.f_extents > 1)
+			l_fragmented++;
+	}
+	close(fd);
+	return 0;
+}
+
+void usage(void)
+{
+	fprintf(stderr, "usage: uxreplay [-v] [-D major,minor] trace dir\n"
+		"  -v  report operations that fail in the replay\n"
+		"  -D  replay the events of this device (default the "
+		"first one in the trace)\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct statvfs sv;
+	char line[8192];
+	uint64_t start;
+	unsigned long i;
+	FILE *fp;
+	int c;
+
+	while ((c = getopt(argc, argv, "vD:")) != -1) {
+		switch (c) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'D':
+			if (sscanf(optarg, "%d,%d", &dev_major,
+				   &dev_minor) != 2)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 2)
+		usage();
+	topdir = argv[optind + 1];
+	fp = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+	if (!fp) {
+		fprintf(stderr, "uxreplay: %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+
+	node_of(UXFS_ROOT_INO)->path = strdup("");
+	node_of(UXFS_ROOT_INO)->type = N_DIR;
+	node_of(UXFS_ROOT_INO)->present = 1;
+
+	start = now();
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		replay_line(line);
+	}
+	for (i = 0; i < nnodes; i++)
+		node_forget(&nodes[i]);
+	sync();
+
+	printf("# uxreplay trace=%s events=%lu replayed=%lu skipped=%lu "
+	       "failed=%lu prefill_bytes=%lu elapsed_ms=%.1f\n",
+	       argv[optind], events, replayed, skipped, failed, prefilled,
+	       (now() - start) / 1e6);
+	for (i = 0; i < OP_NR; i++)
+		if (results[i].n)
+			report(op_names[i], &results[i]);
+
+	nftw(topdir, layout_one, 16, FTW_PHYS | FTW_MOUNT);
+	printf("layout files=%lu blocks=%lu extents=%lu fragmented=%lu "
+	       "shared=%lu", l_files, l_blocks, l_extents, l_fragmented,
+	       l_shared);
+	if (statvfs(topdir, &sv) == 0)
+		printf(" free_blocks=%lu", (unsigned long)sv.f_bfree);
+	printf("\n");
+	return 0;
+}
@@ -7,14 +7,49 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <time.h>
 #include <linux/fs.h>
 #include <linux/types.h>
 #include "../kern/uxfs.h"
 
+/*
+ * Output formats. FMT_TEXT is the original human readable output,
+ * the others are meant to be consumed by scripts. JSON output is
+ * one object per command (JSON lines), CSV output is a header line
+ * followed by one row per record.
+ */
+
+#define FMT_TEXT	0
+#define FMT_JSON	1
+#define FMT_CSV		2
+
+/*
+ * Number of buckets in the free extent and fan-out histograms.
+ * Bucket n counts values in [2^n, 2^(n+1)).
+ */
+
+#define HIST_BUCKETS	10
+
+#define IMAGE_BLOCKS	(UXFS_FIRST_DATA_BLOCK + uxfs_nblocks(&sb))
+
 struct uxfs_superblock sb;
+struct uxfs_devtab devtab;	/* d_ndevs is 1 without one */
+char bmap[UXFS_MAXBLOCKS];	/* the block map, wherever it is kept */
 int devfd;
+int fmt = FMT_TEXT;
+
+/*
+ * Everything the whole-image reports need, gathered by a single
+ * sequential pass over the image (see scan_image()).
+ */
+
+struct image {
+	struct uxfs_inode inodes[UXFS_MAXFILES];
+	char *dirblk[UXFS_MAXBLOCKS];	/* contents of directory blocks */
+	int isdir[UXFS_MAXBLOCKS];	/* data block belongs to a directory */
+};
 
 void print_inode(int inum, struct uxfs_inode *uip)
 {
@@ -35,6 +70,8 @@ void print_inode(int inum, struct uxfs_inode *uip)
 	printf("  i_uid      = %d\n", uip->i_uid);
 	printf("  i_gid      = %d\n", uip->i_gid);
 	printf("  i_size     = %d\n", uip->i_size);
+	printf("  i_flags    = %x%s\n", uip->i_flags,
+	       (uip->i_flags & UXFS_COMPR_FL) ? " (compressed)" : "");
 	printf("  i_blocks   = %d", uip->i_blocks);
 	for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
 		if (i % 4 == 0)
@@ -53,7 +90,7 @@ void print_inode(int inum, struct uxfs_inode *uip)
 			      SEEK_SET);
 			read(devfd, buf, UXFS_BSIZE);
 			dirent = (struct uxfs_dirent *)buf;
-			for (x = 0; x < UXFS_DIRECT_BLOCKS; x++) {
+			for (x = 0; x < UXFS_DIRS_PER_BLOCK; x++) {
 				if (dirent->d_ino != 0) {
 					printf("    inum[%2d],"
 					       "name[%s]\n",
@@ -70,7 +107,7 @@ void print_inode(int inum, struct uxfs_inode *uip)
 
 int read_inode(ino_t inum, struct uxfs_inode *uip)
 {
-	if (sb.s_inode[inum] == UXFS_INODE_FREE) {
+	if (sb.s_inode[inum] == UXFS_INODE_FREE && fmt == FMT_TEXT) {
 		printf("WARNING: INODE LISTED AS FREE IN SB\n");
 	}
 	lseek(devfd, (UXFS_INODE_BLOCK * UXFS_BSIZE) + (inum * UXFS_BSIZE),
@@ -80,16 +117,684 @@ int read_inode(ino_t inum, struct uxfs_inode *uip)
 	return 0;
 }
 
-int main(int argc, char **argv)
+/*
+ * Print a directory entry name as a JSON string or CSV field.
+ * Names are at most UXFS_NAMELEN bytes and need not be terminated.
+ */
+
+void print_name(const char *name)
+{
+	int i;
+
+	putchar('"');
+	for (i = 0; i < UXFS_NAMELEN && name[i]; i++) {
+		unsigned char c = name[i];
+
+		if (c == '"')
+			printf(fmt == FMT_JSON ? "\\\"" : "\"\"");
+		else if (c == '\\' && fmt == FMT_JSON)
+			printf("\\\\");
+		else if (c < 0x20 || c >= 0x7f)
+			printf(fmt == FMT_JSON ? "\\u%04x" : "?", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+int inode_is_valid(ino_t inum)
+{
+	return inum >= UXFS_ROOT_INO && inum < UXFS_MAXFILES;
+}
+
+/*
+ * Number of contiguous runs in the block list of an inode, counted
+ * the way the kernel does for UXFS_IOC_GETFRAG. Files may have holes
+ * (compressed ones always do); a hole doesn't end a run.
+ */
+
+int inode_extents(struct uxfs_inode *uip)
+{
+	__u32 prev = 0;
+	int i, n = 0;
+
+	for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
+		if (uip->i_addr[i] == 0)
+			continue;
+		if (uip->i_addr[i] != prev + 1)
+			n++;
+		prev = uip->i_addr[i];
+	}
+	return n;
+}
+
+/*
+ * Fragmentation score of a file: 0.0 if all of its blocks are
+ * contiguous, 1.0 if no two logically adjacent blocks are
+ * physically adjacent.
+ */
+
+double frag_score(struct uxfs_inode *uip)
+{
+	int nblocks = uip->i_blocks;
+
+	if (nblocks > UXFS_DIRECT_BLOCKS)
+		nblocks = UXFS_DIRECT_BLOCKS;
+	if (nblocks < 2)
+		return 0.0;
+	return (double)(inode_extents(uip) - 1) / (nblocks - 1);
+}
+
+int hist_bucket(int val)
+{
+	int b = 0;
+
+	while (val > 1 && b < HIST_BUCKETS - 1) {
+		val >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/*
+ * Volumes made before the block map had blocks of its own keep it
+ * in the superblock.
+ */
+
+void read_bmap(void)
+{
+	int r;
+
+	if (uxfs_inline_map(&sb)) {
+		memcpy(bmap, sb.s_block, UXFS_MAXBLOCKS);
+		return;
+	}
+	for (r = 0; r < UXFS_NREGIONS; r++) {
+		lseek(devfd, (UXFS_MAP_BLOCK + r) * UXFS_BSIZE, SEEK_SET);
+		read(devfd, bmap + r * UXFS_REGION_BLOCKS,
+		     r < UXFS_NREGIONS - 1 ? UXFS_REGION_BLOCKS :
+		     UXFS_MAXBLOCKS - r * UXFS_REGION_BLOCKS);
+	}
+}
+
+void cmd_super(void)
+{
+	int i;
+
+	switch (fmt) {
+	case FMT_JSON:
+		printf("{\"cmd\":\"super\",\"magic\":%u,\"clean\":%s,"
+		       "\"nifree\":%u,\"nbfree\":%u,\"nblocks\":%u,"
+		       "\"ndevs\":%u,\"stripe\":%u}\n", sb.s_magic,
+		       (sb.s_mod == UXFS_FSCLEAN) ? "true" : "false",
+		       sb.s_nifree, sb.s_nbfree, uxfs_nblocks(&sb),
+		       devtab.d_ndevs, devtab.d_stripe);
+		break;
+	case FMT_CSV:
+		printf("magic,clean,nifree,nbfree,nblocks,ndevs,stripe\n");
+		printf("%u,%d,%u,%u,%u,%u,%u\n", sb.s_magic,
+		       sb.s_mod == UXFS_FSCLEAN, sb.s_nifree, sb.s_nbfree,
+		       uxfs_nblocks(&sb), devtab.d_ndevs, devtab.d_stripe);
+		break;
+	default:
+		printf("\nSuperblock contents:\n");
+		printf("  s_magic   = 0x%x\n", sb.s_magic);
+		printf("  s_mod     = %s\n",
+		       (sb.s_mod == UXFS_FSCLEAN) ?
+		       "UXFS_FSCLEAN" : "UXFS_FSDIRTY");
+		printf("  s_nifree  = %d\n", sb.s_nifree);
+		printf("  s_nbfree  = %d\n", sb.s_nbfree);
+		printf("  s_nblocks = %d\n", uxfs_nblocks(&sb));
+		if (!uxfs_inline_map(&sb)) {
+			printf("  free by region =");
+			for (i = 0; i < UXFS_NREGIONS; i++)
+				printf(" %u", uxfs_mapsum(&sb)->m_free[i]);
+			printf("\n");
+		}
+		if (devtab.d_ndevs > 1) {
+			printf("  striped over %u devices, %u blocks per "
+			       "unit:\n", devtab.d_ndevs, devtab.d_stripe);
+			for (i = 0; i < devtab.d_ndevs; i++)
+				printf("    %d %.*s\n", i, UXFS_DEVNAMELEN,
+				       devtab.d_names[i]);
+		}
+		printf("\n");
+	}
+}
+
+void print_inode_record(ino_t inum, struct uxfs_inode *uip, int first)
+{
+	int i;
+
+	if (fmt == FMT_JSON) {
+		printf("%s{\"ino\":%lu,\"inuse\":%s,\"mode\":%u,"
+		       "\"nlink\":%u,\"uid\":%u,\"gid\":%u,\"size\":%u,"
+		       "\"atime\":%u,\"mtime\":%u,\"ctime\":%u,"
+		       "\"flags\":%u,\"blocks\":%u,\"addr\":[",
+		       first ? "" : ",",
+		       (unsigned long)inum,
+		       sb.s_inode[inum] == UXFS_INODE_FREE ? "false" : "true",
+		       uip->i_mode, uip->i_nlink, uip->i_uid, uip->i_gid,
+		       uip->i_size, uip->i_atime, uip->i_mtime,
+		       uip->i_ctime, uip->i_flags, uip->i_blocks);
+		for (i = 0; i < UXFS_DIRECT_BLOCKS; i++)
+			printf("%s%u", i ? "," : "", uip->i_addr[i]);
+		printf("]}");
+		return;
+	}
+	if (first)
+		printf("ino,inuse,mode,nlink,uid,gid,size,atime,mtime,"
+		       "ctime,flags,blocks,addr\n");
+	printf("%lu,%d,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,",
+	       (unsigned long)inum, sb.s_inode[inum] != UXFS_INODE_FREE,
+	       uip->i_mode, uip->i_nlink, uip->i_uid, uip->i_gid,
+	       uip->i_size, uip->i_atime, uip->i_mtime, uip->i_ctime,
+	       uip->i_flags, uip->i_blocks);
+	for (i = 0; i < UXFS_DIRECT_BLOCKS; i++)
+		printf("%s%u", i ? " " : "", uip->i_addr[i]);
+	printf("\n");
+}
+
+void cmd_inode(ino_t inum)
 {
 	struct uxfs_inode inode;
+
+	if (!inode_is_valid(inum)) {
+		fprintf(stderr, "fsdb: bad inode number %lu\n",
+			(unsigned long)inum);
+		return;
+	}
+	read_inode(inum, &inode);
+	if (fmt == FMT_TEXT) {
+		print_inode(inum, &inode);
+		return;
+	}
+	if (fmt == FMT_JSON)
+		printf("{\"cmd\":\"inode\",\"inode\":");
+	print_inode_record(inum, &inode, 1);
+	if (fmt == FMT_JSON)
+		printf("}\n");
+}
+
+void cmd_block(int bno)
+{
+	char dataText[UXFS_BSIZE + 1];
+	int i;
+
+	if (bno < 0 || bno >= IMAGE_BLOCKS) {
+		fprintf(stderr, "fsdb: bad block number %d\n", bno);
+		return;
+	}
+	lseek(devfd, bno * UXFS_BSIZE, SEEK_SET);
+	memset(dataText, 0, sizeof(dataText));
+	read(devfd, &dataText, UXFS_BSIZE);
+	if (fmt == FMT_TEXT) {
+		printf("block number requested: %d\n", bno);
+		if (!dataText[0])
+			printf("Data block empty\n");
+		else
+			printf("Data: \n %s \n", dataText);
+		return;
+	}
+
+	/*
+	 * Machine readable block dumps are always hex so that binary
+	 * blocks survive the trip.
+	 */
+
+	if (fmt == FMT_JSON)
+		printf("{\"cmd\":\"block\",\"block\":%d,\"data\":\"", bno);
+	else
+		printf("block,data\n%d,", bno);
+	for (i = 0; i < UXFS_BSIZE; i++)
+		printf("%02x", (unsigned char)dataText[i]);
+	printf(fmt == FMT_JSON ? "\"}\n" : "\n");
+}
+
+void mark_dir_blocks(struct image *img, int ino)
+{
+	struct uxfs_inode *uip = &img->inodes[ino];
+	int i, blk;
+
+	if (sb.s_inode[ino] == UXFS_INODE_FREE || !S_ISDIR(uip->i_mode))
+		return;
+	for (i = 0; i < uip->i_blocks && i < UXFS_DIRECT_BLOCKS; i++) {
+		blk = uip->i_addr[i] - UXFS_FIRST_DATA_BLOCK;
+		if (blk >= 0 && blk < UXFS_MAXBLOCKS)
+			img->isdir[blk] = 1;
+	}
+}
+
+/*
+ * Read the whole image front to back in large chunks. The inode
+ * table precedes the data area, so by the time data blocks stream
+ * past we already know which of them belong to directories and
+ * only those are kept. Nothing else is read again afterwards.
+ */
+
+int scan_image(struct image *img)
+{
+	static char chunk[64 * UXFS_BSIZE];
+	int bno = 0, n, i, ino, blk;
+
+	memset(img, 0, sizeof(*img));
+	lseek(devfd, 0, SEEK_SET);
+	while (bno < IMAGE_BLOCKS) {
+		n = IMAGE_BLOCKS - bno;
+		if (n > 64)
+			n = 64;
+		n = read(devfd, chunk, n * UXFS_BSIZE) / UXFS_BSIZE;
+		if (n <= 0)
+			break;
+		for (i = 0; i < n; i++, bno++) {
+			char *b = chunk + i * UXFS_BSIZE;
+
+			ino = bno - UXFS_INODE_BLOCK;
+			if (ino >= 0 && ino < UXFS_MAXFILES) {
+				if (sb.s_inode[ino] == UXFS_INODE_FREE)
+					continue;
+				memcpy(&img->inodes[ino], b,
+				       sizeof(struct uxfs_inode));
+				continue;
+			}
+			if (bno == UXFS_FIRST_DATA_BLOCK) {
+				for (ino = UXFS_ROOT_INO;
+				     ino < UXFS_MAXFILES; ino++)
+					mark_dir_blocks(img, ino);
+			}
+			blk = bno - UXFS_FIRST_DATA_BLOCK;
+			if (blk >= 0 && img->isdir[blk]) {
+				img->dirblk[blk] = malloc(UXFS_BSIZE);
+				memcpy(img->dirblk[blk], b, UXFS_BSIZE);
+			}
+		}
+	}
+	return bno == IMAGE_BLOCKS ? 0 : -1;
+}
+
+void free_image(struct image *img)
+{
+	int i;
+
+	for (i = 0; i < UXFS_MAXBLOCKS; i++)
+		free(img->dirblk[i]);
+}
+
+/*
+ * Return the n'th directory entry of a directory, or NULL once
+ * its blocks are exhausted.
+ */
+
+struct uxfs_dirent *dir_entry(struct image *img, struct uxfs_inode *dip,
+			      int n)
+{
+	int i = n / UXFS_DIRS_PER_BLOCK, blk;
+
+	if (i >= dip->i_blocks || i >= UXFS_DIRECT_BLOCKS)
+		return NULL;
+	blk = dip->i_addr[i] - UXFS_FIRST_DATA_BLOCK;
+	if (blk < 0 || blk >= UXFS_MAXBLOCKS || !img->dirblk[blk])
+		return NULL;
+	return (struct uxfs_dirent *)img->dirblk[blk] +
+	    n % UXFS_DIRS_PER_BLOCK;
+}
+
+void report_dump(struct image *img)
+{
+	int ino, first = 1;
+
+	if (fmt == FMT_JSON)
+		printf("{\"cmd\":\"dump\",\"inodes\":[");
+	for (ino = UXFS_ROOT_INO; ino < UXFS_MAXFILES; ino++) {
+		if (sb.s_inode[ino] == UXFS_INODE_FREE)
+			continue;
+		if (fmt == FMT_TEXT)
+			print_inode(ino, &img->inodes[ino]);
+		else
+			print_inode_record(ino, &img->inodes[ino], first);
+		first = 0;
+	}
+	if (fmt == FMT_JSON)
+		printf("]}\n");
+}
+
+int tree_first;
+
+void walk_tree(struct image *img, int ino, const char *path, int depth,
+	       char *seen)
+{
+	struct uxfs_inode *dip = &img->inodes[ino];
+	struct uxfs_dirent *de;
+	char cpath[1024];
+	int n, cino;
+
+	if (seen[ino] || depth > UXFS_MAXFILES)
+		return;
+	seen[ino] = 1;
+	for (n = 0; (de = dir_entry(img, dip, n)) != NULL; n++) {
+		cino = de->d_ino;
+		if (cino == 0 || !strcmp(de->d_name, ".") ||
+		    !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(cpath, sizeof(cpath), "%s/%.*s",
+			 depth ? path : "", UXFS_NAMELEN, de->d_name);
+		if (!inode_is_valid(cino)) {
+			fprintf(stderr, "fsdb: %s: bad inode %d\n",
+				cpath, cino);
+			continue;
+		}
+		switch (fmt) {
+		case FMT_JSON:
+			printf("%s{\"path\":", tree_first ? "" : ",");
+			print_name(cpath);
+			printf(",\"ino\":%d,\"type\":\"%s\",\"size\":%u}",
+			       cino, S_ISDIR(img->inodes[cino].i_mode) ?
+			       "dir" : "file", img->inodes[cino].i_size);
+			break;
+		case FMT_CSV:
+			if (tree_first)
+				printf("path,ino,type,size\n");
+			print_name(cpath);
+			printf(",%d,%s,%u\n", cino,
+			       S_ISDIR(img->inodes[cino].i_mode) ?
+			       "dir" : "file", img->inodes[cino].i_size);
+			break;
+		default:
+			printf("%6d %c %8u %s\n", cino,
+			       S_ISDIR(img->inodes[cino].i_mode) ? 'd' : '-',
+			       img->inodes[cino].i_size, cpath);
+		}
+		tree_first = 0;
+		if (S_ISDIR(img->inodes[cino].i_mode))
+			walk_tree(img, cino, cpath, depth + 1, seen);
+	}
+}
+
+void report_tree(struct image *img)
+{
+	char seen[UXFS_MAXFILES];
+
+	memset(seen, 0, sizeof(seen));
+	tree_first = 1;
+	if (fmt == FMT_JSON)
+		printf("{\"cmd\":\"tree\",\"entries\":[");
+	walk_tree(img, UXFS_ROOT_INO, "", 0, seen);
+	if (fmt == FMT_JSON)
+		printf("]}\n");
+}
+
+void print_hist(const char *cmd, const char *what, int *hist)
+{
+	int b;
+
+	if (fmt == FMT_JSON) {
+		printf("\"%s\":[", what);
+		for (b = 0; b < HIST_BUCKETS; b++)
+			printf("%s{\"min\":%d,\"count\":%d}", b ? "," : "",
+			       1 << b, hist[b]);
+		printf("]");
+		return;
+	}
+	if (fmt == FMT_CSV) {
+		printf("report,bucket_min,count\n");
+		for (b = 0; b < HIST_BUCKETS; b++)
+			printf("%s,%d,%d\n", cmd, 1 << b, hist[b]);
+		return;
+	}
+	printf("  %s:\n", what);
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		if (hist[b])
+			printf("    %5d+ : %d\n", 1 << b, hist[b]);
+	}
+}
+
+/*
+ * Histogram of free extent lengths, straight from the block map, plus the number of blocks shared between files.
+ */
+
+void report_free(struct image *img)
+{
+	int hist[HIST_BUCKETS], i, run = 0, nruns = 0, largest = 0;
+	int shared = 0, n = uxfs_nblocks(&sb);
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i <= n; i++) {
+		if (i < n && bmap[i] > UXFS_BLOCK_INUSE)
+			shared++;
+		if (i < n && bmap[i] == UXFS_BLOCK_FREE) {
+			run++;
+			continue;
+		}
+		if (run) {
+			hist[hist_bucket(run)]++;
+			nruns++;
+			if (run > largest)
+				largest = run;
+		}
+		run = 0;
+	}
+	switch (fmt) {
+	case FMT_JSON:
+		printf("{\"cmd\":\"free\",\"nbfree\":%u,\"extents\":%d,"
+		       "\"largest\":%d,\"shared\":%d,", sb.s_nbfree, nruns,
+		       largest, shared);
+		print_hist("free", "histogram", hist);
+		printf("}\n");
+		break;
+	case FMT_CSV:
+		print_hist("free", "histogram", hist);
+		break;
+	default:
+		printf("\nFree space: %u blocks in %d extents, "
+		       "largest %d\n", sb.s_nbfree, nruns, largest);
+		printf("Shared blocks: %d\n", shared);
+		print_hist("free", "extent length histogram", hist);
+		printf("\n");
+	}
+}
+
+void report_frag(struct image *img)
+{
+	struct uxfs_inode *uip;
+	int ino, first = 1, nfiles = 0, nblocks = 0, nextents = 0;
+
+	if (fmt == FMT_JSON)
+		printf("{\"cmd\":\"frag\",\"files\":[");
+	else if (fmt == FMT_CSV)
+		printf("ino,blocks,extents,score\n");
+	else
+		printf("\n  ino blocks extents score\n");
+	for (ino = UXFS_ROOT_INO; ino < UXFS_MAXFILES; ino++) {
+		uip = &img->inodes[ino];
+		if (sb.s_inode[ino] == UXFS_INODE_FREE || !uip->i_blocks)
+			continue;
+		nfiles++;
+		nblocks += uip->i_blocks;
+		nextents += inode_extents(uip);
+		if (fmt == FMT_JSON)
+			printf("%s{\"ino\":%d,\"blocks\":%u,\"extents\":%d,"
+			       "\"score\":%.3f}", first ? "" : ",", ino,
+			       uip->i_blocks, inode_extents(uip),
+			       frag_score(uip));
+		else
+			printf(fmt == FMT_CSV ? "%d,%u,%d,%.3f\n" :
+			       "%5d %6u %7d %.3f\n", ino, uip->i_blocks,
+			       inode_extents(uip), frag_score(uip));
+		first = 0;
+	}
+	if (fmt == FMT_JSON)
+		printf("],\"nfiles\":%d,\"blocks\":%d,\"extents\":%d}\n",
+		       nfiles, nblocks, nextents);
+	else if (fmt == FMT_TEXT)
+		printf("  %d files, %d blocks in %d extents\n\n",
+		       nfiles, nblocks, nextents);
+}
+
+/*
+ * Directory fan-out: live entries (excluding "." and "..") and
+ * slot occupancy of each directory.
+ */
+
+void report_fanout(struct image *img)
+{
+	struct uxfs_dirent *de;
+	int hist[HIST_BUCKETS], ino, n, live, slots, first = 1;
+	int ndirs = 0, total = 0, max = 0;
+
+	memset(hist, 0, sizeof(hist));
+	if (fmt == FMT_JSON)
+		printf("{\"cmd\":\"fanout\",\"dirs\":[");
+	else if (fmt == FMT_CSV)
+		printf("ino,entries,slots,blocks\n");
+	else
+		printf("\n  ino entries slots blocks\n");
+	for (ino = UXFS_ROOT_INO; ino < UXFS_MAXFILES; ino++) {
+		if (sb.s_inode[ino] == UXFS_INODE_FREE ||
+		    !S_ISDIR(img->inodes[ino].i_mode))
+			continue;
+		live = slots = 0;
+		for (n = 0; (de = dir_entry(img, &img->inodes[ino], n));
+		     n++) {
+			slots++;
+			if (de->d_ino && strcmp(de->d_name, ".") &&
+			    strcmp(de->d_name, ".."))
+				live++;
+		}
+		ndirs++;
+		total += live;
+		if (live > max)
+			max = live;
+		hist[hist_bucket(live ? live : 1)]++;
+		if (fmt == FMT_JSON)
+			printf("%s{\"ino\":%d,\"entries\":%d,\"slots\":%d,"
+			       "\"blocks\":%u}", first ? "" : ",", ino, live,
+			       slots, img->inodes[ino].i_blocks);
+		else
+			printf(fmt == FMT_CSV ? "%d,%d,%d,%u\n" :
+			       "%5d %7d %5d %6u\n", ino, live, slots,
+			       img->inodes[ino].i_blocks);
+		first = 0;
+	}
+	if (fmt == FMT_JSON) {
+		printf("],\"ndirs\":%d,\"max\":%d,\"mean\":%.2f,", ndirs,
+		       max, ndirs ? (double)total / ndirs : 0.0);
+		print_hist("fanout", "histogram", hist);
+		printf("}\n");
+	} else if (fmt == FMT_TEXT) {
+		printf("  %d directories, max %d, mean %.2f entries\n",
+		       ndirs, max, ndirs ? (double)total / ndirs : 0.0);
+		print_hist("fanout", "fan-out histogram", hist);
+		printf("\n");
+	}
+}
+
+/*
+ * Run one of the whole-image reports. "report" runs all of them
+ * off the same scan.
+ */
+
+void cmd_report(const char *cmd)
+{
+	static struct image img;
+	int all = !strcmp(cmd, "report");
+
+	if (scan_image(&img) < 0)
+		fprintf(stderr, "fsdb: warning: short image\n");
+	if (all || !strcmp(cmd, "dump"))
+		report_dump(&img);
+	if (all || !strcmp(cmd, "tree"))
+		report_tree(&img);
+	if (all || !strcmp(cmd, "free"))
+		report_free(&img);
+	if (all || !strcmp(cmd, "frag"))
+		report_frag(&img);
+	if (all || !strcmp(cmd, "fanout"))
+		report_fanout(&img);
+	free_image(&img);
+}
+
+/*
+ * Execute a single command. Returns 1 if the command asked us to
+ * quit, -1 if it was not understood.
+ */
+
+int run_command(char *command)
+{
+	static const char *reports[] = {
+		"dump", "tree", "free", "frag", "fanout", "report", NULL
+	};
+	int i;
+
+	for (i = 0; reports[i]; i++) {
+		if (!strcmp(command, reports[i])) {
+			cmd_report(command);
+			return 0;
+		}
+	}
+	switch (command[0]) {
+	case 'q':
+		return 1;
+	case 'i':
+		cmd_inode(atoi(&command[1]));
+		return 0;
+	case 's':
+		cmd_super();
+		return 0;
+	case 'd':
+		cmd_block(atoi(&command[1]));
+		return 0;
+	}
+	fprintf(stderr, "fsdb: unknown command \"%s\"\n", command);
+	return -1;
+}
+
+void usage(void)
+{
+	fprintf(stderr,
+		"usage: fsdb [-b] [-f text|json|csv] [-c command]... device\n"
+		"  -b  batch mode, read commands from stdin without a prompt\n"
+		"  -c  run command and exit, may be given more than once\n"
+		"commands: s, i<inum>, d<block>, q, dump, tree, free, "
+		"frag, fanout, report\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *cmds[64];
+	int ncmds = 0, batch = 0, status = 0, c, i;
 	char command[512];
-	ino_t inum;
-	char dataText[512];
 
-	devfd = open(argv[1], O_RDWR);
+	while ((c = getopt(argc, argv, "bc:f:")) != -1) {
+		switch (c) {
+		case 'b':
+			batch = 1;
+			break;
+		case 'c':
+			if (ncmds == sizeof(cmds) / sizeof(cmds[0]))
+				usage();
+			cmds[ncmds++] = optarg;
+			break;
+		case 'f':
+			if (!strcmp(optarg, "json"))
+				fmt = FMT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				fmt = FMT_CSV;
+			else if (!strcmp(optarg, "text"))
+				fmt = FMT_TEXT;
+			else
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	devfd = open(argv[optind], O_RDONLY);
 	if (devfd < 0) {
-		fprintf(stderr, "uxmkfs: Failed to open device\n");
+		fprintf(stderr, "fsdb: Failed to open device\n");
 		exit(1);
 	}
 
@@ -99,39 +804,43 @@ int main(int argc, char **argv)
 
 	read(devfd, (char *)&sb, sizeof(struct uxfs_superblock));
 	if (sb.s_magic != UXFS_MAGIC) {
-		printf("This is not a uxfs filesystem\n");
+		fprintf(stderr, "This is not a uxfs filesystem\n");
 		exit(1);
 	}
+	lseek(devfd, UXFS_DEVTAB_BLOCK * UXFS_BSIZE, SEEK_SET);
+	read(devfd, (char *)&devtab, sizeof(devtab));
+	if (devtab.d_magic != UXFS_DEVTAB_MAGIC) {
+		memset(&devtab, 0, sizeof(devtab));
+		devtab.d_ndevs = 1;
+	} else if (devtab.d_ndevs > 1)
+		fprintf(stderr, "fsdb: warning: volume is striped over %u "
+			"devices, only data blocks on this one can be "
+			"read\n", devtab.d_ndevs);
+	read_bmap();
 
-	while (1) {
-		printf("uxfsdb > ");
-		fflush(stdout);
-		scanf("%s", command);
-		if (command[0] == 'q')
-			exit(0);
-		if (command[0] == 'i') {
-			inum = atoi(&command[1]);
-			read_inode(inum, &inode);
-			print_inode(inum, &inode);
-		}
-		if (command[0] == 's') {
-			printf("\nSuperblock contents:\n");
-			printf("  s_magic   = 0x%x\n", sb.s_magic);
-			printf("  s_mod     = %s\n",
-			       (sb.s_mod == UXFS_FSCLEAN) ?
-			       "UXFS_FSCLEAN" : "UXFS_FSDIRTY");
-			printf("  s_nifree  = %d\n", sb.s_nifree);
-			printf("  s_nbfree  = %d\n\n", sb.s_nbfree);
+	if (ncmds) {
+		for (i = 0; i < ncmds; i++) {
+			c = run_command(cmds[i]);
+			if (c < 0)
+				status = 1;
+			if (c > 0)
+				break;
 		}
-		if (command[0] == 'd') {
-			inum = atoi(&command[1]);
-			printf("block number requested: %d\n", inum);
-			lseek(devfd, inum * UXFS_BSIZE, SEEK_SET);
-			read(devfd, &dataText, UXFS_BSIZE);
-			if (!dataText[0])
-				printf("Data block empty\n");
-			else
-				printf("Data: \n %s \n", dataText);
+		exit(status);
+	}
+
+	while (1) {
+		if (!batch) {
+			printf("uxfsdb > ");
+			fflush(stdout);
 		}
+		if (scanf("%511s", command) != 1)
+			exit(status);
+		c = run_command(command);
+		if (c < 0)
+			status = 1;
+		if (c > 0)
+			exit(status);
+		fflush(stdout);
 	}
 }
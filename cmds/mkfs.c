@@ -7,165 +7,486 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 #include <linux/fs.h>
 #include <sys/stat.h>
 #include <linux/types.h>
 #include "../kern/uxfs.h"
 
-int main(int argc, char **argv)
+/*
+ * The whole volume is built in memory, indexed by volume block
+ * number, and then written out to each member front to back in
+ * large writes. With -d the image is filled with a copy of a host
+ * directory tree: directories are packed densely and each file
+ * gets contiguous blocks, allocated in the order the tree is
+ * walked so that a directory is followed by its files. The file
+ * data is read in by several threads once the layout is known.
+ * With -b the volume is made smaller than the most uxfs can hold,
+ * to be grown later with uxgrow.
+ */
+
+#define IMAGE_BLOCKS	(UXFS_FIRST_DATA_BLOCK + nblocks)
+#define WRITE_CHUNK	(128 * UXFS_BSIZE)
+#define MAX_THREADS	16
+
+/*
+ * The member devices of the volume, see struct uxfs_devtab. There
+ * is only one unless several devices are given.
+ */
+
+struct uxfs_devtab devtab;
+int devfds[UXFS_MAXDEVS];
+
+struct uxfs_superblock *sb;
+char *image;
+__u32 nblocks = UXFS_MAXBLOCKS;
+__u32 next_block = UXFS_FIRST_DATA_BLOCK;
+int next_inode = UXFS_ROOT_INO;
+time_t tm;
+
+/*
+ * Regular files whose data is still to be read in, and the next one
+ * for a reader thread to take.
+ */
+
+struct srcfile {
+	char *path;
+	__u32 blk;
+	__u32 size;
+} files[UXFS_MAXFILES];
+int nfiles, next_file, read_errors;
+pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char *block_ptr(__u32 blk)
 {
-	struct uxfs_dirent dir;
-	struct uxfs_superblock sb;
-	struct uxfs_inode inode;
-	time_t tm;
-	off_t nsectors = UXFS_MAXBLOCKS;
-	int devfd, error, i;
-	char block[UXFS_BSIZE];
-
-	if (argc != 2) {
-		fprintf(stderr, "uxmkfs: Need to specify device\n");
-		exit(1);
-	}
-	devfd = open(argv[1], O_WRONLY);
-	if (devfd < 0) {
-		fprintf(stderr, "uxmkfs: Failed to open device\n");
-		exit(1);
-	}
-	error = lseek(devfd, (off_t) (nsectors * 512), SEEK_SET);
-	if (error == -1) {
-		fprintf(stderr, "uxmkfs: Cannot create filesystem"
-			" of specified size\n");
-		exit(1);
+	return image + (size_t) blk * UXFS_BSIZE;
+}
+
+struct uxfs_inode *inode_ptr(int ino)
+{
+	return (struct uxfs_inode *)block_ptr(UXFS_INODE_BLOCK + ino);
+}
+
+/*
+ * The block map entry of data block "i", in the map blocks.
+ */
+
+char *map_ptr(__u32 i)
+{
+	return block_ptr(UXFS_MAP_BLOCK + i / UXFS_REGION_BLOCKS) +
+	    i % UXFS_REGION_BLOCKS;
+}
+
+void fail(const char *path, const char *why)
+{
+	fprintf(stderr, "uxmkfs: %s: %s\n", path, why);
+	exit(1);
+}
+
+__u32 alloc_blocks(int count, const char *path)
+{
+	__u32 blk = next_block;
+	int i;
+
+	if (next_block + count > IMAGE_BLOCKS)
+		fail(path, "Out of space");
+	for (i = 0; i < count; i++)
+		*map_ptr(next_block - UXFS_FIRST_DATA_BLOCK + i) =
+		    UXFS_BLOCK_INUSE;
+	next_block += count;
+	return blk;
+}
+
+struct uxfs_inode *alloc_inode(const char *path, int *ino, mode_t mode,
+			       struct stat *st)
+{
+	struct uxfs_inode *uip;
+
+	if (next_inode >= UXFS_MAXFILES)
+		fail(path, "Out of inodes");
+	*ino = next_inode++;
+	sb->s_inode[*ino] = UXFS_INODE_INUSE;
+	uip = inode_ptr(*ino);
+	uip->i_mode = mode;
+	uip->i_nlink = S_ISDIR(mode) ? 2 : 1;
+	uip->i_atime = st ? st->st_atime : tm;
+	uip->i_mtime = st ? st->st_mtime : tm;
+	uip->i_ctime = tm;
+	uip->i_uid = st ? st->st_uid : 0;
+	uip->i_gid = st ? st->st_gid : 0;
+	return uip;
+}
+
+void add_entry(struct uxfs_inode *dip, int *slot, int ino, const char *name)
+{
+	struct uxfs_dirent *dirent;
+
+	dirent = (struct uxfs_dirent *)block_ptr(dip->i_addr[*slot /
+							     UXFS_DIRS_PER_BLOCK]);
+	dirent += *slot % UXFS_DIRS_PER_BLOCK;
+	dirent->d_ino = ino;
+	strncpy(dirent->d_name, name, UXFS_NAMELEN);
+	(*slot)++;
+}
+
+/*
+ * Give directory "dip" enough blocks for "nentries" entries.
+ */
+
+void dir_blocks(struct uxfs_inode *dip, int nentries, const char *path)
+{
+	int i, nblocks;
+	__u32 blk;
+
+	nblocks = (nentries + UXFS_DIRS_PER_BLOCK - 1) / UXFS_DIRS_PER_BLOCK;
+	if (nblocks > UXFS_DIRECT_BLOCKS)
+		fail(path, "Too many entries");
+	blk = alloc_blocks(nblocks, path);
+	for (i = 0; i < nblocks; i++)
+		dip->i_addr[i] = blk + i;
+	dip->i_blocks = nblocks;
+	dip->i_size = nblocks * UXFS_BSIZE;
+}
+
+int skip_entry(const struct dirent *de)
+{
+	return strcmp(de->d_name, ".") && strcmp(de->d_name, "..");
+}
+
+/*
+ * Fill in directory "ino", a copy of host directory "path" (or empty
+ * if there is none), whose parent is "parent". The root also gets
+ * lost+found, which hides a lost+found in the source.
+ */
+
+void make_dir(const char *path, int ino, int parent)
+{
+	struct uxfs_inode *dip = inode_ptr(ino), *uip;
+	struct dirent **names = NULL;
+	struct stat st;
+	char child[PATH_MAX];
+	int *subdirs, nsubdirs = 0;
+	int i, n = 0, slot = 0, cino, lfino = 0, nblocks;
+
+	if (path) {
+		n = scandir(path, &names, skip_entry, alphasort);
+		if (n < 0)
+			fail(path, strerror(errno));
 	}
-	lseek(devfd, 0, SEEK_SET);
+	subdirs = calloc(n + 1, sizeof(int));
+	if (!subdirs)
+		fail(path, strerror(ENOMEM));
 
-	/*added to initialize every block on the device to 0 before writing anything to the device */
-	memset((void *)&block, 0, UXFS_BSIZE);
-	for (i = 0; i < UXFS_MAXBLOCKS; i++) {
-		write(devfd, block, UXFS_BSIZE);
+	dir_blocks(dip, n + 2 + (ino == UXFS_ROOT_INO), path ? path : "/");
+	add_entry(dip, &slot, ino, ".");
+	add_entry(dip, &slot, parent, "..");
+	if (ino == UXFS_ROOT_INO) {
+		alloc_inode("lost+found", &lfino, S_IFDIR | 0755, NULL);
+		add_entry(dip, &slot, lfino, "lost+found");
+		dip->i_nlink++;
 	}
 
-	lseek(devfd, 0, SEEK_SET);
+	for (i = 0; i < n; i++) {
+		snprintf(child, sizeof(child), "%s/%s", path, names[i]->d_name);
+		if (ino == UXFS_ROOT_INO &&
+		    strcmp(names[i]->d_name, "lost+found") == 0)
+			goto next;
+		if (strlen(names[i]->d_name) > UXFS_NAMELEN)
+			fail(child, "Name too long");
+		if (lstat(child, &st) < 0)
+			fail(child, strerror(errno));
+		if (S_ISDIR(st.st_mode)) {
+			uip = alloc_inode(child, &cino,
+					  S_IFDIR | (st.st_mode & 07777), &st);
+			subdirs[nsubdirs++] = cino;
+			dip->i_nlink++;
+		} else if (S_ISREG(st.st_mode)) {
+			if (st.st_size > UXFS_DIRECT_BLOCKS * UXFS_BSIZE)
+				fail(child, "File too large");
+			uip = alloc_inode(child, &cino,
+					  S_IFREG | (st.st_mode & 07777), &st);
+			nblocks = (st.st_size + UXFS_BSIZE - 1) / UXFS_BSIZE;
+			uip->i_size = st.st_size;
+			uip->i_blocks = nblocks;
+			if (nblocks) {
+				files[nfiles].path = strdup(child);
+				files[nfiles].size = st.st_size;
+				files[nfiles].blk = alloc_blocks(nblocks, child);
+				for (nblocks--; nblocks >= 0; nblocks--)
+					uip->i_addr[nblocks] =
+					    files[nfiles].blk + nblocks;
+				nfiles++;
+			}
+		} else {
+			fprintf(stderr, "uxmkfs: Warning: %s is not a regular "
+				"file or directory, skipped\n", child);
+			goto next;
+		}
+		add_entry(dip, &slot, cino, names[i]->d_name);
+		if (S_ISDIR(st.st_mode))
+			continue;
+	      next:
+		free(names[i]);
+		names[i] = NULL;
+	}
 
 	/*
-	 * Fill in the fields of the superblock and write
-	 * it out to the first block of the device.
+	 * lost+found and the subdirectories come after the files of
+	 * this directory. Only the names of subdirectories are left.
 	 */
 
-	sb.s_magic = UXFS_MAGIC;
-	sb.s_mod = UXFS_FSCLEAN;
-	sb.s_nifree = UXFS_MAXFILES - 4;
-	sb.s_nbfree = UXFS_MAXBLOCKS - 2;
+	if (lfino)
+		make_dir(NULL, lfino, ino);
+	for (i = 0, nsubdirs = 0; i < n; i++) {
+		if (!names[i])
+			continue;
+		snprintf(child, sizeof(child), "%s/%s", path, names[i]->d_name);
+		make_dir(child, subdirs[nsubdirs++], ino);
+		free(names[i]);
+	}
+	free(names);
+	free(subdirs);
+}
 
-	/*
-	 * First 4 inodes are in use. Inodes 0 and 1 are not
-	 * used by anything, 2 is the root directory and 3 is
-	 * lost+found.
-	 */
+/*
+ * Reader threads: take the next file off the list and read it
+ * straight into its blocks of the image.
+ */
 
-	sb.s_inode[0] = UXFS_INODE_INUSE;
-	sb.s_inode[1] = UXFS_INODE_INUSE;
-	sb.s_inode[2] = UXFS_INODE_INUSE;
-	sb.s_inode[3] = UXFS_INODE_INUSE;
+void *read_files(void *arg)
+{
+	struct srcfile *f;
+	ssize_t n;
+	__u32 done;
+	int fd;
 
-	/*
-	 * The rest of the inodes are marked unused
-	 */
+	for (;;) {
+		pthread_mutex_lock(&files_lock);
+		f = next_file < nfiles ? &files[next_file++] : NULL;
+		pthread_mutex_unlock(&files_lock);
+		if (!f)
+			return NULL;
 
-	for (i = 4; i < UXFS_MAXFILES; i++)
-		sb.s_inode[i] = UXFS_INODE_FREE;
+		fd = open(f->path, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "uxmkfs: %s: %s\n", f->path,
+				strerror(errno));
+			goto error;
+		}
+		for (done = 0; done < f->size; done += n) {
+			n = pread(fd, block_ptr(f->blk) + done,
+				  f->size - done, done);
+			if (n <= 0) {
+				fprintf(stderr, "uxmkfs: %s: %s\n", f->path,
+					n < 0 ? strerror(errno) :
+					"File shrank while being read");
+				close(fd);
+				goto error;
+			}
+		}
+		close(fd);
+		continue;
+	      error:
+		pthread_mutex_lock(&files_lock);
+		read_errors++;
+		pthread_mutex_unlock(&files_lock);
+	}
+}
 
-	/*
-	 * The first two blocks are allocated for the entries
-	 * for the root and lost+found directories.
-	 */
+void load_files(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	int i;
 
-	sb.s_block[0] = UXFS_BLOCK_INUSE;
-	sb.s_block[1] = UXFS_BLOCK_INUSE;
+	if (nthreads > nfiles)
+		nthreads = nfiles;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, read_files, NULL)) {
+			nthreads = i;
+			break;
+		}
+	}
+	if (nthreads == 0)
+		read_files(NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	if (read_errors)
+		exit(1);
+}
 
-	/*
-	 * The rest of the blocks are marked unused
-	 */
+/*
+ * Write out member "d": the metadata if it's member 0, its copy of
+ * the device table and the data blocks that map to it, with every
+ * other block zeroed.
+ */
 
-	for (i = 2; i < UXFS_MAXBLOCKS; i++)
-		sb.s_block[i] = UXFS_BLOCK_FREE;
+void write_member(int d, const char *name)
+{
+	__u32 blk, phys, member, mblocks;
+	char *buf;
+	size_t len, off;
+	ssize_t n;
 
-	write(devfd, (char *)&sb, sizeof(struct uxfs_superblock));
+	mblocks = uxfs_member_blocks(&devtab, nblocks);
+	buf = calloc(mblocks, UXFS_BSIZE);
+	if (!buf)
+		fail(name, strerror(ENOMEM));
+	for (blk = 0; blk < IMAGE_BLOCKS; blk++) {
+		phys = uxfs_stripe_map(&devtab, blk, &member);
+		if (member == d)
+			memcpy(buf + (size_t) phys * UXFS_BSIZE, block_ptr(blk),
+			       UXFS_BSIZE);
+	}
+	devtab.d_index = d;
+	memcpy(buf + UXFS_DEVTAB_BLOCK * UXFS_BSIZE, &devtab, sizeof(devtab));
 
-	/*
-	 * The root directory and lost+found directory inodes
-	 * must be initialized.
-	 */
+	len = (size_t) mblocks * UXFS_BSIZE;
+	for (off = 0; off < len; off += n) {
+		n = pwrite(devfds[d], buf + off,
+			   len - off < WRITE_CHUNK ? len - off : WRITE_CHUNK,
+			   off);
+		if (n <= 0)
+			fail(name, n < 0 ? strerror(errno) : "Short write");
+	}
+	if (fsync(devfds[d]) < 0 && errno != EINVAL)
+		fail(name, strerror(errno));
+	free(buf);
+}
+
+void usage(void)
+{
+	fprintf(stderr, "usage: mkfs [-b blocks] [-s stripe] [-d dir] "
+		"[-j threads] device [device]...\n"
+		"  -b  data blocks in the volume (default and at most %d)\n"
+		"  -s  blocks per stripe unit when striping over several "
+		"devices (default %d)\n"
+		"  -d  copy the tree below dir into the new filesystem\n"
+		"  -j  threads reading the files of dir (default one per "
+		"cpu, at most %d)\n", UXFS_MAXBLOCKS, UXFS_STRIPE_DEFAULT,
+		MAX_THREADS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct uxfs_mapsum *sum;
+	char *srcdir = NULL;
+	int nthreads, ino, i, c, d;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	devtab.d_stripe = UXFS_STRIPE_DEFAULT;
+	while ((c = getopt(argc, argv, "b:s:d:j:")) != -1) {
+		switch (c) {
+		case 'b':
+			if (atoi(optarg) < 1 || atoi(optarg) > UXFS_MAXBLOCKS)
+				usage();
+			nblocks = atoi(optarg);
+			break;
+		case 's':
+			if (atoi(optarg) < 1)
+				usage();
+			devtab.d_stripe = atoi(optarg);
+			break;
+		case 'd':
+			srcdir = optarg;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if (optind == argc) {
+		fprintf(stderr, "uxmkfs: Need to specify device\n");
+		exit(1);
+	}
+	if (argc - optind > UXFS_MAXDEVS) {
+		fprintf(stderr, "uxmkfs: At most %d devices\n", UXFS_MAXDEVS);
+		exit(1);
+	}
 
 	time(&tm);
-	memset((void *)&inode, 0, sizeof(struct uxfs_inode));
-	inode.i_mode = S_IFDIR | 0755;
-	inode.i_nlink = 3;	/* ".", ".." and "lost+found" */
-	inode.i_atime = tm;
-	inode.i_mtime = tm;
-	inode.i_ctime = tm;
-	inode.i_uid = 0;
-	inode.i_gid = 0;
-	inode.i_size = UXFS_BSIZE;
-	inode.i_blocks = 1;
-	inode.i_addr[0] = UXFS_FIRST_DATA_BLOCK;
-
-	lseek(devfd, (UXFS_INODE_BLOCK + UXFS_ROOT_INO) * UXFS_BSIZE,
-	      SEEK_SET);
-	write(devfd, (char *)&inode, sizeof(struct uxfs_inode));
-
-	memset((void *)&inode, 0, sizeof(struct uxfs_inode));
-	inode.i_mode = S_IFDIR | 0755;
-	inode.i_nlink = 2;	/* "." and ".." */
-	inode.i_atime = tm;
-	inode.i_mtime = tm;
-	inode.i_ctime = tm;
-	inode.i_uid = 0;
-	inode.i_gid = 0;
-	inode.i_size = UXFS_BSIZE;
-	inode.i_blocks = 1;
-	inode.i_addr[0] = UXFS_FIRST_DATA_BLOCK + 1;
-
-	lseek(devfd, (UXFS_INODE_BLOCK + UXFS_ROOT_INO + 1) * UXFS_BSIZE,
-	      SEEK_SET);
-	write(devfd, (char *)&inode, sizeof(struct uxfs_inode));
+	devtab.d_magic = UXFS_DEVTAB_MAGIC;
+	devtab.d_volid = tm ^ (getpid() << 16);
+	devtab.d_ndevs = argc - optind;
+	for (d = 0; d < devtab.d_ndevs; d++) {
+		if (strlen(argv[optind + d]) >= UXFS_DEVNAMELEN)
+			fprintf(stderr, "uxmkfs: Warning: name of %s too long "
+				"to record, give it with -o devices= at "
+				"mount time\n", argv[optind + d]);
+		else
+			strcpy(devtab.d_names[d], argv[optind + d]);
+	}
 
-	/*
-	 * Fill in the directory entries for root 
-	 */
+	for (d = 0; d < devtab.d_ndevs; d++) {
+		devfds[d] = open(argv[optind + d], O_WRONLY);
+		if (devfds[d] < 0) {
+			fprintf(stderr, "uxmkfs: Failed to open device %s\n",
+				argv[optind + d]);
+			exit(1);
+		}
+		if (lseek(devfds[d], (off_t) uxfs_member_blocks(&devtab,
+								 nblocks) *
+			  UXFS_BSIZE, SEEK_SET) == -1) {
+			fprintf(stderr, "uxmkfs: Cannot create filesystem"
+				" of specified size\n");
+			exit(1);
+		}
+	}
 
-	lseek(devfd, UXFS_FIRST_DATA_BLOCK * UXFS_BSIZE, SEEK_SET);
-	memset((void *)&block, 0, UXFS_BSIZE);
-	write(devfd, block, UXFS_BSIZE);
-	lseek(devfd, UXFS_FIRST_DATA_BLOCK * UXFS_BSIZE, SEEK_SET);
-	dir.d_ino = 2;
-	strcpy(dir.d_name, ".");
-	write(devfd, (char *)&dir, sizeof(struct uxfs_dirent));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, "..");
-	write(devfd, (char *)&dir, sizeof(struct uxfs_dirent));
-	dir.d_ino = 3;
-	strcpy(dir.d_name, "lost+found");
-	write(devfd, (char *)&dir, sizeof(struct uxfs_dirent));
+	image = calloc(IMAGE_BLOCKS, UXFS_BSIZE);
+	if (!image)
+		fail("image", strerror(ENOMEM));
 
 	/*
-	 * Fill in the directory entries for lost+found 
+	 * Inodes 0 and 1 are not used by anything, 2 is the root
+	 * directory and 3 is lost+found. Everything else is free until
+	 * the tree is laid out.
 	 */
 
-	lseek(devfd, UXFS_FIRST_DATA_BLOCK * UXFS_BSIZE + UXFS_BSIZE,
-	      SEEK_SET);
-	memset((void *)&block, 0, UXFS_BSIZE);
-	write(devfd, block, UXFS_BSIZE);
-	lseek(devfd, UXFS_FIRST_DATA_BLOCK * UXFS_BSIZE + UXFS_BSIZE,
-	      SEEK_SET);
-	dir.d_ino = 3;		//THIS IS INODE 3, NOT 2
-	strcpy(dir.d_name, ".");
-	write(devfd, (char *)&dir, sizeof(struct uxfs_dirent));
-	dir.d_ino = 2;
-	strcpy(dir.d_name, "..");
-	write(devfd, (char *)&dir, sizeof(struct uxfs_dirent));
+	sb = (struct uxfs_superblock *)block_ptr(0);
+	sb->s_magic = UXFS_MAGIC;
+	sb->s_mod = UXFS_FSCLEAN;
+	sb->s_nblocks = nblocks;
+	sb->s_inode[0] = UXFS_INODE_INUSE;
+	sb->s_inode[1] = UXFS_INODE_INUSE;
+	for (i = 2; i < UXFS_MAXFILES; i++)
+		sb->s_inode[i] = UXFS_INODE_FREE;
+	for (i = 0; i < UXFS_MAXBLOCKS; i++)
+		*map_ptr(i) = UXFS_BLOCK_FREE;
+
+	alloc_inode("/", &ino, S_IFDIR | 0755, NULL);
+	make_dir(srcdir, ino, ino);
+	if (srcdir)
+		load_files(nthreads);
 
+	sb->s_nifree = UXFS_MAXFILES - next_inode;
+	sb->s_nbfree = IMAGE_BLOCKS - next_block;
+	sum = uxfs_mapsum(sb);
+	sum->m_magic = UXFS_MAPS_MAGIC;
+	for (i = 0; i < (int)nblocks; i++) {
+		if (*map_ptr(i) == UXFS_BLOCK_FREE)
+			sum->m_free[i / UXFS_REGION_BLOCKS]++;
+	}
+
+	for (d = 0; d < devtab.d_ndevs; d++) {
+		write_member(d, argv[optind + d]);
+		close(devfds[d]);
+	}
+	if (srcdir)
+		printf("uxmkfs: %d inodes, %d blocks used\n", next_inode - 2,
+		       next_block - UXFS_FIRST_DATA_BLOCK);
 	return 0;
 }
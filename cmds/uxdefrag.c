@@ -0,0 +1,127 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- uxdefrag.c -------------------------*/
+/*--------------------------------------------------------------*/
+
+#define _XOPEN_SOURCE 500
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/types.h>
+#include "../kern/uxfs.h"
+
+/*
+ * Report on, and unless -n is given defragment, the files named on
+ * the command line and the regular files below any directories
+ * named there, on a mounted uxfs filesystem. Unless -n is given
+ * those directories are compacted too, after their contents. The
+ * whole volume report is in /sys/fs/uxfs/<dev>/frag.
+ */
+
+int report_only;
+int nfiles, nfragmented, nmoved, ndirs, ncompacted, errors;
+
+void compact_one(const char *path)
+{
+	int fd, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || (n = ioctl(fd, UXFS_IOC_DIR_COMPACT)) < 0) {
+		fprintf(stderr, "uxdefrag: %s: %s\n", path, strerror(errno));
+		errors++;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	ndirs++;
+	if (n) {
+		printf("%s: directory, %d blocks freed\n", path, n);
+		ncompacted += n;
+	}
+	close(fd);
+}
+
+int defrag_one(const char *path, const struct stat *st, int type,
+	       struct FTW *ftw)
+{
+	struct uxfs_frag f;
+	int fd;
+
+	if (type == FTW_DP && !report_only) {
+		compact_one(path);
+		return 0;
+	}
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	fd = open(path, report_only ? O_RDONLY : O_RDWR);
+	if (fd < 0 || ioctl(fd, UXFS_IOC_GETFRAG, &f) < 0) {
+		fprintf(stderr, "uxdefrag: %s: %s\n", path, strerror(errno));
+		errors++;
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	nfiles++;
+	printf("%s: %u blocks, %u extents", path, f.f_blocks, f.f_extents);
+	if (f.f_shared)
+		printf(", %u shared", f.f_shared);
+	if (f.f_extents > 1) {
+		nfragmented++;
+		if (!report_only && f.f_shared)
+			printf(" (shared, skipped)");
+		else if (!report_only) {
+			if (ioctl(fd, UXFS_IOC_DEFRAG, &f) < 0) {
+				printf(" (%s)", strerror(errno));
+				errors++;
+			} else {
+				printf(" -> %u extents", f.f_extents);
+				nmoved += f.f_moved;
+			}
+		}
+	}
+	printf("\n");
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+
+	while ((c = getopt(argc, argv, "n")) != -1) {
+		switch (c) {
+		case 'n':
+			report_only = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc)
+		goto usage;
+
+	for (i = optind; i < argc; i++) {
+		if (nftw(argv[i], defrag_one, 16,
+			 FTW_PHYS | FTW_MOUNT | FTW_DEPTH) < 0) {
+			fprintf(stderr, "uxdefrag: %s: %s\n", argv[i],
+				strerror(errno));
+			errors++;
+		}
+	}
+	printf("%d files, %d fragmented", nfiles, nfragmented);
+	if (!report_only)
+		printf(", %d blocks moved, %d directories compacted, "
+		       "%d blocks freed", nmoved, ndirs, ncompacted);
+	printf("\n");
+	return errors ? 1 : 0;
+
+      usage:
+	fprintf(stderr, "usage: uxdefrag [-n] path...\n");
+	return 2;
+}
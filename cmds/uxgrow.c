@@ -0,0 +1,55 @@
+/*--------------------------------------------------------------*/
+/*---------------------------- uxgrow.c --------------------------*/
+/*--------------------------------------------------------------*/
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/types.h>
+#include "../kern/uxfs.h"
+
+/*
+ * Grow the mounted uxfs filesystem that "path" is on to "blocks"
+ * data blocks, or as far as its devices allow if no size is given.
+ * The devices must be enlarged first; for an image on a loop device
+ * that means extending the file and running "losetup -c".
+ */
+
+int main(int argc, char **argv)
+{
+	struct statfs st;
+	__u32 nblocks = 0;
+	int fd;
+
+	if (argc < 2 || argc > 3)
+		goto usage;
+	if (argc == 3) {
+		if (atoi(argv[2]) < 1)
+			goto usage;
+		nblocks = atoi(argv[2]);
+	}
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstatfs(fd, &st) < 0 ||
+	    ioctl(fd, UXFS_IOC_GROW, &nblocks) < 0) {
+		fprintf(stderr, "uxgrow: %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	close(fd);
+	if (nblocks == st.f_blocks)
+		printf("%u blocks, not grown\n", nblocks);
+	else
+		printf("%lu -> %u blocks\n", (unsigned long)st.f_blocks,
+		       nblocks);
+	return 0;
+
+      usage:
+	fprintf(stderr, "usage: uxgrow path [blocks]\n");
+	return 2;
+}
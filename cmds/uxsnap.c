@@ -0,0 +1,80 @@
+/*--------------------------------------------------------------*/
+/*---------------------------- uxsnap.c --------------------------*/
+/*--------------------------------------------------------------*/
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <linux/types.h>
+#include "../kern/uxfs.h"
+
+/*
+ * Take (-c), delete (-d) or, by default, report on the snapshot of
+ * the mounted uxfs filesystem that "path" is on. The snapshot
+ * itself is found below /.snapshot of the filesystem.
+ */
+
+int main(int argc, char **argv)
+{
+	struct uxfs_snapinfo si;
+	unsigned long cmd = UXFS_IOC_SNAP_INFO;
+	time_t t;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "cd")) != -1) {
+		switch (c) {
+		case 'c':
+			cmd = UXFS_IOC_SNAP_CREATE;
+			break;
+		case 'd':
+			cmd = UXFS_IOC_SNAP_DELETE;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "uxsnap: %s: %s\n", argv[optind],
+			strerror(errno));
+		return 1;
+	}
+	if (ioctl(fd, cmd, &si) < 0) {
+		fprintf(stderr, "uxsnap: %s: %s\n", argv[optind],
+			strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	if (cmd != UXFS_IOC_SNAP_INFO)
+		return 0;
+
+	switch (si.s_state) {
+	case UXFS_SNAP_NONE:
+		printf("no snapshot\n");
+		break;
+	case UXFS_SNAP_ACTIVE:
+		t = si.s_time;
+		printf("snapshot taken %s", ctime(&t));
+		printf("%u inodes saved, %u blocks held\n", si.s_saved,
+		       si.s_held);
+		break;
+	case UXFS_SNAP_DELETING:
+		printf("snapshot being deleted, %u blocks left\n", si.s_held);
+		break;
+	}
+	return 0;
+
+      usage:
+	fprintf(stderr, "usage: uxsnap [-c | -d] path\n");
+	return 2;
+}
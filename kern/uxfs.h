@@ -2,7 +2,19 @@
 /*---------------------------- uxfs.h -------------------------*/
 /*--------------------------------------------------------------*/
 
+#ifdef __KERNEL__
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
+#endif
+
 extern struct address_space_operations uxfs_aops;
+extern struct address_space_operations uxfs_stripe_aops;
 extern struct inode_operations uxfs_file_inops;
 extern struct inode_operations uxfs_dir_inops;
 extern struct file_operations uxfs_dir_operations;
@@ -24,8 +36,10 @@ extern struct file_operations uxfs_file_operations;
 //#define i_private     u.generic_ip
 
 /*
- * The on-disk superblock. The number of inodes and 
- * data blocks is fixed.
+ * The on-disk superblock. The number of inodes is fixed. The
+ * volume has s_nblocks data blocks, at most UXFS_MAXBLOCKS; it can
+ * be grown up to that while mounted, see uxfs_grow(). Volumes made
+ * before it could grow have zero there and the full size.
  */
 
 struct uxfs_superblock {	//made smaller using chars so it fits in a block
@@ -34,9 +48,109 @@ struct uxfs_superblock {	//made smaller using chars so it fits in a block
 	__u32 s_nifree;
 	char s_inode[UXFS_MAXFILES];	//changed to char from __u32
 	__u32 s_nbfree;
-	char s_block[UXFS_MAXBLOCKS];	//changed to char from __u32
+	char s_block[UXFS_MAXBLOCKS];	/* struct uxfs_mapsum, see below */
+	__u32 s_nblocks;
 };
 
+static inline __u32 uxfs_nblocks(const struct uxfs_superblock *usb)
+{
+	return usb->s_nblocks ? usb->s_nblocks : UXFS_MAXBLOCKS;
+}
+
+/*
+ * The block map, a reference count per data block (see
+ * UXFS_BLOCK_MAXREF), is kept in blocks of its own: one for each
+ * region of UXFS_REGION_BLOCKS data blocks, from UXFS_MAP_BLOCK on.
+ * Where s_block[] was, the superblock has the number of free
+ * blocks in each region instead, so that nothing but the
+ * superblock has to be read to mount. Volumes made before have the
+ * map itself in s_block[]; m_magic, whose low byte can't be a
+ * reference count, tells the two apart.
+ */
+
+#define UXFS_MAP_BLOCK		3
+#define UXFS_REGION_BLOCKS	128
+#define UXFS_NREGIONS \
+	((UXFS_MAXBLOCKS + UXFS_REGION_BLOCKS - 1) / UXFS_REGION_BLOCKS)
+#define UXFS_MAPS_MAGIC		0x50414dff	// \377MAP
+
+struct uxfs_mapsum {
+	__u32 m_magic;
+	__u16 m_free[UXFS_NREGIONS];	/* free blocks per region */
+};
+
+static inline struct uxfs_mapsum *uxfs_mapsum(struct uxfs_superblock *usb)
+{
+	return (struct uxfs_mapsum *)usb->s_block;
+}
+
+static inline int uxfs_inline_map(struct uxfs_superblock *usb)
+{
+	return uxfs_mapsum(usb)->m_magic != UXFS_MAPS_MAGIC;
+}
+
+/*
+ * A volume can be striped over several devices. Block 1 of each of
+ * them holds the device table, the same on all members but for
+ * d_index. The superblock and inode table are on member 0, the
+ * device that is mounted; data blocks are spread round robin over
+ * all members in stripe units of d_stripe blocks. mkfs records the
+ * member devices in d_names, the "devices=" mount option can name
+ * others. A volume without a device table is on a single device.
+ */
+
+#define UXFS_DEVTAB_BLOCK	1
+#define UXFS_DEVTAB_MAGIC	0x56454455	// UDEV
+#define UXFS_MAXDEVS		8
+#define UXFS_DEVNAMELEN		48
+#define UXFS_STRIPE_DEFAULT	8	/* blocks, a page on most machines */
+
+struct uxfs_devtab {
+	__u32 d_magic;
+	__u32 d_volid;			/* same on every member */
+	__u32 d_ndevs;
+	__u32 d_index;			/* this member's place */
+	__u32 d_stripe;			/* blocks per stripe unit */
+	char d_names[UXFS_MAXDEVS][UXFS_DEVNAMELEN];
+};
+
+/*
+ * Where data block "blk" of the volume lives: returns the block
+ * number on member "*member".
+ */
+
+static inline __u32 uxfs_stripe_map(const struct uxfs_devtab *dt, __u32 blk,
+				    __u32 *member)
+{
+	__u32 d, unit;
+
+	if (dt->d_ndevs <= 1 || blk < UXFS_FIRST_DATA_BLOCK) {
+		*member = 0;
+		return blk;
+	}
+	d = blk - UXFS_FIRST_DATA_BLOCK;
+	unit = d / dt->d_stripe;
+	*member = unit % dt->d_ndevs;
+	return UXFS_FIRST_DATA_BLOCK + unit / dt->d_ndevs * dt->d_stripe +
+	    d % dt->d_stripe;
+}
+
+/*
+ * The size, in blocks, each member of a volume of "nblocks" data
+ * blocks must have.
+ */
+
+static inline __u32 uxfs_member_blocks(const struct uxfs_devtab *dt,
+				       __u32 nblocks)
+{
+	__u32 units = (nblocks + dt->d_stripe - 1) / dt->d_stripe;
+
+	if (dt->d_ndevs <= 1)
+		return UXFS_FIRST_DATA_BLOCK + nblocks;
+	return UXFS_FIRST_DATA_BLOCK +
+	    (units + dt->d_ndevs - 1) / dt->d_ndevs * dt->d_stripe;
+}
+
 /*
  * The on-disk inode.
  */
@@ -52,18 +166,176 @@ struct uxfs_inode {
 	__u32 i_size;
 	__u32 i_blocks;
 	__u32 i_addr[UXFS_DIRECT_BLOCKS];
+	__u32 i_flags;
 };
 
 /*
- * the actual inode allocation
+ * Inode flags. A directory's flags are inherited by everything
+ * created in it.
+ */
+
+#define UXFS_COMPR_FL	0x00000001	/* compress file data */
+
+/*
+ * Compressed files are stored a cluster of UXFS_CLUSTER_BLOCKS
+ * blocks at a time, whatever the page size, see uxfs_compress.c.
+ */
+
+#define UXFS_CLUSTER_BLOCKS	8
+#define UXFS_CLUSTER_SIZE	(UXFS_CLUSTER_BLOCKS << UXFS_BSIZE_BITS)
+
+/*
+ * In-kernel copy between files, the ioctl returns the number of
+ * bytes copied. A length of zero copies to the end of the source.
+ */
+
+struct uxfs_copy_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 length;
+	__u64 dest_offset;
+};
+
+#define UXFS_IOC_COPY_RANGE	_IOW('U', 1, struct uxfs_copy_range)
+
+/*
+ * Fragmentation of a file. An extent is a run of blocks that are
+ * contiguous on disk in file order, holes aside. UXFS_IOC_GETFRAG
+ * reports on a file, UXFS_IOC_DEFRAG moves its blocks into a single
+ * extent and then reports on it, with f_moved set.
+ */
+
+struct uxfs_frag {
+	__u32 f_blocks;		/* blocks mapped */
+	__u32 f_extents;
+	__u32 f_shared;		/* blocks shared with other files */
+	__u32 f_moved;		/* blocks moved by UXFS_IOC_DEFRAG */
+};
+
+#define UXFS_IOC_GETFRAG	_IOR('U', 2, struct uxfs_frag)
+#define UXFS_IOC_DEFRAG		_IOR('U', 3, struct uxfs_frag)
+
+/*
+ * Snapshots, see uxfs_snap.c. A volume has at most one, described
+ * by the table in UXFS_SNAP_BLOCK. Inodes changed since it was
+ * taken have their old contents in the save area that follows the
+ * inode table, UXFS_SNAP_IPB to a block: with 32 inodes, 4 to a
+ * block, that is blocks 40-47.
+ */
+
+#define UXFS_SNAP_BLOCK		2
+#define UXFS_SNAP_MAGIC		0x50414e53	// SNAP
+#define UXFS_SNAP_IBLOCK	(UXFS_INODE_BLOCK + UXFS_MAXFILES)
+#define UXFS_SNAP_IPB		(UXFS_BSIZE / sizeof(struct uxfs_inode))
+#define UXFS_SNAP_MAPSIZE	((UXFS_MAXBLOCKS + 7) / 8)
+
+#define UXFS_SNAP_NONE		0
+#define UXFS_SNAP_ACTIVE	1
+#define UXFS_SNAP_DELETING	2	/* its space is being given back */
+
+struct uxfs_snaptab {
+	__u32 t_magic;
+	__u32 t_state;
+	__u32 t_time;			/* when it was taken */
+	__u32 t_saved;			/* a bit per inode in the save area */
+	char t_inode[UXFS_MAXFILES];	/* s_inode[] when it was taken */
+	__u8 t_born[UXFS_SNAP_MAPSIZE];	/* blocks allocated since */
+	__u8 t_held[UXFS_SNAP_MAPSIZE];	/* blocks freed since, kept for it */
+};
+
+struct uxfs_snapinfo {
+	__u32 s_state;
+	__u32 s_time;
+	__u32 s_held;		/* blocks kept only for the snapshot */
+	__u32 s_saved;		/* inodes in the save area */
+};
+
+#define UXFS_IOC_SNAP_CREATE	_IO('U', 4)
+#define UXFS_IOC_SNAP_DELETE	_IO('U', 5)
+#define UXFS_IOC_SNAP_INFO	_IOR('U', 6, struct uxfs_snapinfo)
+
+/*
+ * Grow the volume to the given number of data blocks, or as far as
+ * its devices allow if that is zero. The new size is passed back.
+ */
+
+#define UXFS_IOC_GROW		_IOWR('U', 7, __u32)
+
+/*
+ * Pack the entries of a directory into as few blocks as they fit
+ * and free the rest. Returns the number of blocks freed.
+ */
+
+#define UXFS_IOC_DIR_COMPACT	_IO('U', 8)
+
+/*
+ * Non-blocking I/O on a regular file: with a non-zero argument,
+ * read(2), write(2) and AIO through this open file fail with EAGAIN
+ * rather than wait for the disk, an allocation or the inode lock.
+ * Zero turns it off again. O_NONBLOCK has no effect on files.
+ */
+
+#define UXFS_IOC_NOWAIT		_IOW('U', 9, int)
+
+/*
+ * The snapshot shows up under this name in the root directory. Its
+ * inodes are those of the volume numbered from UXFS_SNAP_INO on.
+ */
+
+#define UXFS_SNAP_NAME		".snapshot"
+#define UXFS_SNAP_INO		UXFS_MAXFILES
+
+/*
+ * The in-core part of an inode. Mode, link count, owner, size,
+ * times and block count live in the VFS inode only. The block map
+ * has its own slab cache and is loaded when it is first needed: at
+ * iget for directories, at open for regular files, so that inodes
+ * that are only stat'ed never carry one.
+ *
+ * On a 64 bit kernel this is 80 bytes on top of struct inode, plus
+ * 64 for a loaded block map (uxfs_imap_cache). It used to be 168,
+ * with a copy of the whole on-disk inode in every one.
  */
 
-struct uxfs_inode_info {
-	struct uxfs_inode uip;
 #ifdef __KERNEL__
+struct uxfs_inode_info {
+	__u32 *i_addr;			/* UXFS_DIRECT_BLOCKS, or NULL */
+	struct rw_semaphore i_dir_sem;	/* directory contents, see uxfs_dir.c */
+	struct uxfs_ncache *i_ncache;	/* directory name cache */
+	struct uxfs_statahead *i_sa;	/* directory stat-ahead window */
+	struct list_head i_rsv_list;	/* on u_rsv_list while reserving */
+	__u32 i_flags;			/* UXFS_*_FL */
+	atomic_t i_dir_opens;		/* open files, see uxfs_dir_compact() */
+	__u32 i_rsv_start;		/* reservation window */
+	unsigned i_rsv_len;
+	unsigned i_rsv_size;		/* size of the last window */
+	unsigned long i_dirty;		/* UXFS_I_* bits, for lazytime */
+	unsigned long i_time_dirtied;	/* when times were first deferred */
 	struct inode vfs_inode;
-#endif
 };
+#endif
+
+#define UXFS_IMAP_SIZE	(UXFS_DIRECT_BLOCKS * sizeof(__u32))
+#define UXFS_FILE_PAGES	DIV_ROUND_UP(UXFS_DIRECT_BLOCKS << UXFS_BSIZE_BITS, \
+				     PAGE_CACHE_SIZE)
+
+/*
+ * Bits in i_dirty. Changes other than to timestamps are written by
+ * the next inode writeback; with the lazytime mount option,
+ * timestamp changes alone wait for fsync, sync, unmount or
+ * UXFS_LAZYTIME_EXPIRE.
+ */
+
+#define UXFS_I_META		0	/* more than the times changed */
+#define UXFS_I_TIME		1	/* times changed */
+
+#define UXFS_LAZYTIME_EXPIRE	(12 * 60 * 60 * HZ)
+
+/*
+ * Buckets in the per-directory name cache, see uxfs_ncache.c
+ */
+
+#define UXFS_NCACHE_BITS	5
 
 /*
  * Allocation flags
@@ -71,9 +343,18 @@ struct uxfs_inode_info {
 
 #define UXFS_INODE_FREE	0
 #define UXFS_INODE_INUSE	1
+#define UXFS_INODE_ORPHAN	2	/* unlinked, being freed */
 #define UXFS_BLOCK_FREE	0
 #define UXFS_BLOCK_INUSE	1
 
+/*
+ * Data blocks can be shared between files (see uxfs_clone.c), so
+ * the block map holds a reference count: UXFS_BLOCK_FREE, then one per
+ * file mapping the block, up to UXFS_BLOCK_MAXREF.
+ */
+
+#define UXFS_BLOCK_MAXREF	127
+
 /*
  * Filesystem flags
  */
@@ -90,6 +371,71 @@ struct uxfs_dirent {
 	char d_name[UXFS_NAMELEN];
 };
 
+/*
+ * Per-mount statistics, exported through /sys/fs/uxfs/<dev>/.
+ * Names are in uxfs_stats.c and must be kept in the same order.
+ */
+
+enum uxfs_stat {
+	UXFS_STAT_LOOKUP,		/* uxfs_lookup() calls */
+	UXFS_STAT_FIND_ENTRY,		/* uxfs_find_entry() calls */
+	UXFS_STAT_FIND_BLOCKS,		/* directory blocks read by it */
+	UXFS_STAT_DIRADD,		/* uxfs_diradd() calls */
+	UXFS_STAT_DIRADD_BLOCKS,	/* directory blocks read by it */
+	UXFS_STAT_IALLOC,		/* uxfs_ialloc() calls */
+	UXFS_STAT_IALLOC_SCAN,		/* inode map slots scanned */
+	UXFS_STAT_BALLOC,		/* uxfs_alloc_blocks() calls */
+	UXFS_STAT_BALLOC_BLOCKS,	/* blocks allocated by it */
+	UXFS_STAT_BALLOC_GOAL,		/* allocations that got their goal */
+	UXFS_STAT_INODE_READ,		/* inodes read from disk */
+	UXFS_STAT_INODE_WRITE,		/* inodes written to disk */
+	UXFS_STAT_INODE_LAZY,		/* writes of timestamps deferred */
+	UXFS_STAT_IMAP_LOAD,		/* block maps loaded after iget */
+	UXFS_STAT_GET_BLOCK,		/* uxfs_get_block() calls */
+	UXFS_STAT_GET_BLOCK_MAPPED,	/* blocks mapped by it */
+	UXFS_STAT_GET_BLOCK_ALLOC,	/* blocks allocated by it */
+	UXFS_STAT_SUPER_DIRTY,		/* times the superblock was dirtied */
+	UXFS_STAT_SUPER_WRITE,		/* uxfs_write_super() calls */
+	UXFS_STAT_NCACHE_HIT,		/* name cache positive hits */
+	UXFS_STAT_NCACHE_NEG,		/* name cache negative hits */
+	UXFS_STAT_NCACHE_BUILD,		/* directories read into the cache */
+	UXFS_STAT_NCACHE_RECLAIM,	/* caches freed by the shrinker */
+	UXFS_STAT_SA_WINDOWS,		/* stat-ahead windows prefetched */
+	UXFS_STAT_SA_INODES,		/* inodes prefetched by stat-ahead */
+	UXFS_STAT_CLONE_BLOCKS,		/* blocks shared by clone ioctls */
+	UXFS_STAT_COW_BLOCKS,		/* shared blocks copied on write */
+	UXFS_STAT_RSV_WINDOWS,		/* reservation windows opened */
+	UXFS_STAT_RSV_BLOCKS,		/* blocks allocated from them */
+	UXFS_STAT_RSV_RECLAIM,		/* windows dropped for lack of space */
+	UXFS_STAT_DEFRAG_FILES,		/* files defragmented */
+	UXFS_STAT_DEFRAG_BLOCKS,	/* blocks moved by defrag */
+	UXFS_STAT_NOWAIT_AGAIN,		/* UXFS_IOC_NOWAIT I/O that would block */
+	UXFS_STAT_SNAP_SAVED,		/* inodes copied to the save area */
+	UXFS_STAT_SNAP_FREED,		/* blocks freed by snapshot deletion */
+	UXFS_STAT_DIR_COMPACT,		/* directories compacted */
+	UXFS_STAT_DIR_COMPACT_BLOCKS,	/* directory blocks freed by it */
+	UXFS_STAT_FREE_QUEUED,		/* unlinked inodes freed in background */
+	UXFS_STAT_FREE_BATCHES,		/* passes that freed them */
+	UXFS_STAT_MAP_LOADS,		/* map regions indexed on demand */
+	UXFS_STAT_NR
+};
+
+/*
+ * Operations with a latency histogram. Bucket n counts calls that
+ * took less than 2^n microseconds, the last bucket everything else.
+ */
+
+enum uxfs_lat {
+	UXFS_LAT_IGET,
+	UXFS_LAT_FIND_ENTRY,
+	UXFS_LAT_DIRADD,
+	UXFS_LAT_GET_BLOCK,
+	UXFS_LAT_WRITE_INODE,
+	UXFS_LAT_NR
+};
+
+#define UXFS_LAT_BUCKETS	16
+
 /*
  * Used to hold filesystem information in-core permanently.
  */
@@ -97,6 +443,41 @@ struct uxfs_dirent {
 struct uxfs_fs {
 	struct uxfs_superblock *u_sb;
 	struct buffer_head *u_sbh;
+#ifdef __KERNEL__
+	struct super_block *u_vfs_sb;	/* for sysfs */
+	int u_lazytime;			/* defer timestamp-only writes */
+	struct uxfs_devtab u_devtab;	/* d_ndevs is 1 without one */
+	struct block_device *u_bdev[UXFS_MAXDEVS];
+	fmode_t u_devmode;		/* members were opened with */
+	char *u_devopt;			/* "devices=" mount option */
+	atomic_long_t u_stats[UXFS_STAT_NR];
+	atomic_long_t u_lat[UXFS_LAT_NR][UXFS_LAT_BUCKETS];
+	struct kobject u_kobj;
+	struct completion u_kobj_unregister;
+	struct mutex u_alloc_lock;	/* block map and free extents */
+	struct rb_root u_fext_start;	/* free extents by start block */
+	struct rb_root u_fext_len;	/* free extents by length */
+	int u_fext_nr;
+	int u_fext_stale;		/* rebuild before next use */
+	unsigned long u_fext_loaded;	/* regions in the index */
+	int u_inline_map;		/* block map in the superblock */
+	__u16 *u_rfree;			/* free blocks per region */
+	__u16 u_rfree_inline[UXFS_NREGIONS];	/* ... for an inline map */
+	struct buffer_head *u_map_bh[UXFS_NREGIONS];	/* map blocks read */
+	struct list_head u_rsv_list;	/* inodes with a reservation */
+	struct uxfs_snaptab *u_snap;	/* in u_snapbh */
+	struct buffer_head *u_snapbh;
+	struct mutex u_snap_lock;	/* snapshot state and save area */
+	atomic_t u_snap_inodes;		/* snapshot inodes in core */
+	struct work_struct u_snap_work;	/* frees a deleted snapshot */
+	int u_snapmount;		/* mount the snapshot, not the volume */
+	spinlock_t u_free_lock;		/* u_free_list and its counts */
+	struct list_head u_free_list;	/* unlinked inodes to free */
+	unsigned long u_free_blocks;	/* blocks they hold */
+	unsigned long u_free_inodes;
+	struct mutex u_free_mutex;	/* one pass at a time */
+	struct delayed_work u_free_work;
+#endif
 };
 
 #ifdef __KERNEL__
@@ -105,13 +486,265 @@ extern ino_t uxfs_ialloc(struct super_block *);
 extern int uxfs_find_entry(struct inode *, char *);
 __u32 uxfs_block_alloc(struct super_block *);
 extern __u32 uxfs_block_alloc(struct super_block *);
+extern __u32 uxfs_alloc_blocks(struct super_block *, __u32, unsigned *,
+			       unsigned);
+extern __u32 uxfs_block_goal(struct inode *, sector_t);
+extern char *uxfs_map_entry(struct super_block *, __u32);
+extern void uxfs_map_dirty(struct super_block *, __u32);
+extern int uxfs_map_sync(struct super_block *, __u32, unsigned);
+extern void uxfs_map_init(struct super_block *);
+extern void uxfs_map_release(struct super_block *);
+extern void uxfs_blocks_taken(struct super_block *, __u32, unsigned);
+extern int uxfs_block_get(struct super_block *, __u32);
+extern int uxfs_block_shared(struct super_block *, __u32);
+extern int uxfs_block_put(struct super_block *, __u32);
+extern void uxfs_block_free(struct super_block *, __u32);
+extern int uxfs_grow(struct super_block *, __u32 *);
+extern int uxfs_get_block(struct inode *, sector_t, struct buffer_head *,
+			  int);
+extern long uxfs_ioctl(struct file *, unsigned int, unsigned long);
 extern int uxfs_unlink(struct inode *, struct dentry *);
 extern int uxfs_link(struct dentry *, struct inode *, struct dentry *);
 struct inode *uxfs_iget(struct super_block *, unsigned long);
+extern int uxfs_imap_load(struct inode *);
+extern int uxfs_dir_compact(struct inode *, struct file *);
+extern struct uxfs_dirent *uxfs_dir_block(struct inode *, int,
+					  struct page **);
+extern void uxfs_dir_put_page(struct page *);
+extern void uxfs_dir_readahead(struct inode *, struct file *, pgoff_t);
+extern int uxfs_imap_new(struct inode *);
+extern struct buffer_head *uxfs_dinode_bread(struct super_block *,
+					     unsigned long,
+					     struct uxfs_inode **);
 
 static inline struct uxfs_inode_info *uxfs_i(struct inode *inode)
 {
 	return container_of(inode, struct uxfs_inode_info, vfs_inode);
 }
 
+static inline struct uxfs_fs *uxfs_sb(struct super_block *sb)
+{
+	return (struct uxfs_fs *)sb->s_fs_info;
+}
+
+/*
+ * Statistics helpers, see uxfs_stats.c
+ */
+
+extern int uxfs_stats_init(void);
+extern void uxfs_stats_exit(void);
+extern int uxfs_sysfs_register(struct super_block *);
+extern void uxfs_sysfs_unregister(struct super_block *);
+extern void uxfs_dirty_super(struct super_block *);
+extern void uxfs_write_super(struct super_block *);
+
+/*
+ * Free extent index, see uxfs_extent.c
+ */
+
+extern void uxfs_fext_reset(struct super_block *);
+extern void uxfs_fext_destroy(struct super_block *);
+extern __u32 uxfs_fext_alloc(struct super_block *, __u32, unsigned *,
+			     unsigned);
+extern __u32 uxfs_fext_goal(struct super_block *, unsigned);
+extern void uxfs_fext_free(struct super_block *, __u32, unsigned);
+extern int uxfs_fext_init(void);
+extern void uxfs_fext_exit(void);
+
+/*
+ * Reservation windows, see uxfs_rsv.c
+ */
+
+extern __u32 uxfs_rsv_alloc(struct inode *, sector_t);
+extern void uxfs_rsv_discard(struct inode *);
+extern int uxfs_rsv_drop_all(struct super_block *, int);
+
+/*
+ * Directory name cache, see uxfs_ncache.c
+ */
+
+extern int uxfs_ncache_find(struct inode *, const char *);
+extern int uxfs_ncache_slot(struct inode *, const char *);
+extern int uxfs_ncache_free_slot(struct inode *);
+extern void uxfs_ncache_add(struct inode *, const char *, __u32, int);
+extern void uxfs_ncache_del(struct inode *, const char *);
+extern void uxfs_ncache_drop(struct inode *);
+extern int uxfs_ncache_count(struct inode *);
+extern void uxfs_ncache_init(void);
+extern void uxfs_ncache_exit(void);
+
+/*
+ * Stat-ahead for directory listings, see uxfs_statahead.c
+ */
+
+extern struct uxfs_statahead *uxfs_sa_readdir_begin(struct inode *);
+extern void uxfs_sa_note(struct uxfs_statahead *, __u32);
+extern void uxfs_sa_readdir_end(struct inode *, struct uxfs_statahead *);
+extern void uxfs_sa_lookup(struct inode *, __u32);
+extern void uxfs_sa_free(struct inode *);
+extern void uxfs_sa_flush(void);
+extern int uxfs_sa_init(void);
+extern void uxfs_sa_exit(void);
+
+/*
+ * Block sharing, see uxfs_clone.c. The ioctl numbers are those of
+ * FICLONE and FICLONERANGE in later kernels so that existing tools
+ * ("cp --reflink") work unchanged.
+ */
+
+#ifndef FICLONE
+struct file_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+
+#define FICLONE		_IOW(0x94, 9, int)
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
+extern int uxfs_clone_range(struct file *, struct file *, u64, u64, u64);
+extern ssize_t uxfs_copy_range(struct file *, struct file *, u64, u64,
+			       u64);
+extern int uxfs_cow_page(struct inode *, struct page *, unsigned,
+			 unsigned);
+extern int uxfs_file_mmap(struct file *, struct vm_area_struct *);
+extern void uxfs_set_nowait(struct file *, int);
+
+/*
+ * Online defragmentation, see uxfs_defrag.c
+ */
+
+extern void uxfs_frag_count(struct super_block *, __u32 *,
+			    struct uxfs_frag *);
+extern int uxfs_defrag(struct inode *, struct uxfs_frag *);
+extern ssize_t uxfs_frag_show(struct super_block *, char *);
+
+/*
+ * Multi-device volumes, see uxfs_stripe.c. Data blocks must be read
+ * and mapped through these rather than sb_bread() and map_bh().
+ */
+
+extern int uxfs_devs_open(struct super_block *);
+extern void uxfs_devs_close(struct super_block *);
+extern int uxfs_devs_sync(struct super_block *, int);
+extern int uxfs_devs_fit(struct super_block *, __u32);
+extern struct block_device *uxfs_map_block(struct super_block *, __u32,
+					   sector_t *);
+extern unsigned uxfs_stripe_run(struct super_block *, __u32);
+extern void uxfs_map_bh(struct buffer_head *, struct super_block *, __u32);
+extern struct buffer_head *uxfs_bread(struct super_block *, __u32);
+extern struct buffer_head *uxfs_getblk(struct super_block *, __u32);
+
+static inline int uxfs_striped(struct super_block *sb)
+{
+	return uxfs_sb(sb)->u_devtab.d_ndevs > 1;
+}
+
+/*
+ * Transparent compression, see uxfs_compress.c
+ */
+
+extern struct address_space_operations uxfs_compr_aops;
+extern int uxfs_set_compr(struct inode *, int);
+extern void uxfs_compr_init(void);
+extern void uxfs_compr_exit(void);
+
+static inline void uxfs_set_file_aops(struct inode *inode)
+{
+	if (uxfs_i(inode)->i_flags & UXFS_COMPR_FL)
+		inode->i_mapping->a_ops = &uxfs_compr_aops;
+	else if (uxfs_striped(inode->i_sb))
+		inode->i_mapping->a_ops = &uxfs_stripe_aops;
+	else
+		inode->i_mapping->a_ops = &uxfs_aops;
+}
+
+/*
+ * Directories are never compressed.
+ */
+
+static inline void uxfs_set_dir_aops(struct inode *inode)
+{
+	if (uxfs_striped(inode->i_sb))
+		inode->i_mapping->a_ops = &uxfs_stripe_aops;
+	else
+		inode->i_mapping->a_ops = &uxfs_aops;
+}
+
+/*
+ * Deferred freeing of unlinked inodes, see uxfs_free.c
+ */
+
+extern int uxfs_free_queue(struct inode *);
+extern void uxfs_free_drain(struct super_block *);
+extern int uxfs_free_pending(struct super_block *);
+extern void uxfs_free_counts(struct super_block *, unsigned long *,
+			     unsigned long *);
+extern void uxfs_free_init(struct super_block *);
+extern void uxfs_free_resume(struct super_block *);
+extern void uxfs_free_stop(struct super_block *);
+
+/*
+ * Snapshots, see uxfs_snap.c
+ */
+
+extern struct inode_operations uxfs_snap_dir_inops;
+extern struct file_operations uxfs_snap_dir_operations;
+extern struct file_operations uxfs_snap_file_operations;
+extern const struct dentry_operations uxfs_snap_dops;
+extern int uxfs_snap_load(struct super_block *);
+extern void uxfs_snap_resume(struct super_block *);
+extern void uxfs_snap_stop(struct super_block *);
+extern int uxfs_snap_create(struct super_block *);
+extern int uxfs_snap_delete(struct super_block *);
+extern void uxfs_snap_info(struct super_block *, struct uxfs_snapinfo *);
+extern int uxfs_snap_owns(struct super_block *, __u32);
+extern void uxfs_snap_taken(struct super_block *, __u32, unsigned);
+extern int uxfs_snap_hold(struct super_block *, __u32);
+extern int uxfs_snap_save_inode(struct super_block *, unsigned long);
+extern int uxfs_snap_iget(struct inode *);
+extern void uxfs_snap_iput(struct inode *);
+extern void uxfs_snap_init_inode(struct inode *);
+extern struct buffer_head *uxfs_snap_bread(struct super_block *,
+					  unsigned long,
+					  struct uxfs_inode **);
+extern struct dentry *uxfs_snap_lookup(struct inode *, struct dentry *);
+
+static inline int uxfs_snap_ino(unsigned long ino)
+{
+	return ino >= UXFS_SNAP_INO;
+}
+
+static inline void uxfs_stat_add(struct super_block *sb, int stat, long n)
+{
+	atomic_long_add(n, &uxfs_sb(sb)->u_stats[stat]);
+}
+
+static inline void uxfs_stat_inc(struct super_block *sb, int stat)
+{
+	atomic_long_inc(&uxfs_sb(sb)->u_stats[stat]);
+}
+
+static inline u64 uxfs_lat_start(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/*
+ * Account the time since "start" to the histogram of "op" and
+ * return it so that it can be handed to the tracepoint as well.
+ */
+
+static inline u64 uxfs_lat_end(struct super_block *sb, int op, u64 start)
+{
+	u64 ns = ktime_to_ns(ktime_get()) - start;
+	unsigned long us = (unsigned long)div_u64(ns, 1000);
+	int b = us ? min(fls_long(us), UXFS_LAT_BUCKETS - 1) : 0;
+
+	atomic_long_inc(&uxfs_sb(sb)->u_lat[op][b]);
+	return ns;
+}
+
 #endif
@@ -7,9 +7,117 @@
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/fs.h>
+#include <linux/buffer_head.h>
 #include <asm/uaccess.h>
 #include "uxfs.h"
 
+/*
+ * Mark the superblock dirty. All updates of the in-core allocation
+ * maps go through here so that we can see how often that happens.
+ */
+
+void uxfs_dirty_super(struct super_block *sb)
+{
+	uxfs_stat_inc(sb, UXFS_STAT_SUPER_DIRTY);
+	sb->s_dirt = 1;
+}
+
+/*
+ * The reference count of data block "i", counted from the first
+ * data block, in the block map. Map blocks are read the first time
+ * their region is needed and kept until unmount. Returns NULL if
+ * the map block can't be read. Called with u_alloc_lock held.
+ */
+
+char *uxfs_map_entry(struct super_block *sb, __u32 i)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	unsigned r = i / UXFS_REGION_BLOCKS;
+
+	if (fs->u_inline_map)
+		return &fs->u_sb->s_block[i];
+	if (!fs->u_map_bh[r]) {
+		fs->u_map_bh[r] = sb_bread(sb, UXFS_MAP_BLOCK + r);
+		if (!fs->u_map_bh[r]) {
+			printk(KERN_ERR "uxfs: Unable to read block map %u "
+			       "of %s\n", r, sb->s_id);
+			return NULL;
+		}
+	}
+	return fs->u_map_bh[r]->b_data + i % UXFS_REGION_BLOCKS;
+}
+
+/*
+ * The entry for block "i" changed. An inline map is written with
+ * the superblock, which the caller marks dirty as before.
+ */
+
+void uxfs_map_dirty(struct super_block *sb, __u32 i)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+
+	if (!fs->u_inline_map)
+		mark_buffer_dirty(fs->u_map_bh[i / UXFS_REGION_BLOCKS]);
+}
+
+/*
+ * Write the map entries of "count" blocks from "blk", and the
+ * superblock with its free counts, through to disk.
+ */
+
+int uxfs_map_sync(struct super_block *sb, __u32 blk, unsigned count)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	__u32 i = blk - UXFS_FIRST_DATA_BLOCK;
+	unsigned r;
+	int error = 0;
+
+	if (!fs->u_inline_map) {
+		for (r = i / UXFS_REGION_BLOCKS;
+		     r <= (i + count - 1) / UXFS_REGION_BLOCKS; r++) {
+			if (fs->u_map_bh[r] && !error)
+				error = sync_dirty_buffer(fs->u_map_bh[r]);
+		}
+	}
+	mark_buffer_dirty(fs->u_sbh);
+	if (!error)
+		error = sync_dirty_buffer(fs->u_sbh);
+	return error;
+}
+
+/*
+ * Mount: only the per-region free counts are needed, and volumes
+ * with an inline map, which have none on disk, get them counted
+ * from the map in the superblock.
+ */
+
+void uxfs_map_init(struct super_block *sb)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	struct uxfs_superblock *usb = fs->u_sb;
+	__u32 i, n = uxfs_nblocks(usb);
+
+	fs->u_inline_map = uxfs_inline_map(usb);
+	if (!fs->u_inline_map) {
+		fs->u_rfree = uxfs_mapsum(usb)->m_free;
+		return;
+	}
+	fs->u_rfree = fs->u_rfree_inline;
+	for (i = 0; i < n; i++) {
+		if (usb->s_block[i] == UXFS_BLOCK_FREE)
+			fs->u_rfree[i / UXFS_REGION_BLOCKS]++;
+	}
+}
+
+void uxfs_map_release(struct super_block *sb)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	int r;
+
+	for (r = 0; r < UXFS_NREGIONS; r++)
+		brelse(fs->u_map_bh[r]);
+}
+
 /*
  * Allocate a new inode. We update the superblock and return
  * the inode number.
@@ -21,7 +129,15 @@ ino_t uxfs_ialloc(struct super_block *sb)
 	struct uxfs_superblock *usb = fs->u_sb;
 	int i;
 
+	uxfs_stat_inc(sb, UXFS_STAT_IALLOC);
+	mutex_lock(&fs->u_alloc_lock);
+	if (usb->s_nifree == 0 && uxfs_free_pending(sb)) {
+		mutex_unlock(&fs->u_alloc_lock);
+		uxfs_free_drain(sb);
+		mutex_lock(&fs->u_alloc_lock);
+	}
 	if (usb->s_nifree == 0) {
+		mutex_unlock(&fs->u_alloc_lock);
 		printk(KERN_WARNING "uxfs: Out of inodes\n");
 		return 0;
 	}
@@ -29,45 +145,283 @@ ino_t uxfs_ialloc(struct super_block *sb)
 		if (usb->s_inode[i] == UXFS_INODE_FREE) {
 			usb->s_inode[i] = UXFS_INODE_INUSE;
 			usb->s_nifree--;
-			sb->s_dirt = 1;
+			uxfs_stat_add(sb, UXFS_STAT_IALLOC_SCAN, i - 2);
+			uxfs_dirty_super(sb);
+			mutex_unlock(&fs->u_alloc_lock);
 			return i;
 		}
 	}
+	mutex_unlock(&fs->u_alloc_lock);
 	printk(KERN_ERR
 	       "uxfs: uxfs_ialloc - We should never reach here\n");
 	return 0;
 }
 
 /*
- * Allocate a new data block. We update the superblock and return
- * the new block  number.
+ * Allocate up to "*count" contiguous data blocks, and no fewer than
+ * "min", starting at "goal" if it can (0 for no preference). The
+ * free extent index picks the blocks, see uxfs_fext_alloc(). We
+ * update the superblock and return the first block number with
+ * "*count" set to the number allocated, or 0 if there's no room.
  */
 
-__u32 uxfs_block_alloc(struct super_block * sb)
+__u32 uxfs_alloc_blocks(struct super_block *sb, __u32 goal, unsigned *count,
+			unsigned min)
 {
 	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
 	struct uxfs_superblock *usb = fs->u_sb;
-	int i;
+	__u32 blk;
 
-	if (usb->s_nbfree == 0) {
+	uxfs_stat_inc(sb, UXFS_STAT_BALLOC);
+	mutex_lock(&fs->u_alloc_lock);
+	if (usb->s_nbfree < min && uxfs_free_pending(sb)) {
+		mutex_unlock(&fs->u_alloc_lock);
+		uxfs_free_drain(sb);
+		mutex_lock(&fs->u_alloc_lock);
+	}
+	if (usb->s_nbfree < min) {
+		mutex_unlock(&fs->u_alloc_lock);
 		printk(KERN_WARNING "uxfs: Out of space\n");
 		return 0;
 	}
 
 	/*
-	 * Start looking at block 1. Block 0 is 
-	 * for the root directory.
+	 * Free blocks the index can't find are in reservation windows
+	 * of other files; take those back and try again.
 	 */
 
-	for (i = 1; i < UXFS_MAXBLOCKS; i++) {
-		if (usb->s_block[i] == UXFS_BLOCK_FREE) {
-			usb->s_block[i] = UXFS_BLOCK_INUSE;
-			usb->s_nbfree--;
-			sb->s_dirt = 1;
-			return UXFS_FIRST_DATA_BLOCK + i;
+	blk = uxfs_fext_alloc(sb, goal, count, min);
+	if (!blk && uxfs_rsv_drop_all(sb, 1))
+		blk = uxfs_fext_alloc(sb, goal, count, min);
+	if (blk)
+		uxfs_blocks_taken(sb, blk, *count);
+	mutex_unlock(&fs->u_alloc_lock);
+
+	if (blk && goal && blk == goal)
+		uxfs_stat_inc(sb, UXFS_STAT_BALLOC_GOAL);
+	return blk;
+}
+
+/*
+ * Mark "count" blocks from "blk", just taken out of the free extent
+ * index, allocated, and new to a snapshot if there is one. Called
+ * with u_alloc_lock held.
+ */
+
+void uxfs_blocks_taken(struct super_block *sb, __u32 blk, unsigned count)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	struct uxfs_superblock *usb = fs->u_sb;
+	__u32 i, end = blk + count - UXFS_FIRST_DATA_BLOCK;
+	char *ref;
+
+	for (i = blk - UXFS_FIRST_DATA_BLOCK; i < end; i++) {
+		ref = uxfs_map_entry(sb, i);
+		if (ref) {
+			*ref = UXFS_BLOCK_INUSE;
+			uxfs_map_dirty(sb, i);
+		}
+		fs->u_rfree[i / UXFS_REGION_BLOCKS]--;
+	}
+	usb->s_nbfree -= count;
+	uxfs_snap_taken(sb, blk, count);
+	uxfs_stat_add(sb, UXFS_STAT_BALLOC_BLOCKS, count);
+	uxfs_dirty_super(sb);
+}
+
+/*
+ * Allocate a single data block, anywhere.
+ */
+
+__u32 uxfs_block_alloc(struct super_block * sb)
+{
+	unsigned count = 1;
+
+	return uxfs_alloc_blocks(sb, 0, &count, 1);
+}
+
+/*
+ * Where block "iblock" of a file or directory should go: right
+ * after the closest allocated block before it, so that the file
+ * stays contiguous, or, if there's none, at the start of a free
+ * extent that can hold the rest of the file.
+ */
+
+__u32 uxfs_block_goal(struct inode *inode, sector_t iblock)
+{
+	struct uxfs_fs *fs = uxfs_sb(inode->i_sb);
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	sector_t i;
+	__u32 goal;
+
+	for (i = iblock; i-- > 0;) {
+		if (uxi->i_addr[i])
+			return uxi->i_addr[i] + (iblock - i);
+	}
+	mutex_lock(&fs->u_alloc_lock);
+	goal = uxfs_fext_goal(inode->i_sb, UXFS_DIRECT_BLOCKS - iblock);
+	mutex_unlock(&fs->u_alloc_lock);
+	return goal;
+}
+
+static int uxfs_block_valid(struct super_block *sb, __u32 blk)
+{
+	if (blk < UXFS_FIRST_DATA_BLOCK ||
+	    blk >= UXFS_FIRST_DATA_BLOCK + uxfs_nblocks(uxfs_sb(sb)->u_sb)) {
+		printk(KERN_ERR "uxfs: Bad block number %u\n", blk);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Take another reference to an allocated data block, for a file
+ * that is going to share it.
+ */
+
+int uxfs_block_get(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	char *ref;
+
+	if (!uxfs_block_valid(sb, blk))
+		return -EIO;
+	mutex_lock(&fs->u_alloc_lock);
+	ref = uxfs_map_entry(sb, blk - UXFS_FIRST_DATA_BLOCK);
+	if (!ref || *ref == UXFS_BLOCK_FREE || *ref >= UXFS_BLOCK_MAXREF) {
+		mutex_unlock(&fs->u_alloc_lock);
+		return !ref || *ref == UXFS_BLOCK_FREE ? -EIO : -EMLINK;
+	}
+	(*ref)++;
+	uxfs_map_dirty(sb, blk - UXFS_FIRST_DATA_BLOCK);
+	uxfs_dirty_super(sb);
+	mutex_unlock(&fs->u_alloc_lock);
+	return 0;
+}
+
+/*
+ * Is the block mapped by more than one file, or part of a snapshot?
+ * Either way it must not be written in place.
+ */
+
+int uxfs_block_shared(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	char *ref;
+	int shared = 0;
+
+	if (!uxfs_block_valid(sb, blk))
+		return 0;
+	mutex_lock(&fs->u_alloc_lock);
+	ref = uxfs_map_entry(sb, blk - UXFS_FIRST_DATA_BLOCK);
+	if (ref && *ref != UXFS_BLOCK_FREE)
+		shared = *ref > UXFS_BLOCK_INUSE || uxfs_snap_owns(sb, blk);
+	mutex_unlock(&fs->u_alloc_lock);
+	return shared;
+}
+
+/*
+ * Drop a reference to a data block. The block goes back to the
+ * free pool when the last file using it lets go, unless a snapshot
+ * still has it. Called with u_alloc_lock held; the caller marks
+ * the superblock dirty.
+ */
+
+int uxfs_block_put(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	struct uxfs_superblock *usb = fs->u_sb;
+	__u32 i = blk - UXFS_FIRST_DATA_BLOCK;
+	char *ref;
+
+	if (!uxfs_block_valid(sb, blk))
+		return -EIO;
+	ref = uxfs_map_entry(sb, i);
+	if (!ref)
+		return -EIO;
+	if (*ref == UXFS_BLOCK_FREE) {
+		printk(KERN_ERR "uxfs: Freeing free block %u\n", blk);
+		return -EIO;
+	}
+	if (--(*ref) == UXFS_BLOCK_FREE) {
+		if (uxfs_snap_hold(sb, blk))
+			*ref = UXFS_BLOCK_INUSE;
+		else {
+			usb->s_nbfree++;
+			fs->u_rfree[i / UXFS_REGION_BLOCKS]++;
+			uxfs_fext_free(sb, blk, 1);
 		}
 	}
-	printk(KERN_ERR "uxfs: uxfs_block_alloc - "
-	       "We should never reach here\n");
+	uxfs_map_dirty(sb, i);
 	return 0;
 }
+
+void uxfs_block_free(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+
+	mutex_lock(&fs->u_alloc_lock);
+	if (!uxfs_block_put(sb, blk))
+		uxfs_dirty_super(sb);
+	mutex_unlock(&fs->u_alloc_lock);
+}
+
+/*
+ * Grow the volume to "*nblocks" data blocks, or if that is zero to
+ * as many as fit on its devices, which must have been enlarged
+ * first. The new blocks are free and go straight into the free
+ * extent index, so allocations can use them at once. The inode
+ * table has room for UXFS_MAXFILES inodes from the start and does
+ * not grow. Returns the new size in "*nblocks".
+ */
+
+int uxfs_grow(struct super_block *sb, __u32 *nblocks)
+{
+	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
+	struct uxfs_superblock *usb = fs->u_sb;
+	__u32 i, old, new = *nblocks;
+	char *ref;
+	int error = 0;
+
+	if (new > UXFS_MAXBLOCKS)
+		return -EFBIG;
+	if (!new) {
+		for (new = UXFS_MAXBLOCKS; new > 0; new--) {
+			if (uxfs_devs_fit(sb, new))
+				break;
+		}
+	} else if (!uxfs_devs_fit(sb, new))
+		return -ENOSPC;
+
+	mutex_lock(&fs->u_alloc_lock);
+	old = uxfs_nblocks(usb);
+	if (new < old)
+		error = *nblocks ? -EINVAL : 0;
+	else if (new > old) {
+		/*
+		 * If a map block can't be read, grow as far as the
+		 * blocks before it.
+		 */
+
+		for (i = old; i < new; i++) {
+			ref = uxfs_map_entry(sb, i);
+			if (!ref) {
+				error = -EIO;
+				break;
+			}
+			*ref = UXFS_BLOCK_FREE;
+			uxfs_map_dirty(sb, i);
+			fs->u_rfree[i / UXFS_REGION_BLOCKS]++;
+		}
+		new = i;
+	}
+	if (new > old) {
+		usb->s_nblocks = new;
+		usb->s_nbfree += new - old;
+		uxfs_fext_free(sb, UXFS_FIRST_DATA_BLOCK + old, new - old);
+		uxfs_dirty_super(sb);
+	}
+	*nblocks = uxfs_nblocks(usb);
+	mutex_unlock(&fs->u_alloc_lock);
+	return error;
+}
@@ -0,0 +1,365 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- uxfs_clone.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/sched.h>
+#include <linux/buffer_head.h>
+#include "uxfs.h"
+
+/*
+ * Block sharing. A clone makes a range of one file map the same
+ * disk blocks as a range of another (or the same) file, taking a
+ * reference on each block instead of copying it. A shared block is
+ * never written in place: before a page is modified, through
+ * write(2) or a shared mapping, every block it is about to dirty
+ * that is still shared is replaced by a private one. Compressed
+ * files do the same when a cluster is stored, see uxfs_compress.c.
+ *
+ * Copies that can't be clones are done here too, page by page
+ * between the two page caches, so the data never crosses into user
+ * space.
+ */
+
+/*
+ * Called with the page locked and its buffers mapped, before the
+ * bytes [from, to) of the page are modified. The old contents of a
+ * buffer that isn't uptodate are read before it is moved, so that
+ * a short copy into the page cannot lose them.
+ */
+
+int uxfs_cow_page(struct inode *inode, struct page *page, unsigned from,
+		  unsigned to)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *head, *bh;
+	struct block_device *bdev;
+	sector_t iblock, phys;
+	unsigned start = 0, end, n;
+	__u32 blk;
+
+	if (!page_has_buffers(page))
+		return 0;
+	iblock = (sector_t)page->index << (PAGE_CACHE_SHIFT - UXFS_BSIZE_BITS);
+	head = bh = page_buffers(page);
+	do {
+		end = start + bh->b_size;
+		if (end <= from || start >= to || !buffer_mapped(bh) ||
+		    !uxfs_block_shared(sb, uxi->i_addr[iblock]))
+			goto next;
+		if (!buffer_uptodate(bh)) {
+			ll_rw_block(READ, 1, &bh);
+			wait_on_buffer(bh);
+			if (!buffer_uptodate(bh))
+				return -EIO;
+		}
+		n = 1;
+		blk = uxfs_alloc_blocks(sb, uxfs_block_goal(inode, iblock),
+					&n, 1);
+		if (!blk)
+			return -ENOSPC;
+		bdev = uxfs_map_block(sb, blk, &phys);
+		unmap_underlying_metadata(bdev, phys);
+		uxfs_block_free(sb, uxi->i_addr[iblock]);
+		uxfs_map_bh(bh, sb, blk);
+		uxi->i_addr[iblock] = blk;
+		mark_inode_dirty(inode);
+		uxfs_stat_inc(sb, UXFS_STAT_COW_BLOCKS);
+	      next:
+		start = end;
+		iblock++;
+	} while ((bh = bh->b_this_page) != head);
+	return 0;
+}
+
+/*
+ * Writes through a shared mapping reach the page without going
+ * through write_begin, so break the sharing when the page is first
+ * made writable.
+ */
+
+static int uxfs_page_mkwrite(struct vm_area_struct *vma,
+			     struct vm_fault *vmf)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	int ret;
+
+	if (uxfs_i(inode)->i_flags & UXFS_COMPR_FL)
+		return 0;
+	ret = block_page_mkwrite(vma, vmf, uxfs_get_block);
+	if (ret != VM_FAULT_LOCKED)
+		return ret;
+	if (uxfs_cow_page(inode, vmf->page, 0, PAGE_CACHE_SIZE)) {
+		unlock_page(vmf->page);
+		return VM_FAULT_SIGBUS;
+	}
+	return ret;
+}
+
+static const struct vm_operations_struct uxfs_file_vm_ops = {
+	.fault = filemap_fault,
+	.page_mkwrite = uxfs_page_mkwrite,
+};
+
+int uxfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (!file->f_mapping->a_ops->readpage)
+		return -ENOEXEC;
+	file_accessed(file);
+	vma->vm_ops = &uxfs_file_vm_ops;
+	vma->vm_flags |= VM_CAN_NONLINEAR;
+	return 0;
+}
+
+static void uxfs_lock_two(struct inode *a, struct inode *b)
+{
+	if (a == b)
+		mutex_lock(&a->i_mutex);
+	else if (a < b) {
+		mutex_lock_nested(&a->i_mutex, I_MUTEX_PARENT);
+		mutex_lock_nested(&b->i_mutex, I_MUTEX_CHILD);
+	} else {
+		mutex_lock_nested(&b->i_mutex, I_MUTEX_PARENT);
+		mutex_lock_nested(&a->i_mutex, I_MUTEX_CHILD);
+	}
+}
+
+static void uxfs_unlock_two(struct inode *a, struct inode *b)
+{
+	mutex_unlock(&a->i_mutex);
+	if (a != b)
+		mutex_unlock(&b->i_mutex);
+}
+
+/*
+ * Make "len" bytes of "dst_file" at "destoff" share the blocks of
+ * "src_file" at "off". A length of zero means up to the end of the
+ * source. Offsets must be block aligned (cluster aligned for
+ * compressed files, which share whole clusters); the length too,
+ * unless the range ends at the end of the source and the clone
+ * extends the destination.
+ */
+
+int uxfs_clone_range(struct file *dst_file, struct file *src_file, u64 off,
+		     u64 len, u64 destoff)
+{
+	struct inode *src = src_file->f_path.dentry->d_inode;
+	struct inode *dst = dst_file->f_path.dentry->d_inode;
+	struct uxfs_inode_info *sip = uxfs_i(src);
+	struct uxfs_inode_info *dip = uxfs_i(dst);
+	struct super_block *sb = dst->i_sb;
+	unsigned long unit, sbno, dbno, nblocks, i;
+	loff_t start, end;
+	__u32 blk, old;
+	int error = 0;
+
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		return -EINVAL;
+	if (src->i_sb != sb)
+		return -EXDEV;
+
+	/*
+	 * Snapshot blocks are only the snapshot's to give back;
+	 * uxfs_copy_range() copies them instead.
+	 */
+
+	if (uxfs_snap_ino(src->i_ino))
+		return -EXDEV;
+	if ((sip->i_flags ^ dip->i_flags) & UXFS_COMPR_FL)
+		return -EINVAL;
+	unit = (dip->i_flags & UXFS_COMPR_FL) ? UXFS_CLUSTER_SIZE : UXFS_BSIZE;
+
+	uxfs_lock_two(src, dst);
+
+	error = -EINVAL;
+	if (off > src->i_size)
+		goto out;
+	if (len == 0)
+		len = src->i_size - off;
+	if (len == 0 || off + len > src->i_size)
+		goto out;
+	if ((off | destoff) & (unit - 1))
+		goto out;
+	if ((len & (unit - 1)) &&
+	    (off + len != src->i_size || destoff + len < dst->i_size))
+		goto out;
+	if (src == dst && destoff + len > off && off + len > destoff)
+		goto out;
+
+	sbno = off >> UXFS_BSIZE_BITS;
+	dbno = destoff >> UXFS_BSIZE_BITS;
+	nblocks = DIV_ROUND_UP(len, unit) * (unit >> UXFS_BSIZE_BITS);
+	error = -EFBIG;
+	if (dbno + nblocks > UXFS_DIRECT_BLOCKS)
+		goto out;
+
+	/*
+	 * The blocks have to hold what the source's page cache holds,
+	 * and the destination's cache must not keep pages or buffers
+	 * of the blocks it is about to lose. Only the pages over the
+	 * cloned range go; they are clean once written back, so those
+	 * it shares with blocks outside the range lose nothing.
+	 */
+
+	error = filemap_write_and_wait(src->i_mapping);
+	if (!error)
+		error = filemap_write_and_wait(dst->i_mapping);
+	if (error)
+		goto out;
+	start = round_down(destoff, PAGE_CACHE_SIZE);
+	end = round_up(destoff + ((loff_t)nblocks << UXFS_BSIZE_BITS),
+		       PAGE_CACHE_SIZE);
+	unmap_mapping_range(dst->i_mapping, start, end - start, 1);
+	truncate_inode_pages_range(dst->i_mapping, start, end - 1);
+
+	/*
+	 * Take all the references first so that running out of them
+	 * leaves the destination as it was.
+	 */
+
+	for (i = 0; i < nblocks; i++) {
+		blk = sip->i_addr[sbno + i];
+		if (blk && (error = uxfs_block_get(sb, blk)))
+			break;
+	}
+	if (error) {
+		while (i-- > 0) {
+			if (sip->i_addr[sbno + i])
+				uxfs_block_free(sb, sip->i_addr[sbno + i]);
+		}
+		goto out;
+	}
+	for (i = 0; i < nblocks; i++) {
+		blk = sip->i_addr[sbno + i];
+		old = dip->i_addr[dbno + i];
+		if (old) {
+			uxfs_block_free(sb, old);
+			dst->i_blocks--;
+		}
+		dip->i_addr[dbno + i] = blk;
+		if (blk) {
+			dst->i_blocks++;
+			uxfs_stat_inc(sb, UXFS_STAT_CLONE_BLOCKS);
+		}
+	}
+	if (destoff + len > dst->i_size)
+		i_size_write(dst, destoff + len);
+	dst->i_mtime = dst->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dst);
+
+      out:
+	uxfs_unlock_two(src, dst);
+	return error;
+}
+
+/*
+ * Copy "len" bytes from "src_file" at "off" to "dst_file" at
+ * "destoff", zero meaning up to the end of the source. Whatever can
+ * be cloned is; otherwise the source is read ahead over the whole
+ * range, so that it comes in with a few large reads, and written to
+ * the destination through write_begin/write_end like write(2)
+ * would. Returns the number of bytes copied.
+ */
+
+ssize_t uxfs_copy_range(struct file *dst_file, struct file *src_file,
+			u64 off, u64 len, u64 destoff)
+{
+	struct inode *src = src_file->f_path.dentry->d_inode;
+	struct inode *dst = dst_file->f_path.dentry->d_inode;
+	struct address_space *smap = src->i_mapping;
+	struct address_space *dmap = dst->i_mapping;
+	struct page *spage, *dpage;
+	unsigned long soff, doff, n;
+	pgoff_t index;
+	loff_t pos = destoff;
+	size_t count;
+	ssize_t copied = 0;
+	char *from, *to;
+	void *fsdata;
+	int error = 0;
+
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		return -EINVAL;
+	if (off >= i_size_read(src))
+		return 0;
+	if (len == 0 || off + len > i_size_read(src))
+		len = i_size_read(src) - off;
+	if (src == dst && destoff + len > off && off + len > destoff)
+		return -EINVAL;
+
+	/*
+	 * The size limits apply as they would to write(2), which may
+	 * cut the copy short.
+	 */
+
+	count = len;
+	error = generic_write_checks(dst_file, &pos, &count, 0);
+	if (error)
+		return error;
+	if (count == 0)
+		return 0;
+	len = count;
+	if (!uxfs_clone_range(dst_file, src_file, off, len, destoff))
+		return len;
+
+	mutex_lock(&dst->i_mutex);
+	error = file_remove_suid(dst_file);
+	if (error)
+		goto out;
+	file_update_time(dst_file);
+	page_cache_sync_readahead(smap, &src_file->f_ra, src_file,
+				  off >> PAGE_CACHE_SHIFT,
+				  DIV_ROUND_UP((off & ~PAGE_CACHE_MASK) + len,
+					       PAGE_CACHE_SIZE));
+
+	while (len) {
+		index = off >> PAGE_CACHE_SHIFT;
+		soff = off & ~PAGE_CACHE_MASK;
+		doff = destoff & ~PAGE_CACHE_MASK;
+		n = min_t(u64, len, PAGE_CACHE_SIZE - max(soff, doff));
+
+		spage = read_mapping_page(smap, index, src_file);
+		if (IS_ERR(spage)) {
+			error = PTR_ERR(spage);
+			break;
+		}
+		error = pagecache_write_begin(dst_file, dmap, destoff, n, 0,
+					      &dpage, &fsdata);
+		if (error) {
+			page_cache_release(spage);
+			break;
+		}
+		from = kmap(spage);
+		to = kmap(dpage);
+		memcpy(to + doff, from + soff, n);
+		kunmap(dpage);
+		kunmap(spage);
+		flush_dcache_page(dpage);
+		error = pagecache_write_end(dst_file, dmap, destoff, n, n,
+					    dpage, fsdata);
+		page_cache_release(spage);
+		if (error < 0)
+			break;
+		n = error;
+		error = 0;
+
+		off += n;
+		destoff += n;
+		len -= n;
+		copied += n;
+		balance_dirty_pages_ratelimited(dmap);
+		if (fatal_signal_pending(current)) {
+			error = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+      out:
+	mutex_unlock(&dst->i_mutex);
+	return copied ? copied : error;
+}
@@ -0,0 +1,419 @@
+/*--------------------------------------------------------------*/
+/*------------------------- uxfs_compress.c ----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/buffer_head.h>
+#include <linux/crypto.h>
+#include <linux/mutex.h>
+#include "uxfs.h"
+
+/*
+ * Transparent compression of file data, for files with
+ * UXFS_COMPR_FL set.
+ *
+ * Data is compressed a cluster of UXFS_CLUSTER_SIZE bytes at a
+ * time, independent of the page size, so that a volume reads the
+ * same on any machine; a page holds one or more whole clusters.
+ * The UXFS_CLUSTER_BLOCKS slots of i_addr[] that would map a
+ * cluster are used for its compressed image: the first n slots
+ * hold blocks, the rest are zero. The image starts with its length
+ * as a little endian 32 bit word followed by the compressed bytes.
+ * A cluster that does not compress by at least one block is stored
+ * as is in all its slots, which is how the two cases are told
+ * apart.
+ *
+ * Only the blocks actually used are allocated, so the free counts
+ * in the superblock, and with them uxfs_statfs(), and the block
+ * count of the inode reflect the compressed size. A cluster is
+ * stored by first getting every block the new image needs, with
+ * new ones for blocks shared with a clone, and only then writing
+ * it and letting go of the blocks it no longer uses; running out
+ * of space on the way leaves the old image as it was.
+ *
+ * Pages of compressed files never get buffer_heads; all block I/O
+ * goes through the buffer cache of the device.
+ */
+
+#define UXFS_CLUSTERS		(UXFS_DIRECT_BLOCKS / UXFS_CLUSTER_BLOCKS)
+#define UXFS_PAGE_CLUSTERS	(PAGE_CACHE_SIZE / UXFS_CLUSTER_SIZE)
+#define UXFS_COMPR_ALG		"lzo"
+
+/*
+ * Room for the length word plus the worst case expansion of LZO,
+ * which does not check the size of its output buffer.
+ */
+
+#define UXFS_COMPR_BUFSIZE \
+	(4 + UXFS_CLUSTER_SIZE + UXFS_CLUSTER_SIZE / 16 + 67)
+
+static struct crypto_comp *uxfs_tfm;
+static DEFINE_MUTEX(uxfs_tfm_lock);
+
+/*
+ * Read cluster "c" of "inode" and expand it into "dst".
+ */
+
+static int uxfs_compr_read(struct inode *inode, unsigned c, char *dst)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	unsigned int clen, dlen = UXFS_CLUSTER_SIZE;
+	char *buf = NULL;
+	__u32 *addr;
+	int i, n = 0, error = 0;
+
+	if (c >= UXFS_CLUSTERS)
+		goto zero;
+	addr = &uxi->i_addr[c * UXFS_CLUSTER_BLOCKS];
+	while (n < UXFS_CLUSTER_BLOCKS && addr[n])
+		n++;
+	if (n == 0)
+		goto zero;
+
+	if (n == UXFS_CLUSTER_BLOCKS)
+		buf = dst;
+	else {
+		buf = kmalloc(n * UXFS_BSIZE, GFP_NOFS);
+		if (!buf)
+			return -ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		bh = uxfs_bread(sb, addr[i]);
+		if (!bh) {
+			error = -EIO;
+			goto out;
+		}
+		memcpy(buf + i * UXFS_BSIZE, bh->b_data, UXFS_BSIZE);
+		brelse(bh);
+	}
+	if (buf == dst)
+		return 0;
+
+	clen = le32_to_cpu(*(__le32 *) buf);
+	if (!uxfs_tfm || clen > n * UXFS_BSIZE - 4) {
+		printk(KERN_ERR "uxfs: Bad compressed cluster %u in "
+		       "inode %lu\n", c, inode->i_ino);
+		error = -EIO;
+		goto out;
+	}
+	mutex_lock(&uxfs_tfm_lock);
+	error = crypto_comp_decompress(uxfs_tfm, buf + 4, clen, dst, &dlen);
+	mutex_unlock(&uxfs_tfm_lock);
+	if (error) {
+		error = -EIO;
+		goto out;
+	}
+	memset(dst + dlen, 0, UXFS_CLUSTER_SIZE - dlen);
+      out:
+	if (buf != dst)
+		kfree(buf);
+	return error;
+
+      zero:
+	memset(dst, 0, UXFS_CLUSTER_SIZE);
+	return 0;
+}
+
+/*
+ * Expand the clusters backing "page" into it.
+ */
+
+static int uxfs_compr_fill(struct inode *inode, struct page *page)
+{
+	unsigned c = page->index * UXFS_PAGE_CLUSTERS;
+	char *kaddr;
+	int i, error = 0;
+
+	kaddr = kmap(page);
+	for (i = 0; i < UXFS_PAGE_CLUSTERS && !error; i++)
+		error = uxfs_compr_read(inode, c + i,
+					kaddr + i * UXFS_CLUSTER_SIZE);
+	flush_dcache_page(page);
+	kunmap(page);
+	return error;
+}
+
+/*
+ * Compress the first "len" bytes of "src" and store the result as
+ * cluster "c", growing or shrinking the cluster to fit.
+ */
+
+static int uxfs_compr_write(struct inode *inode, unsigned c, char *src,
+			    unsigned int len, char *buf, int sync)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	unsigned int clen = UXFS_COMPR_BUFSIZE - 4;
+	struct buffer_head *bhs[UXFS_CLUSTER_BLOCKS];
+	__u32 new[UXFS_CLUSTER_BLOCKS], *addr;
+	sector_t first = c * UXFS_CLUSTER_BLOCKS;
+	int i, n, error = 0;
+
+	mutex_lock(&uxfs_tfm_lock);
+	if (!uxfs_tfm || crypto_comp_compress(uxfs_tfm, src, len, buf + 4,
+					      &clen))
+		clen = UXFS_CLUSTER_SIZE;
+	mutex_unlock(&uxfs_tfm_lock);
+
+	n = DIV_ROUND_UP(4 + clen, UXFS_BSIZE);
+	if (n < UXFS_CLUSTER_BLOCKS)
+		*(__le32 *) buf = cpu_to_le32(clen);
+	else {
+		n = UXFS_CLUSTER_BLOCKS;
+		buf = src;
+	}
+
+	/*
+	 * Get all the blocks first: those of the cluster that are the
+	 * file's alone are written in place, the others are new.
+	 */
+
+	addr = &uxi->i_addr[first];
+	for (i = 0; i < n; i++) {
+		new[i] = addr[i];
+		if (addr[i] && !uxfs_block_shared(sb, addr[i]))
+			continue;
+		new[i] = uxfs_rsv_alloc(inode, first + i);
+		if (!new[i]) {
+			error = -ENOSPC;
+			goto undo;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		bhs[i] = uxfs_getblk(sb, new[i]);
+		if (!bhs[i]) {
+			while (i-- > 0)
+				brelse(bhs[i]);
+			error = -EIO;
+			i = n;
+			goto undo;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		lock_buffer(bhs[i]);
+		memcpy(bhs[i]->b_data, buf + i * UXFS_BSIZE, UXFS_BSIZE);
+		set_buffer_uptodate(bhs[i]);
+		unlock_buffer(bhs[i]);
+		mark_buffer_dirty(bhs[i]);
+		if (sync)
+			sync_dirty_buffer(bhs[i]);
+		brelse(bhs[i]);
+	}
+	for (i = 0; i < UXFS_CLUSTER_BLOCKS; i++) {
+		if (i < n && new[i] == addr[i])
+			continue;
+		if (addr[i]) {
+			uxfs_block_free(sb, addr[i]);
+			inode->i_blocks--;
+			if (i < n)
+				uxfs_stat_inc(sb, UXFS_STAT_COW_BLOCKS);
+		}
+		addr[i] = i < n ? new[i] : 0;
+		if (addr[i])
+			inode->i_blocks++;
+	}
+	mark_inode_dirty(inode);
+	return 0;
+
+      undo:
+	while (i-- > 0) {
+		if (new[i] != addr[i])
+			uxfs_block_free(sb, new[i]);
+	}
+	return error;
+}
+
+/*
+ * Store the first "len" bytes of "page" in its clusters.
+ */
+
+static int uxfs_compr_store(struct inode *inode, struct page *page,
+			    unsigned int len, int sync)
+{
+	unsigned c = page->index * UXFS_PAGE_CLUSTERS;
+	unsigned int off;
+	char *kaddr, *buf;
+	int error = 0;
+
+	if (c >= UXFS_CLUSTERS)
+		return -EFBIG;
+	buf = kmalloc(UXFS_COMPR_BUFSIZE, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+
+	kaddr = kmap(page);
+	if (len < PAGE_CACHE_SIZE)
+		memset(kaddr + len, 0, PAGE_CACHE_SIZE - len);
+	for (off = 0; off < len && c < UXFS_CLUSTERS && !error; c++) {
+		error = uxfs_compr_write(inode, c, kaddr + off,
+					 min_t(unsigned int, len - off,
+					       UXFS_CLUSTER_SIZE), buf, sync);
+		off += UXFS_CLUSTER_SIZE;
+	}
+	kunmap(page);
+	kfree(buf);
+	return error;
+}
+
+static int uxfs_compr_readpage(struct file *file, struct page *page)
+{
+	int error;
+
+	error = uxfs_compr_fill(page->mapping->host, page);
+	if (error)
+		SetPageError(page);
+	else
+		SetPageUptodate(page);
+	unlock_page(page);
+	return error;
+}
+
+static int uxfs_compr_writepage(struct page *page,
+				struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t isize = i_size_read(inode);
+	pgoff_t end_index = isize >> PAGE_CACHE_SHIFT;
+	unsigned int len = PAGE_CACHE_SIZE;
+	int error;
+
+	if (page->index >= end_index) {
+		len = isize & ~PAGE_CACHE_MASK;
+		if (page->index > end_index || !len) {
+			unlock_page(page);
+			return 0;
+		}
+	}
+	set_page_writeback(page);
+	error = uxfs_compr_store(inode, page, len,
+				 wbc->sync_mode == WB_SYNC_ALL);
+	if (error) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, error);
+	}
+	unlock_page(page);
+	end_page_writeback(page);
+	return error;
+}
+
+/*
+ * A partial write to a page that isn't cached needs the old
+ * contents expanded into it first. Nothing may land past the last
+ * cluster, which a large page can reach.
+ */
+
+static int uxfs_compr_write_begin(struct file *file,
+				  struct address_space *mapping, loff_t pos,
+				  unsigned len, unsigned flags,
+				  struct page **pagep, void **fsdata)
+{
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	struct page *page;
+	int error;
+
+	if (pos + len > UXFS_CLUSTERS * UXFS_CLUSTER_SIZE)
+		return -EFBIG;
+	page = grab_cache_page_write_begin(mapping, index, flags);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page) && len != PAGE_CACHE_SIZE) {
+		error = uxfs_compr_fill(mapping->host, page);
+		if (error) {
+			unlock_page(page);
+			page_cache_release(page);
+			return error;
+		}
+		SetPageUptodate(page);
+	}
+	*pagep = page;
+	return 0;
+}
+
+static int uxfs_compr_write_end(struct file *file,
+				struct address_space *mapping, loff_t pos,
+				unsigned len, unsigned copied,
+				struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(page)) {
+		if (copied < len)
+			zero_user(page, (pos & ~PAGE_CACHE_MASK) + copied,
+				  len - copied);
+		SetPageUptodate(page);
+	}
+	set_page_dirty(page);
+	unlock_page(page);
+	page_cache_release(page);
+
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		mark_inode_dirty(inode);
+	}
+	return copied;
+}
+
+struct address_space_operations uxfs_compr_aops = {
+	.readpage = uxfs_compr_readpage,
+	.writepage = uxfs_compr_writepage,
+	.write_begin = uxfs_compr_write_begin,
+	.write_end = uxfs_compr_write_end,
+};
+
+/*
+ * Turn compression on or off for an inode. Data already in a file
+ * is not converted, so a regular file can only change while it is
+ * empty. Called with i_mutex held.
+ */
+
+int uxfs_set_compr(struct inode *inode, int on)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+
+	if (!on == !(uxi->i_flags & UXFS_COMPR_FL))
+		return 0;
+	if (on && !uxfs_tfm)
+		return -EOPNOTSUPP;
+	if (S_ISREG(inode->i_mode)) {
+		if (inode->i_size || inode->i_blocks ||
+		    inode->i_mapping->nrpages)
+			return -EINVAL;
+	}
+	if (on)
+		uxi->i_flags |= UXFS_COMPR_FL;
+	else
+		uxi->i_flags &= ~UXFS_COMPR_FL;
+	if (S_ISREG(inode->i_mode))
+		uxfs_set_file_aops(inode);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+void __init uxfs_compr_init(void)
+{
+	BUILD_BUG_ON(PAGE_CACHE_SIZE % UXFS_CLUSTER_SIZE);
+	BUILD_BUG_ON(UXFS_DIRECT_BLOCKS % UXFS_CLUSTER_BLOCKS);
+
+	uxfs_tfm = crypto_alloc_comp(UXFS_COMPR_ALG, 0, 0);
+	if (IS_ERR(uxfs_tfm)) {
+		printk(KERN_WARNING "uxfs: No " UXFS_COMPR_ALG
+		       " support, compression disabled\n");
+		uxfs_tfm = NULL;
+	}
+}
+
+void uxfs_compr_exit(void)
+{
+	if (uxfs_tfm)
+		crypto_free_comp(uxfs_tfm);
+}
@@ -0,0 +1,359 @@
+/*--------------------------------------------------------------*/
+/*-------------------------- uxfs_defrag.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/buffer_head.h>
+#include "uxfs.h"
+
+/*
+ * Online defragmentation and fragmentation reports.
+ *
+ * UXFS_IOC_DEFRAG moves all the blocks of a file into a single free
+ * extent, in logical order, while the file stays open and in use:
+ *
+ *  - dirty pages are written back and then every page of the file
+ *    is locked in the page cache, so that nothing reads a block
+ *    into the cache, writes a page back or maps a new block while
+ *    the blocks move. write(2) and truncate are kept out by
+ *    i_mutex; writes through a shared mapping wait for the page
+ *    lock in page_mkwrite.
+ *  - the data is copied into the new extent and written out, and
+ *    the superblock with it, so that the new blocks are on disk and
+ *    marked in use before anything points at them.
+ *  - the new block map replaces the old one in the inode, buffers
+ *    attached to the pages are pointed at the new blocks, and the
+ *    inode is written synchronously.
+ *  - only then are the old blocks freed.
+ *
+ * A crash leaves the file either all in its old blocks or all in
+ * its new ones, at worst with the other set leaked. Holes stay
+ * holes. Files with blocks shared with a clone are refused, since
+ * moving those blocks would unshare them and use more space.
+ */
+
+#define UXFS_PAGE_BLOCKS	(PAGE_CACHE_SIZE >> UXFS_BSIZE_BITS)
+
+/*
+ * Extents are counted as runs of mapped blocks that are physically
+ * contiguous in logical order; holes don't end a run, since there
+ * is nothing a defrag could do about them.
+ */
+
+void uxfs_frag_count(struct super_block *sb, __u32 *addr,
+		     struct uxfs_frag *f)
+{
+	__u32 blk, prev = 0;
+	int i;
+
+	memset(f, 0, sizeof(*f));
+	for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
+		blk = addr[i];
+		if (blk == 0)
+			continue;
+		f->f_blocks++;
+		if (blk != prev + 1)
+			f->f_extents++;
+		if (uxfs_block_shared(sb, blk))
+			f->f_shared++;
+		prev = blk;
+	}
+}
+
+/*
+ * Fetch the current contents of block "iblock" of "inode", mapped
+ * by "blk", into "buf". The page lock is held, if there is a page.
+ * For compressed files the buffer cache of the device is where the
+ * data lives; for the others an uptodate page or buffer is newer
+ * than the disk, and the device's own buffer for the block may be
+ * stale, so it is read again.
+ */
+
+static int defrag_read(struct inode *inode, struct page *page,
+		       sector_t iblock, __u32 blk, char *buf)
+{
+	unsigned offset = (iblock % UXFS_PAGE_BLOCKS) << UXFS_BSIZE_BITS;
+	int compr = uxfs_i(inode)->i_flags & UXFS_COMPR_FL;
+	struct buffer_head *bh;
+	char *kaddr;
+
+	if (page && !compr) {
+		if (page_has_buffers(page)) {
+			bh = page_buffers(page);
+			while (bh_offset(bh) != offset)
+				bh = bh->b_this_page;
+			if (buffer_uptodate(bh)) {
+				memcpy(buf, bh->b_data, UXFS_BSIZE);
+				return 0;
+			}
+		} else if (PageUptodate(page)) {
+			kaddr = kmap(page);
+			memcpy(buf, kaddr + offset, UXFS_BSIZE);
+			kunmap(page);
+			return 0;
+		}
+	}
+
+	bh = uxfs_getblk(inode->i_sb, blk);
+	if (!bh)
+		return -EIO;
+	if (!compr) {
+		lock_buffer(bh);
+		if (!buffer_dirty(bh))
+			clear_buffer_uptodate(bh);
+		if (bh_submit_read(bh)) {
+			brelse(bh);
+			return -EIO;
+		}
+	} else if (!buffer_uptodate(bh)) {
+		ll_rw_block(READ, 1, &bh);
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh)) {
+			brelse(bh);
+			return -EIO;
+		}
+	}
+	memcpy(buf, bh->b_data, UXFS_BSIZE);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Point the buffers of a locked page that map old blocks at their
+ * new homes.
+ */
+
+static void defrag_remap_page(struct page *page, __u32 *old, __u32 *new)
+{
+	struct super_block *sb = page->mapping->host->i_sb;
+	struct buffer_head *head, *bh;
+	sector_t iblock;
+
+	if (!page_has_buffers(page))
+		return;
+	iblock = (sector_t)page->index * UXFS_PAGE_BLOCKS;
+	head = bh = page_buffers(page);
+	do {
+		if (iblock < UXFS_DIRECT_BLOCKS && buffer_mapped(bh) &&
+		    old[iblock])
+			uxfs_map_bh(bh, sb, new[iblock]);
+		iblock++;
+	} while ((bh = bh->b_this_page) != head);
+}
+
+/*
+ * Defragment the file behind "inode". On return "f" describes the
+ * file as it is now, with f_moved the number of blocks moved.
+ */
+
+int uxfs_defrag(struct inode *inode, struct uxfs_frag *f)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	struct address_space *mapping = inode->i_mapping;
+	struct page *pages[UXFS_FILE_PAGES];
+	struct buffer_head *bhs[UXFS_DIRECT_BLOCKS];
+	__u32 old[UXFS_DIRECT_BLOCKS], new[UXFS_DIRECT_BLOCKS];
+	pgoff_t npages;
+	unsigned count = 0, n = 0, i, nbhs = 0;
+	__u32 blk = 0;
+	char *buf;
+	int error;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	buf = kmalloc(UXFS_BSIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&inode->i_mutex);
+	uxfs_rsv_discard(inode);
+	error = filemap_write_and_wait(mapping);
+	if (error)
+		goto out;
+
+	/*
+	 * Readers can only bring in pages below i_size, and only
+	 * writers, which we've locked out, can add them above it.
+	 */
+
+	memset(pages, 0, sizeof(pages));
+	npages = DIV_ROUND_UP(i_size_read(inode), PAGE_CACHE_SIZE);
+	for (i = 0; i < UXFS_FILE_PAGES; i++) {
+		if (i < npages)
+			pages[i] = find_or_create_page(mapping, i, GFP_NOFS);
+		else
+			pages[i] = find_lock_page(mapping, i);
+		if (pages[i])
+			wait_on_page_writeback(pages[i]);
+		else if (i < npages) {
+			error = -ENOMEM;
+			goto unlock;
+		}
+	}
+
+	uxfs_frag_count(sb, uxi->i_addr, f);
+	if (f->f_extents <= 1)
+		goto unlock;
+	error = -EBUSY;
+	if (f->f_shared)
+		goto unlock;
+
+	count = f->f_blocks;
+	error = -ENOSPC;
+	blk = uxfs_alloc_blocks(sb, 0, &count, count);
+	if (!blk)
+		goto unlock;
+
+	memcpy(old, uxi->i_addr, sizeof(old));
+	for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
+		new[i] = 0;
+		if (!old[i])
+			continue;
+		new[i] = blk + n++;
+		error = defrag_read(inode, pages[i / UXFS_PAGE_BLOCKS], i,
+				    old[i], buf);
+		if (error)
+			goto free_new;
+		bhs[nbhs] = uxfs_getblk(sb, new[i]);
+		if (!bhs[nbhs]) {
+			error = -EIO;
+			goto free_new;
+		}
+		lock_buffer(bhs[nbhs]);
+		memcpy(bhs[nbhs]->b_data, buf, UXFS_BSIZE);
+		set_buffer_uptodate(bhs[nbhs]);
+		unlock_buffer(bhs[nbhs]);
+		mark_buffer_dirty(bhs[nbhs]);
+		nbhs++;
+	}
+	ll_rw_block(WRITE, nbhs, bhs);
+	error = 0;
+	for (i = 0; i < nbhs; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			error = -EIO;
+	}
+	if (error)
+		goto free_new;
+	error = uxfs_map_sync(sb, blk, count);
+	if (error)
+		goto free_new;
+
+	memcpy(uxi->i_addr, new, sizeof(new));
+	for (i = 0; i < UXFS_FILE_PAGES; i++) {
+		if (pages[i])
+			defrag_remap_page(pages[i], old, new);
+	}
+	mark_inode_dirty(inode);
+	error = sync_inode_metadata(inode, 1);
+	if (error)
+		printk(KERN_ERR "uxfs: Unable to write inode %lu after "
+		       "defrag\n", inode->i_ino);
+	for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
+		if (old[i])
+			uxfs_block_free(sb, old[i]);
+	}
+	uxfs_stat_inc(sb, UXFS_STAT_DEFRAG_FILES);
+	uxfs_stat_add(sb, UXFS_STAT_DEFRAG_BLOCKS, count);
+	uxfs_frag_count(sb, uxi->i_addr, f);
+	f->f_moved = count;
+	goto unlock;
+
+      free_new:
+	for (i = 0; i < nbhs; i++)
+		bforget(bhs[i]);
+	nbhs = 0;
+	for (i = 0; i < count; i++)
+		uxfs_block_free(sb, blk + i);
+      unlock:
+	for (i = 0; i < nbhs; i++)
+		brelse(bhs[i]);
+	for (i = 0; i < UXFS_FILE_PAGES; i++) {
+		if (!pages[i])
+			continue;
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+      out:
+	mutex_unlock(&inode->i_mutex);
+	kfree(buf);
+	return error;
+}
+
+/*
+ * Whole volume report for /sys/fs/uxfs/<dev>/frag. Block maps in
+ * core are looked at there, since they may not have been written
+ * yet; the others are read from disk.
+ */
+
+ssize_t uxfs_frag_show(struct super_block *sb, char *buf)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_superblock *usb = fs->u_sb;
+	struct uxfs_inode dip;
+	struct uxfs_frag f;
+	struct buffer_head *bh;
+	struct inode *inode;
+	unsigned long files = 0, blocks = 0, extents = 0, fragmented = 0;
+	unsigned long nfree = 0, free_extents = 0, largest = 0, run = 0;
+	int i, n = uxfs_nblocks(usb);
+	char *ref;
+
+	mutex_lock(&fs->u_alloc_lock);
+	for (i = 0; i <= n; i++) {
+		ref = i < n ? uxfs_map_entry(sb, i) : NULL;
+		if (ref && *ref == UXFS_BLOCK_FREE) {
+			run++;
+			continue;
+		}
+		if (run) {
+			nfree += run;
+			free_extents++;
+			largest = max(largest, run);
+		}
+		run = 0;
+	}
+	mutex_unlock(&fs->u_alloc_lock);
+
+	for (i = UXFS_ROOT_INO; i < UXFS_MAXFILES; i++) {
+		if (usb->s_inode[i] == UXFS_INODE_FREE)
+			continue;
+		inode = ilookup(sb, i);
+		if (inode && uxfs_i(inode)->i_addr)
+			uxfs_frag_count(sb, uxfs_i(inode)->i_addr, &f);
+		else {
+			bh = sb_bread(sb, UXFS_INODE_BLOCK + i);
+			if (!bh) {
+				iput(inode);
+				continue;
+			}
+			memcpy(&dip, bh->b_data, sizeof(dip));
+			brelse(bh);
+			uxfs_frag_count(sb, dip.i_addr, &f);
+		}
+		iput(inode);
+		if (!f.f_blocks)
+			continue;
+		files++;
+		blocks += f.f_blocks;
+		extents += f.f_extents;
+		if (f.f_extents > 1)
+			fragmented++;
+	}
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "free_blocks %lu\n"
+			 "free_extents %lu\n"
+			 "largest_free_extent %lu\n"
+			 "files %lu\n"
+			 "file_blocks %lu\n"
+			 "file_extents %lu\n"
+			 "fragmented_files %lu\n",
+			 nfree, free_extents, largest, files, blocks, extents,
+			 fragmented);
+}
@@ -5,41 +5,246 @@
 #include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <linux/buffer_head.h>
 
 #include "uxfs.h"
+#include "uxfs_trace.h"
 
 /*
- * Add "name" to the directory "dip"
+ * Directory locking. The VFS holds the directory's i_mutex for
+ * anything that changes it, which also keeps the check for an
+ * existing name and the uxfs_diradd() that follows together.
+ * Readers - uxfs_find_entry() and uxfs_readdir() - only take
+ * i_dir_sem shared, and the blocks, size and name cache of a
+ * directory only change under it held exclusively, in
+ * uxfs_diradd() and uxfs_dirdel(). Readers thus never see a
+ * half-written entry or a block map being extended, and nothing in
+ * uxfs keeps them from searching and listing the same directory at
+ * once. (The VFS of the kernels we build for still calls readdir
+ * and lookup with i_mutex held; this is what lets them run in
+ * parallel once it doesn't.)
+ */
+
+/*
+ * Directory blocks live in the page cache of the directory, like
+ * file data, and are read and written back through uxfs_aops. A
+ * page holds several blocks; callers walk a directory a block at
+ * a time with uxfs_dir_block(), which keeps the current page
+ * mapped until the walk moves on to the next one.
+ */
+
+#define UXFS_DIR_PAGES \
+	DIV_ROUND_UP(UXFS_DIRECT_BLOCKS << UXFS_BSIZE_BITS, PAGE_CACHE_SIZE)
+
+void uxfs_dir_put_page(struct page *page)
+{
+	if (page) {
+		kunmap(page);
+		page_cache_release(page);
+	}
+}
+
+/*
+ * Return the entries of block "blk" of "dip". "*pagep" is the page
+ * the caller has mapped, if any, and is replaced by the page of
+ * "blk" when that is another one. NULL if it could not be read.
+ */
+
+struct uxfs_dirent *uxfs_dir_block(struct inode *dip, int blk,
+				   struct page **pagep)
+{
+	loff_t pos = (loff_t)blk << UXFS_BSIZE_BITS;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	struct page *page = *pagep;
+
+	if (!page || page->index != index) {
+		uxfs_dir_put_page(page);
+		*pagep = NULL;
+		page = read_mapping_page(dip->i_mapping, index, NULL);
+		if (IS_ERR(page))
+			return NULL;
+		kmap(page);
+		*pagep = page;
+	}
+	return (struct uxfs_dirent *)(page_address(page) +
+				      (pos & ~PAGE_CACHE_MASK));
+}
+
+/*
+ * Start reading the pages of "dip" from "index" on that aren't
+ * cached yet, so that a scan waits for one batch of I/O rather than
+ * for each page in turn. "filp" is the directory being read, if
+ * any, whose readahead state is then used.
+ */
+
+void uxfs_dir_readahead(struct inode *dip, struct file *filp, pgoff_t index)
+{
+	struct file_ra_state ra, *rap = filp ? &filp->f_ra : &ra;
+	pgoff_t end = DIV_ROUND_UP(i_size_read(dip), PAGE_CACHE_SIZE);
+
+	if (index >= end)
+		return;
+	if (!filp)
+		file_ra_state_init(&ra, dip->i_mapping);
+	page_cache_sync_readahead(dip->i_mapping, rap, filp, index,
+				  end - index);
+}
+
+/*
+ * Get "len" bytes at "pos" of a directory page ready to be changed:
+ * lock the page and map its blocks, moving any that a snapshot
+ * holds to new ones (uxfs_cow_page()). dir_commit() then dirties
+ * what was changed. Called with i_dir_sem held exclusively.
+ */
+
+static int dir_prepare(struct page *page, loff_t pos, unsigned len)
+{
+	unsigned from = pos & ~PAGE_CACHE_MASK;
+	int error;
+
+	lock_page(page);
+	error = __block_write_begin(page, pos, len, uxfs_get_block);
+	if (error) {
+		unlock_page(page);
+		return error;
+	}
+	error = uxfs_cow_page(page->mapping->host, page, from, from + len);
+	if (error) {
+		/*
+		 * Blocks already moved still need their contents.
+		 */
+
+		block_write_end(NULL, page->mapping, pos, len, len, page,
+				NULL);
+		unlock_page(page);
+	}
+	return error;
+}
+
+static void dir_commit(struct page *page, loff_t pos, unsigned len)
+{
+	block_write_end(NULL, page->mapping, pos, len, len, page, NULL);
+	unlock_page(page);
+}
+
+/*
+ * Set entry "slot" of "dip", in the page "page" the caller has
+ * mapped. An "inum" of zero clears it.
+ */
+
+static int dir_set_entry(struct page *page, int slot, const char *name,
+			 __u32 inum)
+{
+	loff_t pos = (loff_t)slot * sizeof(struct uxfs_dirent);
+	struct uxfs_dirent *dirent;
+	int error;
+
+	error = dir_prepare(page, pos, sizeof(*dirent));
+	if (error)
+		return error;
+	dirent = (struct uxfs_dirent *)(page_address(page) +
+					(pos & ~PAGE_CACHE_MASK));
+	dirent->d_ino = inum;
+	strncpy(dirent->d_name, name, UXFS_NAMELEN);
+	dir_commit(page, pos, sizeof(*dirent));
+	return 0;
+}
+
+/*
+ * Block "pos" of "dip" has just been allocated: zero it in the page
+ * cache, with "name" as its first entry. Anything the device's own
+ * buffer cache still holds for the block is stale. A block that
+ * starts a page is all of that page in use, so a page that isn't
+ * cached needn't be read.
+ */
+
+static int dir_new_block(struct inode *dip, int pos, const char *name,
+			 __u32 inum)
+{
+	struct super_block *sb = dip->i_sb;
+	loff_t off = (loff_t)pos << UXFS_BSIZE_BITS;
+	struct uxfs_dirent *dirent = NULL;
+	struct block_device *bdev;
+	struct page *page = NULL;
+	sector_t phys;
+	int error;
+
+	bdev = uxfs_map_block(sb, uxfs_i(dip)->i_addr[pos], &phys);
+	unmap_underlying_metadata(bdev, phys);
+	if (off & ~PAGE_CACHE_MASK)
+		dirent = uxfs_dir_block(dip, pos, &page);
+	else {
+		page = grab_cache_page(dip->i_mapping, off >> PAGE_CACHE_SHIFT);
+		if (page) {
+			if (!PageUptodate(page)) {
+				zero_user(page, 0, PAGE_CACHE_SIZE);
+				SetPageUptodate(page);
+			}
+			unlock_page(page);
+			dirent = kmap(page);
+		}
+	}
+	if (!dirent)
+		return -EIO;
+	error = dir_prepare(page, off, UXFS_BSIZE);
+	if (!error) {
+		memset(dirent, 0, UXFS_BSIZE);
+		dirent->d_ino = inum;
+		strncpy(dirent->d_name, name, UXFS_NAMELEN);
+		dir_commit(page, off, UXFS_BSIZE);
+	}
+	uxfs_dir_put_page(page);
+	return error;
+}
+
+/*
+ * Add "name" to the directory "dip". If the directory is in the
+ * name cache we know which block has a free slot and go straight
+ * there.
  */
 
 int uxfs_diradd(struct inode *dip, const char *name, int inum)
 {
-	struct uxfs_inode *uip = (struct uxfs_inode *)
-	    dip->i_private;
-	struct buffer_head *bh;
+	struct uxfs_inode_info *uxi = uxfs_i(dip);
 	struct super_block *sb = dip->i_sb;
 	struct uxfs_dirent *dirent;
+	struct page *page = NULL;
+	u64 ns, start = uxfs_lat_start();
 	__u32 blk = 0;
-	int i, pos;
-
-	for (blk = 0; blk < uip->i_blocks; blk++) {
-		bh = sb_bread(sb, uip->i_addr[blk]);
-		dirent = (struct uxfs_dirent *)bh->b_data;
+	int i, pos, slot, nread = 0, error = 0;
+
+	uxfs_stat_inc(sb, UXFS_STAT_DIRADD);
+	down_write(&uxi->i_dir_sem);
+	slot = uxfs_ncache_free_slot(dip);
+	if (slot >= 0)
+		blk = slot / UXFS_DIRS_PER_BLOCK;
+	else
+		uxfs_dir_readahead(dip, NULL, 0);
+	for (; blk < dip->i_blocks; blk++) {
+		dirent = uxfs_dir_block(dip, blk, &page);
+		if (!dirent) {
+			error = -EIO;
+			goto out;
+		}
+		nread++;
 		for (i = 0; i < UXFS_DIRS_PER_BLOCK; i++) {
 			if (dirent->d_ino != 0) {
 				dirent++;
 				continue;
 			} else {
-				dirent->d_ino = inum;
-				strcpy(dirent->d_name, name);
-				mark_buffer_dirty(bh);
+				slot = blk * UXFS_DIRS_PER_BLOCK + i;
+				error = dir_set_entry(page, slot, name, inum);
+				if (error)
+					goto out;
+				uxfs_ncache_add(dip, name, inum, slot);
 				mark_inode_dirty(dip);	//this shouldn't be necessary...
-				brelse(bh);
-				return 0;
+				goto out;
 			}
 		}
-		brelse(bh);
 	}
 
 	/*
@@ -47,25 +252,190 @@ int uxfs_diradd(struct inode *dip, const char *name, int inum)
 	 * a new block if there's space in the inode.
 	 */
 
-	if (uip->i_blocks < UXFS_DIRECT_BLOCKS) {
-		pos = uip->i_blocks;
-		blk = uxfs_block_alloc(sb);
-		uip->i_blocks++;
-		uip->i_size += UXFS_BSIZE;
+	error = -ENOSPC;
+	if (dip->i_blocks < UXFS_DIRECT_BLOCKS) {
+		unsigned n = 1;
+
+		pos = dip->i_blocks;
+		blk = uxfs_alloc_blocks(sb, uxfs_block_goal(dip, pos), &n, 1);
+		if (!blk)
+			goto out;
 		dip->i_size += UXFS_BSIZE;
 		dip->i_blocks++;
-		uip->i_addr[pos] = blk;
-		bh = sb_bread(sb, blk);
-		memset(bh->b_data, 0, UXFS_BSIZE);
+		uxi->i_addr[pos] = blk;
 		mark_inode_dirty(dip);
-		dirent = (struct uxfs_dirent *)bh->b_data;
-		dirent->d_ino = inum;
-		strcpy(dirent->d_name, name);
-		mark_buffer_dirty(bh);
-		brelse(bh);
+		error = dir_new_block(dip, pos, name, inum);
+		if (!error)
+			uxfs_ncache_add(dip, name, inum,
+					pos * UXFS_DIRS_PER_BLOCK);
+		else {
+			dip->i_size -= UXFS_BSIZE;
+			dip->i_blocks--;
+			truncate_inode_pages(dip->i_mapping, dip->i_size);
+			uxi->i_addr[pos] = 0;
+			uxfs_block_free(sb, blk);
+		}
 	}
 
-	return 0;
+      out:
+	uxfs_dir_put_page(page);
+	up_write(&uxi->i_dir_sem);
+	uxfs_stat_add(sb, UXFS_STAT_DIRADD_BLOCKS, nread);
+	ns = uxfs_lat_end(sb, UXFS_LAT_DIRADD, start);
+	trace_uxfs_diradd(dip, name, inum, nread, ns);
+	return error;
+}
+
+/*
+ * Directory compaction. uxfs_dirdel() only clears an entry, so a
+ * directory that was once big keeps its blocks, and every search,
+ * hunt for a free slot and readdir goes through them. Compaction
+ * packs the entries, in the order they are in, into as few blocks
+ * as they fit and frees the rest.
+ *
+ * That changes the readdir position of every entry that moves, so
+ * it only happens while nobody has the directory open, as counted
+ * in i_dir_opens, apart from the caller of UXFS_IOC_DIR_COMPACT,
+ * whose position goes back to the start. A directory opened while
+ * compaction runs hasn't read anything yet, and its readdir waits
+ * for i_dir_sem.
+ *
+ * It is done by itself when a delete or the last close leaves a
+ * directory at most half full with a block to spare. The name
+ * cache tells us that without going to disk.
+ */
+
+static int uxfs_dir_sparse(struct inode *dip)
+{
+	int n = uxfs_ncache_count(dip);
+
+	return n >= 0 && dip->i_blocks > 1 &&
+	    DIV_ROUND_UP(n, UXFS_DIRS_PER_BLOCK) < dip->i_blocks &&
+	    n * 2 <= dip->i_blocks * UXFS_DIRS_PER_BLOCK;
+}
+
+/*
+ * Returns the number of blocks freed. Called with i_dir_sem held
+ * exclusively.
+ */
+
+static int dir_compact(struct inode *dip)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(dip);
+	struct super_block *sb = dip->i_sb;
+	struct page *page = NULL, *pages[UXFS_DIR_PAGES];
+	struct uxfs_dirent *de, *to;
+	int nblocks = dip->i_blocks, need, npages, blk, i, error = 0;
+	loff_t size, pos;
+	unsigned len;
+	char *buf;
+
+	buf = kzalloc(nblocks * UXFS_BSIZE, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+	to = (struct uxfs_dirent *)buf;
+	for (blk = 0; blk < nblocks; blk++) {
+		de = uxfs_dir_block(dip, blk, &page);
+		if (!de) {
+			kfree(buf);
+			return -EIO;
+		}
+		for (i = 0; i < UXFS_DIRS_PER_BLOCK; i++, de++) {
+			if (de->d_ino)
+				*to++ = *de;
+		}
+	}
+	uxfs_dir_put_page(page);
+	need = DIV_ROUND_UP((char *)to - buf, UXFS_BSIZE);
+	if (need == 0)
+		need = 1;
+	if (need >= nblocks)
+		goto out;
+	size = (loff_t)need << UXFS_BSIZE_BITS;
+	npages = DIV_ROUND_UP(size, PAGE_CACHE_SIZE);
+
+	/*
+	 * Get every page that stays ready, its blocks copied away from
+	 * a snapshot if need be, before changing any, so that a
+	 * failure leaves the directory as it was.
+	 */
+
+	for (i = 0; i < npages; i++) {
+		pos = (loff_t)i << PAGE_CACHE_SHIFT;
+		pages[i] = read_mapping_page(dip->i_mapping, i, NULL);
+		if (IS_ERR(pages[i]))
+			error = PTR_ERR(pages[i]);
+		else {
+			error = dir_prepare(pages[i], pos,
+					    min_t(loff_t, PAGE_CACHE_SIZE,
+						  size - pos));
+			if (error)
+				page_cache_release(pages[i]);
+		}
+		if (error) {
+			/*
+			 * The pages we got are unchanged, but their blocks
+			 * may have moved and must still be written.
+			 */
+
+			while (i-- > 0) {
+				dir_commit(pages[i],
+					   (loff_t)i << PAGE_CACHE_SHIFT,
+					   PAGE_CACHE_SIZE);
+				page_cache_release(pages[i]);
+			}
+			goto out;
+		}
+	}
+	for (i = 0; i < npages; i++) {
+		pos = (loff_t)i << PAGE_CACHE_SHIFT;
+		len = min_t(loff_t, PAGE_CACHE_SIZE, size - pos);
+		memcpy(kmap(pages[i]), buf + pos, len);
+		kunmap(pages[i]);
+		dir_commit(pages[i], pos, len);
+		page_cache_release(pages[i]);
+	}
+
+	/*
+	 * Throw away the cached blocks past the new end before giving
+	 * them back, so that they are never written.
+	 */
+
+	dip->i_size = size;
+	truncate_inode_pages(dip->i_mapping, size);
+	for (blk = need; blk < nblocks; blk++) {
+		uxfs_block_free(sb, uxi->i_addr[blk]);
+		uxi->i_addr[blk] = 0;
+	}
+	dip->i_blocks = need;
+	mark_inode_dirty(dip);
+	uxfs_ncache_drop(dip);
+	uxfs_stat_inc(sb, UXFS_STAT_DIR_COMPACT);
+	uxfs_stat_add(sb, UXFS_STAT_DIR_COMPACT_BLOCKS, nblocks - need);
+	error = nblocks - need;
+      out:
+	kfree(buf);
+	return error;
+}
+
+/*
+ * Compact "dip" now, for UXFS_IOC_DIR_COMPACT on "filp".
+ */
+
+int uxfs_dir_compact(struct inode *dip, struct file *filp)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(dip);
+	int error = -EBUSY;
+
+	if (!S_ISDIR(dip->i_mode))
+		return -ENOTDIR;
+	down_write(&uxi->i_dir_sem);
+	if (atomic_read(&uxi->i_dir_opens) <= 1) {
+		error = dir_compact(dip);
+		filp->f_pos = 0;
+	}
+	up_write(&uxi->i_dir_sem);
+	return error;
 }
 
 /*
@@ -74,77 +444,140 @@ int uxfs_diradd(struct inode *dip, const char *name, int inum)
 
 int uxfs_dirdel(struct inode *dip, char *name)
 {
-	struct uxfs_inode *uip = (struct uxfs_inode *)
-	    dip->i_private;
-	struct buffer_head *bh;
-	struct super_block *sb = dip->i_sb;
+	struct uxfs_inode_info *uxi = uxfs_i(dip);
 	struct uxfs_dirent *dirent;
+	struct page *page = NULL;
 	__u32 blk = 0;
-	int i;
+	int i, slot, found = 0;
 
-	while (blk < uip->i_blocks) {
-		bh = sb_bread(sb, uip->i_addr[blk]);
+	/*
+	 * The name cache tells us which block holds the entry.
+	 */
+
+	down_write(&uxi->i_dir_sem);
+	slot = uxfs_ncache_slot(dip, name);
+	if (slot >= 0)
+		blk = slot / UXFS_DIRS_PER_BLOCK;
+	else
+		uxfs_dir_readahead(dip, NULL, 0);
+	while (!found && blk < dip->i_blocks) {
+		dirent = uxfs_dir_block(dip, blk, &page);
+		if (!dirent)
+			goto out;
 		blk++;
-		dirent = (struct uxfs_dirent *)bh->b_data;
 		for (i = 0; i < UXFS_DIRS_PER_BLOCK; i++) {
-			if (strcmp(dirent->d_name, name) != 0) {
+			if (strncmp(dirent->d_name, name, UXFS_NAMELEN) != 0) {
 				dirent++;
 				continue;
 			} else {
-				dirent->d_ino = 0;
-				dirent->d_name[0] = '\0';
-				mark_buffer_dirty(bh);	//unnecessary??
-				inode_dec_link_count(dip);
-				//      mark_inode_dirty(dip); redundant
+				slot = (blk - 1) * UXFS_DIRS_PER_BLOCK + i;
+				if (dir_set_entry(page, slot, "", 0))
+					goto out;
+				mark_inode_dirty(dip);
+				found = 1;
 				break;
 			}
 		}
-		brelse(bh);
 	}
+	uxfs_dir_put_page(page);
+	page = NULL;
+	if (found)
+		uxfs_ncache_del(dip, name);
+	if (found && !atomic_read(&uxi->i_dir_opens) && uxfs_dir_sparse(dip))
+		dir_compact(dip);
+      out:
+	uxfs_dir_put_page(page);
+	up_write(&uxi->i_dir_sem);
 	return 0;
 }
 
+/*
+ * Hand out as many entries as filldir will take, mapping each
+ * directory page once. The inode numbers go to stat-ahead.
+ */
+
 int uxfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 	unsigned long pos;
 	struct inode *inode = filp->f_dentry->d_inode;
-	struct uxfs_inode *uip = (struct uxfs_inode *)
-	    inode->i_private;
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	struct uxfs_statahead *sa;
 	struct uxfs_dirent *udir;
-	struct buffer_head *bh;
-	__u32 blk;
-
-      start_again:
-	pos = filp->f_pos;
-	if (pos >= inode->i_size)
-		return 0;
-	blk = (pos + 1) / UXFS_BSIZE;
-	blk = uip->i_addr[blk];
-	bh = sb_bread(inode->i_sb, blk);
-	udir = (struct uxfs_dirent *)(bh->b_data + pos % UXFS_BSIZE);
+	struct page *page = NULL;
+	ino_t base = 0, ino;
 
 	/*
-	 * Skip over 'null' directory entries.
+	 * Entries of a snapshot directory name snapshot inodes, which
+	 * are never cached, so stat-ahead has nothing to do there.
 	 */
 
-	if (udir->d_ino == 0) {
+	if (uxfs_snap_ino(inode->i_ino)) {
+		base = UXFS_SNAP_INO;
+		sa = NULL;
+	} else
+		sa = uxfs_sa_readdir_begin(inode);
+	down_read(&uxi->i_dir_sem);
+	uxfs_dir_readahead(inode, filp, filp->f_pos >> PAGE_CACHE_SHIFT);
+	while ((pos = filp->f_pos) < inode->i_size) {
+		udir = uxfs_dir_block(inode, pos / UXFS_BSIZE, &page);
+		if (!udir)
+			break;
+		udir += pos % UXFS_BSIZE / sizeof(struct uxfs_dirent);
+
+		/*
+		 * Skip over 'null' directory entries.
+		 */
+
+		if (udir->d_ino != 0) {
+			ino = base + udir->d_ino;
+			if (filldir(dirent, udir->d_name,
+				    strnlen(udir->d_name, UXFS_NAMELEN), pos,
+				    ino, DT_UNKNOWN))
+				break;
+			if (ino != inode->i_ino)
+				uxfs_sa_note(sa, ino);
+		}
 		filp->f_pos += sizeof(struct uxfs_dirent);
-		brelse(bh);
-		goto start_again;
-	} else {
-		filldir(dirent, udir->d_name,
-			sizeof(udir->d_name), pos, udir->d_ino,
-			DT_UNKNOWN);
 	}
-	filp->f_pos += sizeof(struct uxfs_dirent);
-	brelse(bh);
+	uxfs_dir_put_page(page);
+	up_read(&uxi->i_dir_sem);
+	uxfs_sa_readdir_end(inode, sa);
+	return 0;
+}
+
+static int uxfs_dir_open(struct inode *inode, struct file *filp)
+{
+	atomic_inc(&uxfs_i(inode)->i_dir_opens);
+	return 0;
+}
+
+/*
+ * The last close of a sparse directory compacts it, for those that
+ * emptied it while reading it, like "rm -r".
+ */
+
+static int uxfs_dir_release(struct inode *inode, struct file *filp)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+
+	if (!atomic_dec_and_test(&uxi->i_dir_opens) || !inode->i_nlink ||
+	    !uxfs_dir_sparse(inode) || mnt_want_write_file(filp))
+		return 0;
+	down_write(&uxi->i_dir_sem);
+	if (!atomic_read(&uxi->i_dir_opens) && uxfs_dir_sparse(inode))
+		dir_compact(inode);
+	up_write(&uxi->i_dir_sem);
+	mnt_drop_write_file(filp);
 	return 0;
 }
 
 struct file_operations uxfs_dir_operations = {
 	.read = generic_read_dir,
 	.readdir = uxfs_readdir,
-	.fsync = noop_fsync,
+	.fsync = generic_file_fsync,
+	.unlocked_ioctl = uxfs_ioctl,
+	.open = uxfs_dir_open,
+	.release = uxfs_dir_release,
 };
 
 /*
@@ -156,10 +589,10 @@ struct file_operations uxfs_dir_operations = {
 int uxfs_create(struct inode *dip, struct dentry *dentry, umode_t mode,
 		struct nameidata *nd)
 {
-	struct uxfs_inode *nip;
 	struct super_block *sb = dip->i_sb;
 	struct inode *inode;
 	ino_t inum = 0;
+	int error = -ENOSPC;
 
 	/*
 	 * See if the entry exists. If not, create a new 
@@ -168,17 +601,36 @@ int uxfs_create(struct inode *dip, struct dentry *dentry, umode_t mode,
 	 */
 
 	inum = uxfs_find_entry(dip, (char *)dentry->d_name.name);
-	if (inum)
-		return -EEXIST;
+	if (inum) {
+		error = -EEXIST;
+		goto out;
+	}
 	inode = new_inode(sb);
 	if (!inode)
-		return -ENOSPC;
+		goto out;
+	if (uxfs_imap_new(inode)) {
+		iput(inode);
+		error = -ENOMEM;
+		goto out;
+	}
 	inum = uxfs_ialloc(sb);
 	if (!inum) {
 		iput(inode);
-		return -ENOSPC;
+		goto out;
+	}
+
+	/*
+	 * Without an entry the inode is dropped again, and with no
+	 * links left uxfs_destroy_inode() gives back its number.
+	 */
+
+	inode->i_ino = inum;
+	error = uxfs_diradd(dip, (char *)dentry->d_name.name, inum);
+	if (error) {
+		clear_nlink(inode);
+		iput(inode);
+		goto out;
 	}
-	uxfs_diradd(dip, (char *)dentry->d_name.name, inum);
 
 	/*
 	 * Increment the parent link count and intialize the inode.
@@ -191,30 +643,22 @@ int uxfs_create(struct inode *dip, struct dentry *dentry, umode_t mode,
 	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
 	inode->i_op = &uxfs_file_inops;
 	inode->i_fop = &uxfs_file_operations;
-	inode->i_mapping->a_ops = &uxfs_aops;
 	inode->i_mode = mode;
 	set_nlink(inode, 1);
 	inode->i_ino = inum;
 
-	//need to set i_private
-	inode->i_private = uxfs_i(inode);
-
-	nip = (struct uxfs_inode *)inode->i_private;
-	nip->i_mode = mode;
-	nip->i_nlink = 1;
-	nip->i_atime = nip->i_ctime = nip->i_mtime = CURRENT_TIME.tv_sec;
-	nip->i_uid = inode->i_uid;
-	nip->i_gid = inode->i_gid;
-	nip->i_size = 0;
-	nip->i_blocks = 0;
-	memset(nip->i_addr, 0,
-	       UXFS_DIRECT_BLOCKS * sizeof(nip->i_addr[0]));
+	inode->i_blocks = 0;
+	uxfs_i(inode)->i_flags = uxfs_i(dip)->i_flags & UXFS_COMPR_FL;
+	uxfs_set_file_aops(inode);
 
 	insert_inode_hash(inode);	//moved from above
 	d_instantiate(dentry, inode);
 	//  mark_inode_dirty(dip); //this does not belong here
 	mark_inode_dirty(inode);
-	return 0;
+	error = 0;
+      out:
+	trace_uxfs_op_create(dip, dentry, error ? error : inum);
+	return error;
 }
 
 /*
@@ -224,13 +668,13 @@ int uxfs_create(struct inode *dip, struct dentry *dentry, umode_t mode,
 
 int uxfs_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 {
-	struct uxfs_inode *nip;
-	struct buffer_head *bh;
 	struct super_block *sb = dip->i_sb;
-	struct uxfs_dirent *dirent;
+	struct page *page = NULL;
 	struct inode *inode;
 	ino_t inum = 0;
-	int blk;
+	unsigned n = 1;
+	__u32 blk;
+	int error = -ENOSPC;
 
 	/*
 	 * Make sure there isn't already an entry. If not, 
@@ -238,59 +682,74 @@ int uxfs_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 	 */
 
 	inum = uxfs_find_entry(dip, (char *)dentry->d_name.name);
-	if (inum)
-		return -EEXIST;
+	if (inum) {
+		error = -EEXIST;
+		goto out;
+	}
 	inode = new_inode(sb);
 	if (!inode)
-		return -ENOSPC;
+		goto out;
+	if (uxfs_imap_new(inode)) {
+		iput(inode);
+		error = -ENOMEM;
+		goto out;
+	}
 	inum = uxfs_ialloc(sb);
 	if (!inum) {
 		iput(inode);
-		return -ENOSPC;
+		goto out;
 	}
-	uxfs_diradd(dip, (char *)dentry->d_name.name, inum);
-
 	inode->i_uid = current_fsuid();
 	inode->i_gid =
 	    (dip->i_mode & S_ISGID) ? dip->i_gid : current_fsgid();
 	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
-	inode->i_blocks = 1;
 //      inode->i_blksize = UXFS_BSIZE;
 	inode->i_op = &uxfs_dir_inops;
 	inode->i_fop = &uxfs_dir_operations;
-	inode->i_mapping->a_ops = &uxfs_aops;
+	uxfs_set_dir_aops(inode);
 	inode->i_mode = mode | S_IFDIR;
 	inode->i_ino = inum;
 	inode->i_size = UXFS_BSIZE;
-	inode->i_private = uxfs_i(inode);	//initialize private, again!
 	set_nlink(inode, 2);
+	uxfs_i(inode)->i_flags = uxfs_i(dip)->i_flags & UXFS_COMPR_FL;
 
-	nip = (struct uxfs_inode *)inode->i_private;
-	nip->i_mode = mode | S_IFDIR;
-	nip->i_nlink = 2;
-	nip->i_atime = nip->i_ctime = nip->i_mtime = CURRENT_TIME.tv_sec;
-	nip->i_uid = current_fsuid();
-	nip->i_gid =
-	    (dip->i_mode & S_ISGID) ? dip->i_gid : current_fsgid();
-	nip->i_size = 512;
-	nip->i_blocks = 1;
-	memset(nip->i_addr, 0,
-	       UXFS_DIRECT_BLOCKS * sizeof(nip->i_addr[0]));
-
-	blk = uxfs_block_alloc(sb);
-	nip->i_addr[0] = blk;
-	bh = sb_bread(sb, blk);
-	memset(bh->b_data, 0, UXFS_BSIZE);
-	dirent = (struct uxfs_dirent *)bh->b_data;
-	dirent->d_ino = inum;
-	strcpy(dirent->d_name, ".");
-	dirent++;
-	dirent->d_ino = inode->i_ino;
-	strcpy(dirent->d_name, "..");
+	/*
+	 * Hash the inode before its first block goes through the page
+	 * cache: dirtying the pages of an unhashed inode never puts it
+	 * on the writeback list, and the block and the inode would
+	 * never reach the disk.
+	 */
 
-	mark_buffer_dirty(bh);
-	brelse(bh);
 	insert_inode_hash(inode);
+
+	/*
+	 * The first block goes next to the parent's. The new
+	 * directory only gets its entry in the parent once it is
+	 * complete; until then a failure just drops the inode, and
+	 * with it the inode number and the block.
+	 */
+
+	blk = uxfs_alloc_blocks(sb, uxfs_block_goal(dip, dip->i_blocks), &n,
+				1);
+	if (!blk) {
+		error = -ENOSPC;
+		goto drop;
+	}
+	uxfs_i(inode)->i_addr[0] = blk;
+	inode->i_blocks = 1;
+	error = dir_new_block(inode, 0, ".", inum);
+	if (error)
+		goto drop;
+	if (!uxfs_dir_block(inode, 0, &page))
+		error = -EIO;
+	else
+		error = dir_set_entry(page, 1, "..", inode->i_ino);
+	uxfs_dir_put_page(page);
+	if (!error)
+		error = uxfs_diradd(dip, (char *)dentry->d_name.name, inum);
+	if (error)
+		goto drop;
+
 	d_instantiate(dentry, inode);
 	mark_inode_dirty(inode);
 
@@ -300,7 +759,16 @@ int uxfs_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 
 	inode_inc_link_count(dip);
 	mark_inode_dirty(dip);
-	return 0;
+	error = 0;
+	goto out;
+
+      drop:
+	clear_nlink(inode);
+	remove_inode_hash(inode);
+	iput(inode);
+      out:
+	trace_uxfs_op_mkdir(dip, dentry, error ? error : inum);
+	return error;
 }
 
 /*
@@ -309,44 +777,35 @@ int uxfs_mkdir(struct inode *dip, struct dentry *dentry, umode_t mode)
 
 int uxfs_rmdir(struct inode *dip, struct dentry *dentry)
 {
-	struct super_block *sb = dip->i_sb;
-	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
-	struct uxfs_superblock *usb = fs->u_sb;
 	struct inode *inode = dentry->d_inode;
-	struct uxfs_inode *uip = (struct uxfs_inode *)
-	    inode->i_private;
-	int inum, i;
+	int inum;
 
-	if (inode->i_nlink > 2)
+	if (inode->i_nlink > 2) {
+		trace_uxfs_op_rmdir(dip, dentry, -ENOTEMPTY);
 		return -ENOTEMPTY;
+	}
 
 	/*
 	 * Remove the entry from the parent directory
 	 */
 
 	inum = uxfs_find_entry(dip, (char *)dentry->d_name.name);
-	if (!inum)
+	if (!inum) {
+		trace_uxfs_op_rmdir(dip, dentry, -ENOTDIR);
 		return -ENOTDIR;
-	uxfs_dirdel(dip, (char *)dentry->d_name.name);
-
-	/*
-	 * Clean up the inode
-	 */
-
-	for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
-		if (uip->i_addr[i] != 0) {
-			usb->s_block[uip->i_addr[i]]
-			    = UXFS_BLOCK_FREE;
-			usb->s_nbfree++;
-		}
 	}
+	uxfs_dirdel(dip, (char *)dentry->d_name.name);
 
 	/*
-	 * Update the superblock summaries.
+	 * Drop the parent's link from "..". The blocks and the inode
+	 * are released by uxfs_destroy_inode() once the last
+	 * reference to the directory goes away.
 	 */
 
-	usb->s_inode[dip->i_ino] = UXFS_INODE_FREE;
-	usb->s_nifree++;
+	inode_dec_link_count(dip);
+	clear_nlink(inode);
+	mark_inode_dirty(inode);
+	trace_uxfs_op_rmdir(dip, dentry, inum);
 	return 0;
 }
 
@@ -364,12 +823,26 @@ struct dentry *uxfs_lookup(struct inode *dip, struct dentry *dentry,
 	if (dentry->d_name.len > UXFS_NAMELEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
+	uxfs_stat_inc(dip->i_sb, UXFS_STAT_LOOKUP);
+
+	if (dip->i_ino == UXFS_ROOT_INO &&
+	    !strcmp(dentry->d_name.name, UXFS_SNAP_NAME))
+		return uxfs_snap_lookup(dip, dentry);
+
 	inum = uxfs_find_entry(dip, (char *)dentry->d_name.name);
+	if (inum && uxfs_snap_ino(dip->i_ino)) {
+		d_set_d_op(dentry, &uxfs_snap_dops);
+		inum += UXFS_SNAP_INO;
+	} else if (inum)
+		uxfs_sa_lookup(dip, inum);
 	if (inum) {
 		inode = uxfs_iget(dip->i_sb, inum);
-		if (!inode)
+		if (IS_ERR(inode)) {
+			trace_uxfs_op_lookup(dip, dentry, PTR_ERR(inode));
 			return ERR_CAST(inode);
+		}
 	}
+	trace_uxfs_op_lookup(dip, dentry, inum);
 	d_add(dentry, inode);
 	return NULL;
 }
@@ -388,6 +861,8 @@ int uxfs_link(struct dentry *old, struct inode *dip, struct dentry *new)
 	 */
 
 	error = uxfs_diradd(dip, new->d_name.name, inode->i_ino);
+	if (error)
+		return error;
 
 	/*
 	 * Increment the link count of the target inode
@@ -411,6 +886,7 @@ int uxfs_unlink(struct inode *dip, struct dentry *dentry)
 	uxfs_dirdel(dip, (char *)dentry->d_name.name);
 	inode_dec_link_count(inode);
 	mark_inode_dirty(inode);	//more redundancy,
+	trace_uxfs_op_unlink(dip, dentry, inode->i_ino);
 	return 0;
 }
 
@@ -422,3 +898,17 @@ struct inode_operations uxfs_dir_inops = {
 	.link = uxfs_link,
 	.unlink = uxfs_unlink,
 };
+
+/*
+ * Directories of the snapshot can only be read.
+ */
+
+struct inode_operations uxfs_snap_dir_inops = {
+	.lookup = uxfs_lookup,
+};
+
+struct file_operations uxfs_snap_dir_operations = {
+	.read = generic_read_dir,
+	.readdir = uxfs_readdir,
+	.fsync = noop_fsync,
+};
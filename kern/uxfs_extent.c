@@ -0,0 +1,424 @@
+/*--------------------------------------------------------------*/
+/*-------------------------- uxfs_extent.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include "uxfs.h"
+
+/*
+ * In-core index of the free space. Every run of free blocks in the
+ * block map is one extent, kept in two red-black trees: one sorted
+ * by start block, used to find the extent holding or following a
+ * given block and to merge neighbours on free, and one sorted by
+ * length (then start), used to find the smallest extent that is
+ * long enough.
+ *
+ * The index is filled from the block map a region at a time, when
+ * an allocation first needs one: the region of its goal, else the
+ * one with the most free blocks by the counts in the superblock.
+ * So mount reads no map blocks, and a volume that is mostly used
+ * in one place never reads the rest. Once in, a region is kept in
+ * step by uxfs_alloc_blocks() and uxfs_block_free(), which hold
+ * u_alloc_lock around every call in here; blocks freed in a region
+ * that isn't in yet are found when it is. Should we ever fail to
+ * allocate an extent structure the index is marked stale and
+ * emptied, to be filled again on demand.
+ *
+ * Blocks in reservation windows (see uxfs_rsv.c) are free in the
+ * block map but not in the index.
+ */
+
+struct uxfs_fext {
+	struct rb_node fe_by_start;
+	struct rb_node fe_by_len;
+	__u32 fe_blk;
+	__u32 fe_count;
+};
+
+static struct kmem_cache *uxfs_fext_cachep;
+
+static void fext_insert_start(struct uxfs_fs *fs, struct uxfs_fext *fe)
+{
+	struct rb_node **p = &fs->u_fext_start.rb_node, *parent = NULL;
+	struct uxfs_fext *f;
+
+	while (*p) {
+		parent = *p;
+		f = rb_entry(parent, struct uxfs_fext, fe_by_start);
+		if (fe->fe_blk < f->fe_blk)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->fe_by_start, parent, p);
+	rb_insert_color(&fe->fe_by_start, &fs->u_fext_start);
+}
+
+static void fext_insert_len(struct uxfs_fs *fs, struct uxfs_fext *fe)
+{
+	struct rb_node **p = &fs->u_fext_len.rb_node, *parent = NULL;
+	struct uxfs_fext *f;
+
+	while (*p) {
+		parent = *p;
+		f = rb_entry(parent, struct uxfs_fext, fe_by_len);
+		if (fe->fe_count < f->fe_count ||
+		    (fe->fe_count == f->fe_count && fe->fe_blk < f->fe_blk))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&fe->fe_by_len, parent, p);
+	rb_insert_color(&fe->fe_by_len, &fs->u_fext_len);
+}
+
+static int fext_add(struct uxfs_fs *fs, __u32 blk, __u32 count)
+{
+	struct uxfs_fext *fe;
+
+	fe = kmem_cache_alloc(uxfs_fext_cachep, GFP_NOFS);
+	if (!fe)
+		return -ENOMEM;
+	fe->fe_blk = blk;
+	fe->fe_count = count;
+	fext_insert_start(fs, fe);
+	fext_insert_len(fs, fe);
+	fs->u_fext_nr++;
+	return 0;
+}
+
+static void fext_del(struct uxfs_fs *fs, struct uxfs_fext *fe)
+{
+	rb_erase(&fe->fe_by_start, &fs->u_fext_start);
+	rb_erase(&fe->fe_by_len, &fs->u_fext_len);
+	kmem_cache_free(uxfs_fext_cachep, fe);
+	fs->u_fext_nr--;
+}
+
+/*
+ * Change the length of an extent. Extents never overlap, so moving
+ * its start within its old range keeps the start tree in order;
+ * only the length tree needs the extent reinserted.
+ */
+
+static void fext_resize(struct uxfs_fs *fs, struct uxfs_fext *fe, __u32 blk,
+			__u32 count)
+{
+	if (!count) {
+		fext_del(fs, fe);
+		return;
+	}
+	rb_erase(&fe->fe_by_len, &fs->u_fext_len);
+	fe->fe_blk = blk;
+	fe->fe_count = count;
+	fext_insert_len(fs, fe);
+}
+
+/*
+ * The last extent starting at or before "blk", or NULL.
+ */
+
+static struct uxfs_fext *fext_prev(struct uxfs_fs *fs, __u32 blk)
+{
+	struct rb_node *n = fs->u_fext_start.rb_node;
+	struct uxfs_fext *fe, *best = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct uxfs_fext, fe_by_start);
+		if (fe->fe_blk <= blk) {
+			best = fe;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+	return best;
+}
+
+/*
+ * The smallest extent of at least "count" blocks, or NULL.
+ */
+
+static struct uxfs_fext *fext_fit(struct uxfs_fs *fs, __u32 count)
+{
+	struct rb_node *n = fs->u_fext_len.rb_node;
+	struct uxfs_fext *fe, *best = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct uxfs_fext, fe_by_len);
+		if (fe->fe_count >= count) {
+			best = fe;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return best;
+}
+
+static void fext_clear(struct uxfs_fs *fs)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(&fs->u_fext_start)) != NULL)
+		fext_del(fs, rb_entry(n, struct uxfs_fext, fe_by_start));
+}
+
+/*
+ * Put "count" blocks starting at "blk", all in regions already in
+ * the index, into it, merging with the extents on either side.
+ */
+
+static int fext_merge(struct uxfs_fs *fs, __u32 blk, unsigned count)
+{
+	struct uxfs_fext *prev, *next = NULL;
+	struct rb_node *n;
+
+	prev = fext_prev(fs, blk);
+	if (prev)
+		n = rb_next(&prev->fe_by_start);
+	else
+		n = rb_first(&fs->u_fext_start);
+	if (n)
+		next = rb_entry(n, struct uxfs_fext, fe_by_start);
+	if (prev && prev->fe_blk + prev->fe_count != blk)
+		prev = NULL;
+	if (next && blk + count != next->fe_blk)
+		next = NULL;
+
+	if (prev && next) {
+		count += prev->fe_count + next->fe_count;
+		fext_del(fs, next);
+		fext_resize(fs, prev, prev->fe_blk, count);
+	} else if (prev)
+		fext_resize(fs, prev, prev->fe_blk, prev->fe_count + count);
+	else if (next)
+		fext_resize(fs, next, blk, next->fe_count + count);
+	else
+		return fext_add(fs, blk, count);
+	return 0;
+}
+
+static void fext_stale(struct uxfs_fs *fs)
+{
+	fext_clear(fs);
+	fs->u_fext_loaded = 0;
+	fs->u_fext_stale = 1;
+}
+
+/*
+ * Empty the index, to be filled again as allocations need it.
+ */
+
+void uxfs_fext_reset(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+
+	uxfs_rsv_drop_all(sb, 0);
+	fext_clear(fs);
+	fs->u_fext_loaded = 0;
+	fs->u_fext_stale = 0;
+}
+
+/*
+ * Add the free runs of region "r" from the block map.
+ */
+
+static int fext_load(struct super_block *sb, unsigned r)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	__u32 i = r * UXFS_REGION_BLOCKS, start = 0, run = 0;
+	__u32 end = min_t(__u32, i + UXFS_REGION_BLOCKS,
+			  uxfs_nblocks(fs->u_sb));
+	char *map;
+
+	if (i >= end) {
+		__set_bit(r, &fs->u_fext_loaded);	/* past the end */
+		return 0;
+	}
+	map = uxfs_map_entry(sb, i);
+	if (!map)
+		return -EIO;
+	for (; i <= end; i++, map++) {
+		if (i < end && *map == UXFS_BLOCK_FREE) {
+			if (run++ == 0)
+				start = i;
+			continue;
+		}
+		if (run && fext_merge(fs, UXFS_FIRST_DATA_BLOCK + start, run)) {
+			fext_stale(fs);
+			return -ENOMEM;
+		}
+		run = 0;
+	}
+	__set_bit(r, &fs->u_fext_loaded);
+	uxfs_stat_inc(sb, UXFS_STAT_MAP_LOADS);
+	return 0;
+}
+
+/*
+ * Bring in the region of block "blk", if need be.
+ */
+
+static void fext_load_blk(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	unsigned r = (blk - UXFS_FIRST_DATA_BLOCK) / UXFS_REGION_BLOCKS;
+
+	if (r < UXFS_NREGIONS && !test_bit(r, &fs->u_fext_loaded))
+		fext_load(sb, r);
+}
+
+/*
+ * Bring in the region with the most free blocks of those not in
+ * the index yet. Returns 0 if there is none left with any.
+ */
+
+static int fext_load_more(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	int r, best = -1;
+
+	for (r = 0; r < UXFS_NREGIONS; r++) {
+		if (test_bit(r, &fs->u_fext_loaded) || !fs->u_rfree[r])
+			continue;
+		if (best < 0 || fs->u_rfree[r] > fs->u_rfree[best])
+			best = r;
+	}
+	if (best < 0 || fext_load(sb, best))
+		return 0;
+	return 1;
+}
+
+void uxfs_fext_destroy(struct super_block *sb)
+{
+	fext_clear(uxfs_sb(sb));
+}
+
+/*
+ * The smallest extent of at least "count" blocks, bringing in more
+ * regions until one turns up. Failing that the largest extent
+ * there is, or NULL if the index is empty.
+ */
+
+static struct uxfs_fext *fext_find(struct super_block *sb, __u32 count)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_fext *fe;
+
+	while (!(fe = fext_fit(fs, count)) && fext_load_more(sb))
+		;
+	if (!fe && fs->u_fext_len.rb_node)
+		fe = rb_entry(rb_last(&fs->u_fext_len), struct uxfs_fext,
+			      fe_by_len);
+	return fe;
+}
+
+/*
+ * Take up to "*count", and at least "min", contiguous blocks out of
+ * the index. The extent holding "goal" is used if enough of it is
+ * free from "goal" on, so that a file can grow in place; otherwise
+ * the smallest extent that holds "*count" blocks, or failing that
+ * the largest one there is. Returns the first block and sets
+ * "*count", or returns 0 if no extent of "min" blocks is free.
+ */
+
+__u32 uxfs_fext_alloc(struct super_block *sb, __u32 goal, unsigned *count,
+		      unsigned min)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_fext *fe;
+	__u32 blk, n;
+
+	if (fs->u_fext_stale)
+		uxfs_fext_reset(sb);
+	if (goal)
+		fext_load_blk(sb, goal);
+
+	fe = goal ? fext_prev(fs, goal) : NULL;
+	if (fe && fe->fe_blk + fe->fe_count >= goal + min &&
+	    fe->fe_blk + fe->fe_count > goal) {
+		blk = goal;
+		n = min_t(__u32, *count, fe->fe_blk + fe->fe_count - goal);
+	} else {
+		fe = fext_find(sb, *count);
+		if (!fe || fe->fe_count < min)
+			return 0;
+		blk = fe->fe_blk;
+		n = min_t(__u32, *count, fe->fe_count);
+	}
+
+	/*
+	 * Taking the middle of an extent splits it in two. If there's
+	 * no memory for the second half, take the front of the extent
+	 * instead.
+	 */
+
+	if (blk == fe->fe_blk)
+		fext_resize(fs, fe, blk + n, fe->fe_count - n);
+	else if (blk + n == fe->fe_blk + fe->fe_count)
+		fext_resize(fs, fe, fe->fe_blk, fe->fe_count - n);
+	else if (fext_add(fs, blk + n, fe->fe_blk + fe->fe_count - blk - n)) {
+		blk = fe->fe_blk;
+		fext_resize(fs, fe, blk + n, fe->fe_count - n);
+	} else
+		fext_resize(fs, fe, fe->fe_blk, blk - fe->fe_blk);
+	*count = n;
+	return blk;
+}
+
+/*
+ * Where to put a run of "want" blocks: the start of the smallest
+ * extent that holds them all, else of the largest one. 0 if there
+ * is no free space at all.
+ */
+
+__u32 uxfs_fext_goal(struct super_block *sb, unsigned want)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_fext *fe;
+
+	if (fs->u_fext_stale)
+		uxfs_fext_reset(sb);
+	fe = fext_find(sb, want);
+	return fe ? fe->fe_blk : 0;
+}
+
+/*
+ * Put "count" blocks starting at "blk" back into the index. Only
+ * the part in regions that are in the index goes in; the rest is
+ * read from the block map with its region.
+ */
+
+void uxfs_fext_free(struct super_block *sb, __u32 blk, unsigned count)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	__u32 i = blk - UXFS_FIRST_DATA_BLOCK, end = i + count, next;
+
+	if (fs->u_fext_stale)
+		return;
+	for (; i < end; i = next) {
+		next = min_t(__u32, roundup(i + 1, UXFS_REGION_BLOCKS), end);
+		if (!test_bit(i / UXFS_REGION_BLOCKS, &fs->u_fext_loaded))
+			continue;
+		if (fext_merge(fs, UXFS_FIRST_DATA_BLOCK + i, next - i)) {
+			fext_stale(fs);
+			return;
+		}
+	}
+}
+
+int __init uxfs_fext_init(void)
+{
+	uxfs_fext_cachep = kmem_cache_create("uxfs_fext_cache",
+					     sizeof(struct uxfs_fext), 0,
+					     SLAB_RECLAIM_ACCOUNT, NULL);
+	if (!uxfs_fext_cachep)
+		return -ENOMEM;
+	return 0;
+}
+
+void uxfs_fext_exit(void)
+{
+	kmem_cache_destroy(uxfs_fext_cachep);
+}
@@ -4,27 +4,273 @@
 
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/blkdev.h>
 #include "uxfs.h"
+#include "uxfs_trace.h"
 #include <linux/aio.h>
 
+/*
+ * A file's block map is loaded when it is first opened, see struct
+ * uxfs_inode_info. A writer that closes the file is done appending
+ * for now, give its reservation window back.
+ */
+
+static int uxfs_file_open(struct inode *inode, struct file *filp)
+{
+	int error;
+
+	error = uxfs_imap_load(inode);
+	if (error)
+		return error;
+	return generic_file_open(inode, filp);
+}
+
+/*
+ * The reservation window goes back when the last writer closes the
+ * file, so that appenders still at it keep theirs. The closing
+ * file's write access is only put after this returns, so it is
+ * still counted in i_writecount.
+ */
+
+static int uxfs_file_release(struct inode *inode, struct file *filp)
+{
+	if ((filp->f_mode & FMODE_WRITE) &&
+	    atomic_read(&inode->i_writecount) <= 1)
+		uxfs_rsv_discard(inode);
+	return 0;
+}
+
+/*
+ * Non-blocking I/O. A read or write through an open file that asked
+ * for it with UXFS_IOC_NOWAIT only goes ahead if it can be done in
+ * the page cache without waiting: every page it touches must be
+ * cached and up to date and, for a write, every block must already
+ * belong to the file alone, so that no read from disk, allocation
+ * or copy on write is needed. Otherwise it fails with -EAGAIN and
+ * the caller can retry from a context that is allowed to block.
+ * Synchronous writes always wait for the disk and so always get
+ * -EAGAIN. O_NONBLOCK is left alone, as on any other file: it is
+ * opened with often enough by programs that only mean to avoid
+ * blocking on FIFOs and devices.
+ *
+ * The pages are held while the I/O is done so that reclaim can't
+ * take them away in between.
+ */
+
+#define UXFS_FILE_NOWAIT	((void *)1)	/* in file->private_data */
+
+void uxfs_set_nowait(struct file *filp, int on)
+{
+	filp->private_data = on ? UXFS_FILE_NOWAIT : NULL;
+}
+
+static int uxfs_nowait(struct file *filp)
+{
+	return filp->private_data == UXFS_FILE_NOWAIT;
+}
+
+static void uxfs_nowait_put(struct page **pages, int n)
+{
+	while (n-- > 0)
+		page_cache_release(pages[n]);
+}
+
+/*
+ * Get the pages over "len" bytes at "pos" if they are all cached
+ * and up to date. Returns how many, or -1 if one isn't.
+ */
+
+static int uxfs_nowait_get(struct address_space *mapping, loff_t pos,
+			   size_t len, struct page **pages)
+{
+	pgoff_t index, last;
+	struct page *page;
+	int n = 0;
+
+	if (!len)
+		return 0;
+	index = pos >> PAGE_CACHE_SHIFT;
+	last = (pos + len - 1) >> PAGE_CACHE_SHIFT;
+	if (last >= UXFS_FILE_PAGES)
+		return -1;
+	for (; index <= last; index++) {
+		page = find_get_page(mapping, index);
+		if (!page || !PageUptodate(page)) {
+			if (page)
+				page_cache_release(page);
+			uxfs_nowait_put(pages, n);
+			return -1;
+		}
+		pages[n++] = page;
+	}
+	return n;
+}
+
+static int uxfs_nowait_mapped(struct inode *inode, loff_t pos, size_t len)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	sector_t iblock, last;
+	__u32 blk;
+
+	/*
+	 * Compressed files only get their blocks at writeback.
+	 */
+
+	if (!len || (uxi->i_flags & UXFS_COMPR_FL))
+		return 1;
+	iblock = pos >> UXFS_BSIZE_BITS;
+	last = (pos + len - 1) >> UXFS_BSIZE_BITS;
+	if (last >= UXFS_DIRECT_BLOCKS)
+		return 0;
+	for (; iblock <= last; iblock++) {
+		blk = uxi->i_addr[iblock];
+		if (!blk || uxfs_block_shared(inode->i_sb, blk))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * read(2) and write(2) come through here, so that the operation
+ * stream can be traced. An appending write only finds out where it
+ * goes once it has the inode locked, hence the position is taken
+ * from the iocb afterwards.
+ */
+
+static ssize_t uxfs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				  unsigned long nr_segs, loff_t pos)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	struct page *pages[UXFS_FILE_PAGES];
+	size_t len = iov_length(iov, nr_segs);
+	loff_t isize = i_size_read(inode);
+	ssize_t ret;
+	int n = 0;
+
+	if (uxfs_nowait(iocb->ki_filp) && pos < isize) {
+		n = uxfs_nowait_get(inode->i_mapping, pos,
+				    min_t(loff_t, len, isize - pos), pages);
+		if (n < 0) {
+			uxfs_stat_inc(inode->i_sb, UXFS_STAT_NOWAIT_AGAIN);
+			ret = -EAGAIN;
+			goto out;
+		}
+	}
+	ret = generic_file_aio_read(iocb, iov, nr_segs, pos);
+	uxfs_nowait_put(pages, n);
+      out:
+	trace_uxfs_op_read(inode, pos, len, ret);
+	return ret;
+}
+
+/*
+ * generic_file_aio_write() with the inode lock only tried for, and
+ * the write checked before anything is done.
+ */
+
+static ssize_t uxfs_nowait_write(struct kiocb *iocb, const struct iovec *iov,
+				 unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_mapping->host;
+	size_t len = iov_length(iov, nr_segs);
+	struct page *pages[UXFS_FILE_PAGES];
+	struct blk_plug plug;
+	ssize_t ret;
+	int n = -1;
+
+	if ((file->f_flags & O_DSYNC) || IS_SYNC(inode) ||
+	    !mutex_trylock(&inode->i_mutex))
+		return -EAGAIN;
+	if (file->f_flags & O_APPEND)
+		pos = i_size_read(inode);
+	if (uxfs_nowait_mapped(inode, pos, len))
+		n = uxfs_nowait_get(inode->i_mapping, pos, len, pages);
+	if (n < 0) {
+		mutex_unlock(&inode->i_mutex);
+		return -EAGAIN;
+	}
+	blk_start_plug(&plug);
+	ret = __generic_file_aio_write(iocb, iov, nr_segs, &iocb->ki_pos);
+	blk_finish_plug(&plug);
+	uxfs_nowait_put(pages, n);
+	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
+static ssize_t uxfs_file_aio_write(struct kiocb *iocb,
+				   const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos)
+{
+	struct inode *inode = iocb->ki_filp->f_mapping->host;
+	ssize_t ret;
+
+	if (uxfs_nowait(iocb->ki_filp)) {
+		ret = uxfs_nowait_write(iocb, iov, nr_segs, pos);
+		if (ret == -EAGAIN)
+			uxfs_stat_inc(inode->i_sb, UXFS_STAT_NOWAIT_AGAIN);
+	} else
+		ret = generic_file_aio_write(iocb, iov, nr_segs, pos);
+	trace_uxfs_op_write(inode, ret > 0 ? iocb->ki_pos - ret : pos,
+			    iov_length(iov, nr_segs), ret);
+	return ret;
+}
+
 struct file_operations uxfs_file_operations = {
 	.llseek = generic_file_llseek,
 	.read = do_sync_read,
-	.aio_read = generic_file_aio_read,	//added 
+	.aio_read = uxfs_file_aio_read,
 	.write = do_sync_write,
-	.aio_write = generic_file_aio_write,	//added
-	.mmap = generic_file_mmap,
+	.aio_write = uxfs_file_aio_write,
+	.mmap = uxfs_file_mmap,
 	.splice_read = generic_file_splice_read,	//added
+	.splice_write = generic_file_splice_write,
+	.fsync = generic_file_fsync,
+	.unlocked_ioctl = uxfs_ioctl,
+	.open = uxfs_file_open,
+	.release = uxfs_file_release,
+};
+
+/*
+ * Files of the snapshot, see uxfs_snap.c.
+ */
+
+struct file_operations uxfs_snap_file_operations = {
+	.llseek = generic_file_llseek,
+	.read = do_sync_read,
+	.aio_read = generic_file_aio_read,
+	.mmap = generic_file_readonly_mmap,
+	.splice_read = generic_file_splice_read,
+	.open = uxfs_file_open,
 };
 
+/*
+ * Map file blocks starting at "iblock". Callers that can take more
+ * than one block (mpage reads and writeback) pass the size they
+ * want in bh_result->b_size; we map as much of that as is
+ * physically contiguous on disk and hand back the length in
+ * b_size, so that a whole run of blocks goes out as one bio. On a
+ * striped volume a run ends with its stripe unit.
+ *
+ * Unallocated blocks are left unmapped unless we're creating, in
+ * which case a single new block is allocated.
+ */
+
 int uxfs_get_block(struct inode *inode,
 		   sector_t iblock, struct buffer_head *bh_result,
 		   int create)
 {
 	struct super_block *sb = inode->i_sb;
-	struct uxfs_inode *uip = (struct uxfs_inode *)inode->i_private;
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	unsigned long max = bh_result->b_size >> UXFS_BSIZE_BITS;
+	unsigned long count = 1;
+	u64 ns, start = uxfs_lat_start();
 	__u32 blk;
 
+	uxfs_stat_inc(sb, UXFS_STAT_GET_BLOCK);
+
 	/*
 	 * First check to see is the file can be extended.
 	 */
@@ -32,26 +278,42 @@ int uxfs_get_block(struct inode *inode,
 	if (iblock >= UXFS_DIRECT_BLOCKS)
 		return -EFBIG;
 
-	/*
-	 * If we're creating, we must allocate a new block.
-	 */
+	blk = uxi->i_addr[iblock];
+	if (blk == 0) {
+		if (!create)
+			goto out;
+
+		/*
+		 * If we're creating, we must allocate a new block,
+		 * from the file's reservation window if it has one.
+		 */
 
-	if (create) {
-		blk = uxfs_block_alloc(sb);
+		blk = uxfs_rsv_alloc(inode, iblock);
 		if (blk == 0) {
 			printk(KERN_ERR "uxfs: uxfs_get_block - "
 			       "Out of space\n");
 			return -ENOSPC;
 		}
-		uip->i_addr[iblock] = blk;
-		uip->i_blocks++;
-		uip->i_size = inode->i_size;
+		uxi->i_addr[iblock] = blk;
+		inode->i_blocks++;
 		mark_inode_dirty(inode);
+		set_buffer_new(bh_result);
+		uxfs_stat_inc(sb, UXFS_STAT_GET_BLOCK_ALLOC);
+	} else {
+		unsigned long run = uxfs_stripe_run(sb, blk);
+
+		while (count < max && count < run &&
+		       iblock + count < UXFS_DIRECT_BLOCKS &&
+		       uxi->i_addr[iblock + count] == blk + count)
+			count++;
 	}
-	bh_result->b_bdev = sb->s_bdev;	//changed from inode->i_bdev (which was null and stupid)
-	bh_result->b_blocknr = uip->i_addr[iblock];
-	bh_result->b_state |= (1UL << BH_Mapped);
+	uxfs_map_bh(bh_result, sb, blk);
+	bh_result->b_size = count << UXFS_BSIZE_BITS;
+	uxfs_stat_add(sb, UXFS_STAT_GET_BLOCK_MAPPED, count);
 
+      out:
+	ns = uxfs_lat_end(sb, UXFS_LAT_GET_BLOCK, start);
+	trace_uxfs_get_block(inode, iblock, blk, create, ns);
 	return 0;
 }
 
@@ -60,17 +322,50 @@ int uxfs_writepage(struct page *page, struct writeback_control *wbc)
 	return block_write_full_page(page, uxfs_get_block, wbc);
 }
 
+/*
+ * Write back dirty pages in runs, one bio per contiguous run of
+ * blocks rather than one buffer_head submission per block.
+ */
+
+int uxfs_writepages(struct address_space *mapping,
+		    struct writeback_control *wbc)
+{
+	return mpage_writepages(mapping, wbc, uxfs_get_block);
+}
+
 int uxfs_readpage(struct file *file, struct page *page)
 {
-	return block_read_full_page(page, uxfs_get_block);
+	return mpage_readpage(page, uxfs_get_block);
 }
 
+int uxfs_readpages(struct file *file, struct address_space *mapping,
+		   struct list_head *pages, unsigned nr_pages)
+{
+	return mpage_readpages(mapping, pages, nr_pages, uxfs_get_block);
+}
+
+/*
+ * Blocks shared with another file are replaced before the page is
+ * written to, see uxfs_clone.c.
+ */
+
 int uxfs_write_begin(struct file *file, struct address_space *mapping,
 		     loff_t pos, unsigned len, unsigned flags,
 		     struct page **pagep, void **fsdata)
 {
-	return block_write_begin(file->f_mapping, pos, len, flags, pagep,
-				 uxfs_get_block);
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	int error;
+
+	error = block_write_begin(file->f_mapping, pos, len, flags, pagep,
+				  uxfs_get_block);
+	if (error)
+		return error;
+	error = uxfs_cow_page(mapping->host, *pagep, from, from + len);
+	if (error) {
+		unlock_page(*pagep);
+		page_cache_release(*pagep);
+	}
+	return error;
 }
 
 sector_t uxfs_bmap(struct address_space * mapping, sector_t block)
@@ -80,6 +375,26 @@ sector_t uxfs_bmap(struct address_space * mapping, sector_t block)
 
 struct address_space_operations uxfs_aops = {
 	.readpage = uxfs_readpage,
+	.readpages = uxfs_readpages,
+	.writepage = uxfs_writepage,
+	.writepages = uxfs_writepages,
+	.write_begin = uxfs_write_begin,
+	.write_end = generic_write_end,
+	.bmap = uxfs_bmap,
+};
+
+/*
+ * Files of striped volumes, whose blocks may be on different
+ * devices: no mpage I/O, see uxfs_stripe.c.
+ */
+
+static int uxfs_stripe_readpage(struct file *file, struct page *page)
+{
+	return block_read_full_page(page, uxfs_get_block);
+}
+
+struct address_space_operations uxfs_stripe_aops = {
+	.readpage = uxfs_stripe_readpage,
 	.writepage = uxfs_writepage,
 	.write_begin = uxfs_write_begin,
 	.write_end = generic_write_end,
@@ -0,0 +1,212 @@
+/*--------------------------------------------------------------*/
+/*---------------------------- uxfs_free.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/buffer_head.h>
+#include "uxfs.h"
+
+/*
+ * Deferred freeing. The last iput() of an unlinked inode used to
+ * give back its blocks and the inode itself there and then, block
+ * by block, in the unlink or rmdir that dropped it. Now
+ * uxfs_destroy_inode() marks the inode UXFS_INODE_ORPHAN and queues
+ * it here, and a work item frees everything queued a little later
+ * in one pass over the maps, under a single hold of u_alloc_lock.
+ *
+ * Until then the inode number and the blocks stay taken, but
+ * uxfs_statfs() already counts them as free. An allocation that
+ * comes up short, sync and unmount run the queue first, so nothing
+ * ever fails for space that is only waiting to be freed. Orphans
+ * left by a crash are found in the inode map and queued again at
+ * mount.
+ */
+
+#define UXFS_FREE_DELAY		(HZ / 10)
+
+struct uxfs_free {
+	struct list_head f_list;
+	unsigned long f_ino;
+	unsigned long f_blocks;		/* counted in u_free_blocks */
+	int f_mapped;			/* f_addr is valid */
+	__u32 f_addr[UXFS_DIRECT_BLOCKS];
+};
+
+static int free_add(struct super_block *sb, unsigned long ino,
+		    unsigned long blocks, __u32 *addr)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_free *f;
+
+	f = kmalloc(sizeof(*f), GFP_NOFS);
+	if (!f)
+		return -ENOMEM;
+	f->f_ino = ino;
+	f->f_blocks = blocks;
+	f->f_mapped = addr != NULL;
+	if (addr)
+		memcpy(f->f_addr, addr, UXFS_IMAP_SIZE);
+	spin_lock(&fs->u_free_lock);
+	list_add_tail(&f->f_list, &fs->u_free_list);
+	fs->u_free_blocks += blocks;
+	fs->u_free_inodes++;
+	spin_unlock(&fs->u_free_lock);
+	schedule_delayed_work(&fs->u_free_work, UXFS_FREE_DELAY);
+	return 0;
+}
+
+/*
+ * Queue the unlinked "inode" for freeing. If that fails the caller
+ * frees it itself, there and then.
+ */
+
+int uxfs_free_queue(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	int error;
+
+	mutex_lock(&fs->u_alloc_lock);
+	fs->u_sb->s_inode[inode->i_ino] = UXFS_INODE_ORPHAN;
+	uxfs_dirty_super(sb);
+	mutex_unlock(&fs->u_alloc_lock);
+	error = free_add(sb, inode->i_ino, inode->i_blocks,
+			 uxfs_i(inode)->i_addr);
+	if (!error)
+		uxfs_stat_inc(sb, UXFS_STAT_FREE_QUEUED);
+	return error;
+}
+
+/*
+ * Free everything queued. The maps of inodes that weren't in core
+ * are read first, outside the allocation lock.
+ */
+
+void uxfs_free_drain(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_superblock *usb = fs->u_sb;
+	struct uxfs_free *f, *next;
+	struct buffer_head *bh;
+	struct uxfs_inode *di;
+	unsigned long blocks = 0, inodes = 0;
+	LIST_HEAD(list);
+	int i;
+
+	mutex_lock(&fs->u_free_mutex);
+	spin_lock(&fs->u_free_lock);
+	list_splice_init(&fs->u_free_list, &list);
+	spin_unlock(&fs->u_free_lock);
+	if (list_empty(&list))
+		goto out;
+
+	list_for_each_entry(f, &list, f_list) {
+		if (f->f_mapped)
+			continue;
+		bh = uxfs_dinode_bread(sb, f->f_ino, &di);
+		if (bh) {
+			memcpy(f->f_addr, di->i_addr, UXFS_IMAP_SIZE);
+			brelse(bh);
+		} else {
+			printk(KERN_ERR "uxfs: Unable to free the blocks of "
+			       "inode %lu\n", f->f_ino);
+			memset(f->f_addr, 0, UXFS_IMAP_SIZE);
+		}
+	}
+
+	mutex_lock(&fs->u_alloc_lock);
+	list_for_each_entry(f, &list, f_list) {
+		for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
+			if (f->f_addr[i])
+				uxfs_block_put(sb, f->f_addr[i]);
+		}
+		usb->s_inode[f->f_ino] = UXFS_INODE_FREE;
+		usb->s_nifree++;
+		blocks += f->f_blocks;
+		inodes++;
+	}
+	uxfs_dirty_super(sb);
+	mutex_unlock(&fs->u_alloc_lock);
+
+	spin_lock(&fs->u_free_lock);
+	fs->u_free_blocks -= blocks;
+	fs->u_free_inodes -= inodes;
+	spin_unlock(&fs->u_free_lock);
+	list_for_each_entry_safe(f, next, &list, f_list)
+		kfree(f);
+	uxfs_stat_inc(sb, UXFS_STAT_FREE_BATCHES);
+      out:
+	mutex_unlock(&fs->u_free_mutex);
+}
+
+static void uxfs_free_worker(struct work_struct *work)
+{
+	struct uxfs_fs *fs = container_of(to_delayed_work(work),
+					  struct uxfs_fs, u_free_work);
+
+	uxfs_free_drain(fs->u_vfs_sb);
+}
+
+/*
+ * Are there inodes waiting to be freed?
+ */
+
+int uxfs_free_pending(struct super_block *sb)
+{
+	return uxfs_sb(sb)->u_free_inodes != 0;
+}
+
+/*
+ * Blocks and inodes that are free but for the queue, for statfs.
+ */
+
+void uxfs_free_counts(struct super_block *sb, unsigned long *blocks,
+		      unsigned long *inodes)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+
+	spin_lock(&fs->u_free_lock);
+	*blocks = fs->u_free_blocks;
+	*inodes = fs->u_free_inodes;
+	spin_unlock(&fs->u_free_lock);
+}
+
+void uxfs_free_init(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+
+	spin_lock_init(&fs->u_free_lock);
+	INIT_LIST_HEAD(&fs->u_free_list);
+	mutex_init(&fs->u_free_mutex);
+	INIT_DELAYED_WORK(&fs->u_free_work, uxfs_free_worker);
+}
+
+/*
+ * Queue the orphans a crash left behind. Their block counts aren't
+ * known until their maps are read, so statfs doesn't see them as
+ * free meanwhile.
+ */
+
+void uxfs_free_resume(struct super_block *sb)
+{
+	struct uxfs_superblock *usb = uxfs_sb(sb)->u_sb;
+	int i;
+
+	for (i = UXFS_ROOT_INO; i < UXFS_MAXFILES; i++) {
+		if (usb->s_inode[i] == UXFS_INODE_ORPHAN &&
+		    free_add(sb, i, 0, NULL))
+			break;
+	}
+}
+
+/*
+ * Unmount: finish off the queue.
+ */
+
+void uxfs_free_stop(struct super_block *sb)
+{
+	cancel_delayed_work_sync(&uxfs_sb(sb)->u_free_work);
+	uxfs_free_drain(sb);
+}
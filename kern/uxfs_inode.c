@@ -9,9 +9,12 @@
 #include <linux/statfs.h>
 #include <asm/uaccess.h>
 #include <linux/buffer_head.h>
+#include <linux/writeback.h>
 #include <linux/syscalls.h>
 #include <linux/kdev_t.h>
+#include <linux/parser.h>
 #include "uxfs.h"
+#include "uxfs_trace.h"
 
 MODULE_AUTHOR
     ("Steve Pate <spate@veritas.com>, Wilson Felipe <wfelipe@gmail.com>");
@@ -20,32 +23,48 @@ MODULE_LICENSE("GPL");
 
 /*
  * This function looks for "name" in the directory "dip". 
- * If found the inode number is returned.
+ * If found the inode number is returned. Once the directory is in
+ * the name cache its pages needn't be looked at at all.
  */
 
 int uxfs_find_entry(struct inode *dip, char *name)
 {
 	struct uxfs_inode_info *uxi = uxfs_i(dip);
 	struct super_block *sb = dip->i_sb;
-	struct buffer_head *bh = NULL;
 	struct uxfs_dirent *dirent;
-	int i, blk = 0;
-
-	for (blk = 0; blk < uxi->uip.i_blocks; blk++) {
-		bh = sb_bread(sb, uxi->uip.i_addr[blk]);
-		dirent = (struct uxfs_dirent *)bh->b_data;
+	struct page *page = NULL;
+	u64 ns, start = uxfs_lat_start();
+	int i, blk = 0, inum = 0;
+
+	uxfs_stat_inc(sb, UXFS_STAT_FIND_ENTRY);
+	down_read(&uxi->i_dir_sem);
+	inum = uxfs_ncache_find(dip, name);
+	if (inum >= 0)
+		goto out;
+
+	inum = 0;
+	uxfs_dir_readahead(dip, NULL, 0);
+	while (!inum && blk < dip->i_blocks) {
+		dirent = uxfs_dir_block(dip, blk, &page);
+		if (!dirent)
+			break;
+		blk++;
 		for (i = 0; i < UXFS_DIRS_PER_BLOCK; i++) {
-			if (strcmp(dirent->d_name, name) == 0) {
-				brelse(bh);
-				return dirent->d_ino;
+			if (strncmp(dirent->d_name, name, UXFS_NAMELEN) == 0) {
+				inum = dirent->d_ino;
+				break;
 			}
 			dirent++;
 		}
 	}
-	if (bh)
-		brelse(bh);
-
-	return 0;
+	uxfs_dir_put_page(page);
+	uxfs_stat_add(sb, UXFS_STAT_FIND_BLOCKS, blk);
+
+      out:
+	up_read(&uxi->i_dir_sem);
+	ns = uxfs_lat_end(sb, UXFS_LAT_FIND_ENTRY, start);
+	trace_uxfs_find_entry(dip, name, inum, blk, ns);
+	return inum;
 }
 
 /*
@@ -58,32 +77,53 @@ struct inode *uxfs_iget(struct super_block *sb, unsigned long ino)
 	struct buffer_head *bh;
 	struct uxfs_inode *di;
 	struct inode *inode;
-	int block;
+	u64 ns, start = uxfs_lat_start();
+	unsigned long live = ino;
+	int error;
 
 	inode = iget_locked(sb, ino);
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
-	if (!(inode->i_state & I_NEW))
+	if (!(inode->i_state & I_NEW)) {
+		ns = uxfs_lat_end(sb, UXFS_LAT_IGET, start);
+		trace_uxfs_iget(sb, ino, 1, ns);
 		return inode;
+	}
 
-	if (ino < UXFS_ROOT_INO || ino > UXFS_MAXFILES) {
+	if (uxfs_snap_ino(ino))
+		live = ino - UXFS_SNAP_INO;
+	if (live < UXFS_ROOT_INO || live >= UXFS_MAXFILES) {
 		printk(KERN_ERR "uxfs: Bad inode number %lu\n", ino);
+		iget_failed(inode);
 		return ERR_PTR(-EIO);
 	}
 
 	/*
-	 * Note that for simplicity, there is only one 
-	 * inode per block!
+	 * Stat-ahead may ask for an inode that has since been unlinked
+	 * and is being freed, or is free.
 	 */
 
-	block = UXFS_INODE_BLOCK + ino;
-	bh = sb_bread(inode->i_sb, block);
+	if (!uxfs_snap_ino(ino) &&
+	    uxfs_sb(sb)->u_sb->s_inode[ino] != UXFS_INODE_INUSE) {
+		iget_failed(inode);
+		return ERR_PTR(-ESTALE);
+	}
+	if (uxfs_snap_ino(ino)) {
+		error = uxfs_snap_iget(inode);
+		if (error) {
+			iget_failed(inode);
+			return ERR_PTR(error);
+		}
+	}
+
+	bh = uxfs_dinode_bread(sb, ino, &di);
 	if (!bh) {
 		printk(KERN_ERR "Unable to read inode %lu\n", ino);
+		iget_failed(inode);
 		return ERR_PTR(-EIO);
 	}
+	uxfs_stat_inc(sb, UXFS_STAT_INODE_READ);
 
-	di = (struct uxfs_inode *)(bh->b_data);
 	inode->i_mode = di->i_mode;
 	if (di->i_mode & S_IFDIR) {
 		inode->i_mode |= S_IFDIR;
@@ -93,63 +133,226 @@ struct inode *uxfs_iget(struct super_block *sb, unsigned long ino)
 		inode->i_mode |= S_IFREG;
 		inode->i_op = &uxfs_file_inops;
 		inode->i_fop = &uxfs_file_operations;
-		inode->i_mapping->a_ops = &uxfs_aops;
 	}
 	inode->i_uid = di->i_uid;
 	inode->i_gid = di->i_gid;
 	set_nlink(inode, di->i_nlink);
 	inode->i_size = di->i_size;
 	inode->i_blocks = di->i_blocks;
-	inode->i_blkbits = UXFS_BSIZE;
+	inode->i_blkbits = UXFS_BSIZE_BITS;
 	inode->i_atime.tv_sec = di->i_atime;
 	inode->i_mtime.tv_sec = di->i_mtime;
 	inode->i_ctime.tv_sec = di->i_ctime;
-	inode->i_private = uxfs_i(inode);
-	memcpy(inode->i_private, di, sizeof(struct uxfs_inode));
+	uxfs_i(inode)->i_flags = di->i_flags;
+	if (S_ISREG(inode->i_mode))
+		uxfs_set_file_aops(inode);
+	else if (S_ISDIR(inode->i_mode))
+		uxfs_set_dir_aops(inode);
+	if (uxfs_snap_ino(ino))
+		uxfs_snap_init_inode(inode);
 
+	/*
+	 * Any use of a directory needs its block map, a file's waits
+	 * until it is opened.
+	 */
+
+	if (S_ISDIR(inode->i_mode)) {
+		if (uxfs_imap_new(inode)) {
+			brelse(bh);
+			iget_failed(inode);
+			return ERR_PTR(-ENOMEM);
+		}
+		memcpy(uxfs_i(inode)->i_addr, di->i_addr, UXFS_IMAP_SIZE);
+	}
 	brelse(bh);
 
 	unlock_new_inode(inode);
+	ns = uxfs_lat_end(sb, UXFS_LAT_IGET, start);
+	trace_uxfs_iget(sb, ino, 0, ns);
 	return inode;
 }
 
+/*
+ * Read the on-disk copy of inode "ino", returning its buffer with
+ * "*di" pointing at the inode in it. There is only one inode per
+ * block, but for those of a snapshot (see uxfs_snap.c).
+ */
+
+struct buffer_head *uxfs_dinode_bread(struct super_block *sb,
+				      unsigned long ino, struct uxfs_inode **di)
+{
+	struct buffer_head *bh;
+
+	if (uxfs_snap_ino(ino))
+		return uxfs_snap_bread(sb, ino - UXFS_SNAP_INO, di);
+	bh = sb_bread(sb, UXFS_INODE_BLOCK + ino);
+	if (bh)
+		*di = (struct uxfs_inode *)bh->b_data;
+	return bh;
+}
+
+/*
+ * Block maps, see struct uxfs_inode_info.
+ */
+
+static struct kmem_cache *uxfs_imap_cachep;
+
+/*
+ * Give a new inode, or a directory being read in, an empty map.
+ */
+
+int uxfs_imap_new(struct inode *inode)
+{
+	uxfs_i(inode)->i_addr = kmem_cache_zalloc(uxfs_imap_cachep, GFP_NOFS);
+	return uxfs_i(inode)->i_addr ? 0 : -ENOMEM;
+}
+
+/*
+ * Read the map of an inode that doesn't have one yet. Until it has
+ * one nothing can have changed it, so the copy on disk (or in the
+ * buffer cache, if the inode was written lately) is current. Two
+ * racing loaders read the same map; the loser frees its copy.
+ */
+
+int uxfs_imap_load(struct inode *inode)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	struct buffer_head *bh;
+	struct uxfs_inode *di;
+	__u32 *map;
+
+	if (uxi->i_addr)
+		return 0;
+	map = kmem_cache_alloc(uxfs_imap_cachep, GFP_NOFS);
+	if (!map)
+		return -ENOMEM;
+	bh = uxfs_dinode_bread(inode->i_sb, inode->i_ino, &di);
+	if (!bh) {
+		kmem_cache_free(uxfs_imap_cachep, map);
+		return -EIO;
+	}
+	memcpy(map, di->i_addr, UXFS_IMAP_SIZE);
+	brelse(bh);
+	if (cmpxchg(&uxi->i_addr, NULL, map))
+		kmem_cache_free(uxfs_imap_cachep, map);
+	else
+		uxfs_stat_inc(inode->i_sb, UXFS_STAT_IMAP_LOAD);
+	return 0;
+}
+
+/*
+ * Note what kind of change dirtied the inode. The VFS dirties it
+ * with I_DIRTY_SYNC alone for timestamp updates, everything else
+ * goes through mark_inode_dirty().
+ */
+
+void uxfs_dirty_inode(struct inode *inode, int flags)
+{
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+
+	if (flags & I_DIRTY_DATASYNC)
+		set_bit(UXFS_I_META, &uxi->i_dirty);
+	else if (!test_and_set_bit(UXFS_I_TIME, &uxi->i_dirty))
+		uxi->i_time_dirtied = jiffies;
+}
+
 /*
  * This function is called to write a dirty inode to disk.
+ *
+ * With lazytime, background writeback of an inode whose times are
+ * all that changed leaves it dirty in memory instead; data
+ * integrity writeback (fsync, sync, unmount) always writes it.
+ *
+ * An inode has its block to itself, so if the block map is in core
+ * the block is never read first: the whole of it is rebuilt from
+ * the in-core inode. Without a map the one on disk is current and
+ * is kept. Inode blocks are adjacent on disk, so the dirty blocks
+ * of several inodes go out together when the device's page cache
+ * is written. A snapshot gets its copy of the old inode first.
  */
 
 int uxfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
 	unsigned long ino = inode->i_ino;
 	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	struct super_block *sb = inode->i_sb;
 	struct buffer_head *bh;
+	struct uxfs_inode *di;
+	u64 ns, start = uxfs_lat_start();
 	__u32 blk;
+	int error = 0;
 
-
-	if (ino < UXFS_ROOT_INO || ino > UXFS_MAXFILES) {
+	if (uxfs_snap_ino(ino))
+		return 0;
+	if (ino < UXFS_ROOT_INO || ino >= UXFS_MAXFILES) {
 		printk(KERN_ERR "uxfs: Bad inode number %lu\n", ino);
 		return -EIO;
 	}
+	if (uxfs_sb(sb)->u_lazytime && wbc->sync_mode != WB_SYNC_ALL &&
+	    !test_bit(UXFS_I_META, &uxi->i_dirty) &&
+	    test_bit(UXFS_I_TIME, &uxi->i_dirty) &&
+	    time_before(jiffies, uxi->i_time_dirtied + UXFS_LAZYTIME_EXPIRE)) {
+		mark_inode_dirty_sync(inode);
+		uxfs_stat_inc(sb, UXFS_STAT_INODE_LAZY);
+		return 0;
+	}
+	error = uxfs_snap_save_inode(sb, ino);
+	if (error)
+		return error;
+	clear_bit(UXFS_I_META, &uxi->i_dirty);
+	clear_bit(UXFS_I_TIME, &uxi->i_dirty);
+
 	blk = UXFS_INODE_BLOCK + ino;
-	bh = sb_bread(inode->i_sb, blk);
-	uxi->uip.i_mode = inode->i_mode;
-	uxi->uip.i_nlink = inode->i_nlink;
-	uxi->uip.i_atime = inode->i_atime.tv_sec;
-	uxi->uip.i_mtime = inode->i_mtime.tv_sec;
-	uxi->uip.i_ctime = inode->i_ctime.tv_sec;
-	uxi->uip.i_uid = inode->i_uid;
-	uxi->uip.i_gid = inode->i_gid;
-	uxi->uip.i_size = inode->i_size;
-	memcpy(bh->b_data, &uxi->uip, sizeof(struct uxfs_inode));
+	bh = uxi->i_addr ? sb_getblk(sb, blk) : sb_bread(sb, blk);
+	if (!bh)
+		return -EIO;
+	lock_buffer(bh);
+	if (!buffer_uptodate(bh))
+		memset(bh->b_data, 0, UXFS_BSIZE);
+	di = (struct uxfs_inode *)bh->b_data;
+	di->i_mode = inode->i_mode;
+	di->i_nlink = inode->i_nlink;
+	di->i_atime = inode->i_atime.tv_sec;
+	di->i_mtime = inode->i_mtime.tv_sec;
+	di->i_ctime = inode->i_ctime.tv_sec;
+	di->i_uid = inode->i_uid;
+	di->i_gid = inode->i_gid;
+	di->i_size = inode->i_size;
+	di->i_blocks = inode->i_blocks;
+	di->i_flags = uxi->i_flags;
+	if (uxi->i_addr)
+		memcpy(di->i_addr, uxi->i_addr, UXFS_IMAP_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
 	mark_buffer_dirty(bh);
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		error = sync_dirty_buffer(bh);
 	brelse(bh);
 
-	return 0;
+	uxfs_stat_inc(sb, UXFS_STAT_INODE_WRITE);
+	ns = uxfs_lat_end(sb, UXFS_LAT_WRITE_INODE, start);
+	trace_uxfs_write_inode(inode, ns);
+	return error;
 }
 
 /*
- * This function gets called when the link count goes to zero.
+ * Called whenever an inode leaves the cache. Only when the link
+ * count has gone to zero is the file gone; its blocks are then
+ * released (those shared with clones just lose a reference) and
+ * so is the inode. That normally happens in the background, see
+ * uxfs_free.c; if it can't be queued, it is done here, and a file
+ * that was never opened loads its map for that first.
  */
 
+static struct kmem_cache *uxfs_inode_cachep;
+
+static void uxfs_i_callback(struct rcu_head *head)
+{
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(uxfs_inode_cachep, uxfs_i(inode));
+}
+
 void uxfs_destroy_inode(struct inode *inode)
 {
 	unsigned long inum = inode->i_ino;
@@ -159,16 +362,35 @@ void uxfs_destroy_inode(struct inode *inode)
 	struct uxfs_superblock *usb = fs->u_sb;
 	int i;
 
-	usb->s_nbfree += uxi->uip.i_blocks;
-	for (i = 0; i < uxi->uip.i_blocks; i++) {
-		usb->s_block[uxi->uip.i_addr[i] - UXFS_FIRST_DATA_BLOCK] =
-		    UXFS_BLOCK_FREE;
-		uxi->uip.i_addr[i] = UXFS_BLOCK_FREE;
+	uxfs_ncache_drop(inode);
+	uxfs_sa_free(inode);
+	uxfs_rsv_discard(inode);
+	if (inode->i_nlink || uxfs_snap_ino(inum))
+		goto out;
+	if (!uxfs_free_queue(inode))
+		goto out;
+	if (uxfs_imap_load(inode)) {
+		printk(KERN_ERR "uxfs: Unable to free the blocks of inode "
+		       "%lu\n", inum);
+	} else {
+		for (i = 0; i < UXFS_DIRECT_BLOCKS; i++) {
+			if (uxi->i_addr[i] == 0)
+				continue;
+			uxfs_block_free(sb, uxi->i_addr[i]);
+			uxi->i_addr[i] = 0;
+		}
 	}
+	mutex_lock(&fs->u_alloc_lock);
 	usb->s_inode[inum] = UXFS_INODE_FREE;
 	usb->s_nifree++;
-	sb->s_dirt = 1;
-	//clear_inode(inode);
+	uxfs_dirty_super(sb);
+	mutex_unlock(&fs->u_alloc_lock);
+      out:
+	if (uxfs_snap_ino(inum))
+		uxfs_snap_iput(inode);
+	if (uxi->i_addr)
+		kmem_cache_free(uxfs_imap_cachep, uxi->i_addr);
+	call_rcu(&inode->i_rcu, uxfs_i_callback);
 }
 
 /*
@@ -186,6 +408,14 @@ void uxfs_put_super(struct super_block *s)
 	 * Free the uxfs_fs structure allocated by uxfs_get_sb
 	 */
 
+	uxfs_free_stop(s);
+	if (s->s_dirt)
+		uxfs_write_super(s);
+	uxfs_sysfs_unregister(s);
+	uxfs_fext_destroy(s);
+	uxfs_map_release(s);
+	uxfs_devs_close(s);
+	brelse(fs->u_snapbh);
 	kfree(fs);
 	brelse(bh);
 }
@@ -199,14 +429,22 @@ int uxfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	struct super_block *sb = dentry->d_sb;
 	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
 	struct uxfs_superblock *usb = fs->u_sb;
+	unsigned long blocks, inodes;
+
+	/*
+	 * Compressed files only hold the blocks they need, so the
+	 * free count already reflects the space compression saved.
+	 * Unlinked files still being freed count as gone.
+	 */
 
+	uxfs_free_counts(sb, &blocks, &inodes);
 	buf->f_type = UXFS_MAGIC;
 	buf->f_bsize = UXFS_BSIZE;
-	buf->f_blocks = UXFS_MAXBLOCKS;
-	buf->f_bfree = usb->s_nbfree;
-	buf->f_bavail = usb->s_nbfree;
+	buf->f_blocks = uxfs_nblocks(usb);
+	buf->f_bfree = usb->s_nbfree + blocks;
+	buf->f_bavail = usb->s_nbfree + blocks;
 	buf->f_files = UXFS_MAXFILES;
-	buf->f_ffree = usb->s_nifree;
+	buf->f_ffree = usb->s_nifree + inodes;
 	buf->f_fsid.val[0] = sb->s_dev;
 	buf->f_namelen = UXFS_NAMELEN;
 
@@ -224,13 +462,26 @@ void uxfs_write_super(struct super_block *sb)
 	struct uxfs_fs *fs = (struct uxfs_fs *)sb->s_fs_info;
 	struct buffer_head *bh = fs->u_sbh;
 
-	if (!(sb->s_flags & MS_RDONLY))
+	uxfs_stat_inc(sb, UXFS_STAT_SUPER_WRITE);
+	if (!(sb->s_flags & MS_RDONLY)) {
 		mark_buffer_dirty(bh);
+		mark_buffer_dirty(fs->u_snapbh);
+	}
 
 	sb->s_dirt = 0;
 }
 
-static struct kmem_cache *uxfs_inode_cachep;
+/*
+ * A waiting sync finishes off the deferred frees first, so that
+ * what it writes has them.
+ */
+
+static int uxfs_sync_fs(struct super_block *sb, int wait)
+{
+	if (wait)
+		uxfs_free_drain(sb);
+	return uxfs_devs_sync(sb, wait);
+}
 
 struct inode *uxfs_alloc_inode(struct super_block *sb)
 {
@@ -238,28 +489,114 @@ struct inode *uxfs_alloc_inode(struct super_block *sb)
 
 	ui = (struct uxfs_inode_info *)kmem_cache_alloc(uxfs_inode_cachep,
 							GFP_KERNEL);
+	if (!ui)
+		return NULL;
+	ui->i_addr = NULL;
+	ui->i_flags = 0;
+	atomic_set(&ui->i_dir_opens, 0);
+	ui->i_ncache = NULL;
+	ui->i_sa = NULL;
+	INIT_LIST_HEAD(&ui->i_rsv_list);
+	ui->i_rsv_len = 0;
+	ui->i_rsv_size = 0;
+	ui->i_dirty = 0;
 	return &ui->vfs_inode;
 }
 
+/*
+ * Snapshot inodes leave the cache as soon as they are unused, so
+ * that the snapshot can be deleted.
+ */
+
+static int uxfs_drop_inode(struct inode *inode)
+{
+	return uxfs_snap_ino(inode->i_ino) || generic_drop_inode(inode);
+}
+
 struct super_operations uxfs_sops = {
+	.dirty_inode = uxfs_dirty_inode,
 	.write_inode = uxfs_write_inode,
+	.drop_inode = uxfs_drop_inode,
 	.destroy_inode = uxfs_destroy_inode,
 	.put_super = uxfs_put_super,
 	.write_super = uxfs_write_super,
 	.statfs = uxfs_statfs,
+	.sync_fs = uxfs_sync_fs,
 	.alloc_inode = uxfs_alloc_inode,
 };
 
+/*
+ * Mount options:
+ *
+ *   lazytime    keep timestamp-only inode updates in memory, see
+ *               uxfs_write_inode()
+ *   nolazytime  write them like any other change (the default)
+ *   devices=a:b the other members of a striped volume, in order,
+ *               instead of those recorded by mkfs (uxfs_stripe.c)
+ *   snapshot    mount the volume's snapshot, read-only, instead of
+ *               the volume itself (uxfs_snap.c)
+ *
+ * relatime, noatime and friends are handled by the VFS.
+ */
+
+enum {
+	Opt_lazytime, Opt_nolazytime, Opt_devices, Opt_snapshot, Opt_err
+};
+
+static const match_table_t uxfs_tokens = {
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_devices, "devices=%s"},
+	{Opt_snapshot, "snapshot"},
+	{Opt_err, NULL}
+};
+
+static int uxfs_parse_options(char *options, struct uxfs_fs *fs)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 0;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, uxfs_tokens, args)) {
+		case Opt_lazytime:
+			fs->u_lazytime = 1;
+			break;
+		case Opt_nolazytime:
+			fs->u_lazytime = 0;
+			break;
+		case Opt_devices:
+			kfree(fs->u_devopt);
+			fs->u_devopt = match_strdup(&args[0]);
+			if (!fs->u_devopt)
+				return -ENOMEM;
+			break;
+		case Opt_snapshot:
+			fs->u_snapmount = 1;
+			break;
+		default:
+			printk(KERN_ERR "uxfs: Unrecognized mount option "
+			       "\"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 int uxfs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct uxfs_superblock *usb;
 	struct uxfs_fs *fs;
 	struct buffer_head *bh;
 	struct inode *inode;
+	int error;
 
 	sb_set_blocksize(sb,
-			 (sizeof(struct uxfs_superblock) / 512 +
-			  1) * UXFS_BSIZE);
+			 DIV_ROUND_UP(sizeof(struct uxfs_superblock), 512) *
+			 UXFS_BSIZE);
 	bh = sb_bread(sb, 0);
 	if (!bh)
 		return -ENOMEM;
@@ -269,16 +606,23 @@ int uxfs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_blocksize_bits = UXFS_BSIZE_BITS;
 
 	usb = (struct uxfs_superblock *)bh->b_data;
+	error = -EINVAL;
 	if (usb->s_magic != UXFS_MAGIC) {
 		if (!silent)
 			printk(KERN_ERR
 			       "Unable to find uxfs filesystem\n");
-		return -EINVAL;
+		goto out_bh;
 	}
 	if (usb->s_mod == UXFS_FSDIRTY) {
 		printk(KERN_ERR "Filesystem is not clean. Write and "
 		       "run fsck!\n");
-		return -ENOMEM;
+		error = -ENOMEM;
+		goto out_bh;
+	}
+	if (uxfs_nblocks(usb) > UXFS_MAXBLOCKS) {
+		printk(KERN_ERR "uxfs: Bad size %u in superblock of %s\n",
+		       usb->s_nblocks, sb->s_id);
+		goto out_bh;
 	}
 
 	/*
@@ -286,28 +630,95 @@ int uxfs_fill_super(struct super_block *sb, void *data, int silent)
 	 *  be dirty and write it back to disk.
 	 */
 
+	error = -ENOMEM;
 	fs = kzalloc(sizeof(struct uxfs_fs), GFP_KERNEL);
+	if (!fs)
+		goto out_bh;
 	fs->u_sb = usb;
 	fs->u_sbh = bh;
+	fs->u_vfs_sb = sb;
 	sb->s_fs_info = fs;
+	error = uxfs_parse_options(data, fs);
+	if (!error && fs->u_snapmount && !(sb->s_flags & MS_RDONLY))
+		error = -EROFS;
+	if (error)
+		goto out_fs;
+	error = uxfs_devs_open(sb);
+	if (error)
+		goto out_fs;
+
+	/*
+	 * The free space is indexed a region of the block map at a
+	 * time as allocations need it, so mount reads none of it.
+	 */
+
+	mutex_init(&fs->u_alloc_lock);
+	fs->u_fext_start = RB_ROOT;
+	fs->u_fext_len = RB_ROOT;
+	INIT_LIST_HEAD(&fs->u_rsv_list);
+	uxfs_map_init(sb);
+	uxfs_fext_reset(sb);
+	uxfs_free_init(sb);
+
+	error = uxfs_snap_load(sb);
+	if (!error && fs->u_snapmount &&
+	    fs->u_snap->t_state != UXFS_SNAP_ACTIVE) {
+		printk(KERN_ERR "uxfs: No snapshot on %s\n", sb->s_id);
+		error = -ENOENT;
+	}
+	if (error)
+		goto out_devs;
 
 	sb->s_magic = UXFS_MAGIC;
 	sb->s_op = &uxfs_sops;
 
-	inode = uxfs_iget(sb, UXFS_ROOT_INO);
-	if (!inode)
-		return -ENOMEM;
+	if (uxfs_sysfs_register(sb)) {
+		printk(KERN_ERR "uxfs: Unable to register %s in sysfs\n",
+		       sb->s_id);
+		error = -ENOMEM;
+		goto out_sysfs;
+	}
+
+	inode = uxfs_iget(sb, fs->u_snapmount ? UXFS_SNAP_INO + UXFS_ROOT_INO :
+			  UXFS_ROOT_INO);
+	if (IS_ERR(inode)) {
+		error = PTR_ERR(inode);
+		goto out_sysfs;
+	}
 	sb->s_root = d_alloc_root(inode);	//changed from d_make_root(inode) for kernel version 3.2. change back to d_alloc_root for kernal versions > 3.4
 	if (!sb->s_root) {
 		iput(inode);	//redundant line of code if d_make_root is used
-		return -EINVAL;
+		error = -EINVAL;
+		goto out_sysfs;
 	}
 
 	if (!(sb->s_flags & MS_RDONLY)) {
 		mark_buffer_dirty(bh);
-		sb->s_dirt = 1;
+		uxfs_dirty_super(sb);
+		uxfs_snap_resume(sb);
+		uxfs_free_resume(sb);
 	}
 	return 0;
+
+	/*
+	 * Without a root, uxfs_put_super() is never called, so undo
+	 * everything here, in reverse order.
+	 */
+
+      out_sysfs:
+	uxfs_sysfs_unregister(sb);
+      out_devs:
+	brelse(fs->u_snapbh);
+	uxfs_fext_destroy(sb);
+	uxfs_map_release(sb);
+	uxfs_devs_close(sb);
+      out_fs:
+	sb->s_fs_info = NULL;
+	kfree(fs->u_devopt);
+	kfree(fs);
+      out_bh:
+	brelse(bh);
+	return error;
 }
 
 static struct dentry *uxfs_mount(struct file_system_type *fs_type,
@@ -317,11 +728,25 @@ static struct dentry *uxfs_mount(struct file_system_type *fs_type,
 	return mount_bdev(fs_type, flags, dev_name, data, uxfs_fill_super);
 }
 
+/*
+ * Stat-ahead work holds inode references, let it finish before the
+ * inodes are evicted. Snapshot deletion is stopped before the final
+ * sync so that what it did is written.
+ */
+
+static void uxfs_kill_sb(struct super_block *sb)
+{
+	uxfs_sa_flush();
+	if (sb->s_fs_info)
+		uxfs_snap_stop(sb);
+	kill_block_super(sb);
+}
+
 static struct file_system_type uxfs_fs_type = {
 	.owner = THIS_MODULE,
 	.name = "uxfs",
 	.mount = uxfs_mount,
-	.kill_sb = kill_block_super,
+	.kill_sb = uxfs_kill_sb,
 	.fs_flags = FS_REQUIRES_DEV,
 };
 
@@ -329,23 +754,77 @@ static void init_once(void *foo)
 {
 	struct uxfs_inode_info *ei = (struct uxfs_inode_info *)foo;
 
+	init_rwsem(&ei->i_dir_sem);
 	inode_init_once(&ei->vfs_inode);
 }
 
 static int __init init_uxfs_fs(void)
 {
+	int error;
+
+	error = uxfs_stats_init();
+	if (error)
+		return error;
+	error = uxfs_sa_init();
+	if (error) {
+		uxfs_stats_exit();
+		return error;
+	}
+	error = uxfs_fext_init();
+	if (error) {
+		uxfs_sa_exit();
+		uxfs_stats_exit();
+		return error;
+	}
+	error = -ENOMEM;
 	uxfs_inode_cachep = kmem_cache_create("uxfs_inode_cache",
 					      sizeof(struct
 						     uxfs_inode_info), 0,
 					      (SLAB_RECLAIM_ACCOUNT |
 					       SLAB_MEM_SPREAD),
 					      init_once);
-	return register_filesystem(&uxfs_fs_type);
+	if (!uxfs_inode_cachep)
+		goto fail;
+	uxfs_imap_cachep = kmem_cache_create("uxfs_imap_cache",
+					     UXFS_IMAP_SIZE, 0,
+					     SLAB_RECLAIM_ACCOUNT, NULL);
+	if (!uxfs_imap_cachep)
+		goto fail;
+	uxfs_ncache_init();
+	uxfs_compr_init();
+	error = register_filesystem(&uxfs_fs_type);
+	if (!error)
+		return 0;
+	uxfs_compr_exit();
+	uxfs_ncache_exit();
+      fail:
+	if (uxfs_imap_cachep)
+		kmem_cache_destroy(uxfs_imap_cachep);
+	if (uxfs_inode_cachep)
+		kmem_cache_destroy(uxfs_inode_cachep);
+	uxfs_fext_exit();
+	uxfs_sa_exit();
+	uxfs_stats_exit();
+	return error;
 }
 
 static void __exit exit_uxfs_fs(void)
 {
 	unregister_filesystem(&uxfs_fs_type);
+	uxfs_compr_exit();
+	uxfs_ncache_exit();
+
+	/*
+	 * Inodes are freed after an RCU grace period, wait for the
+	 * last of them before the cache goes.
+	 */
+
+	rcu_barrier();
+	kmem_cache_destroy(uxfs_imap_cachep);
+	kmem_cache_destroy(uxfs_inode_cachep);
+	uxfs_fext_exit();
+	uxfs_sa_exit();
+	uxfs_stats_exit();
 }
 
 module_init(init_uxfs_fs)
@@ -0,0 +1,192 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- uxfs_ioctl.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+#include "uxfs.h"
+
+/*
+ * The generic inode flag ioctls, as used by lsattr and chattr.
+ * FS_COMPR_FL ("chattr +c") maps onto UXFS_COMPR_FL, no other
+ * flags are supported.
+ *
+ * FICLONE and FICLONERANGE share blocks between files and
+ * UXFS_IOC_COPY_RANGE copies between them, see uxfs_clone.c.
+ *
+ * UXFS_IOC_GETFRAG and UXFS_IOC_DEFRAG report on and defragment a
+ * file, see uxfs_defrag.c.
+ *
+ * UXFS_IOC_SNAP_CREATE, UXFS_IOC_SNAP_DELETE and UXFS_IOC_SNAP_INFO
+ * take, delete and report on the snapshot of the volume the file is
+ * on, see uxfs_snap.c.
+ *
+ * UXFS_IOC_GROW makes the volume bigger, see uxfs_grow().
+ *
+ * UXFS_IOC_DIR_COMPACT compacts a directory, see uxfs_dir.c.
+ *
+ * UXFS_IOC_NOWAIT turns non-blocking I/O on or off for an open
+ * file, see uxfs_file.c.
+ */
+
+static unsigned int uxfs_flags_to_user(__u32 flags)
+{
+	return (flags & UXFS_COMPR_FL) ? FS_COMPR_FL : 0;
+}
+
+static long uxfs_ioctl_clone(struct file *filp, int srcfd, u64 off, u64 len,
+			     u64 destoff, int copy)
+{
+	struct file *src_file;
+	long error;
+
+	if (!(filp->f_mode & FMODE_WRITE) || (filp->f_flags & O_APPEND))
+		return -EBADF;
+	src_file = fget(srcfd);
+	if (!src_file)
+		return -EBADF;
+	error = -EBADF;
+	if (!(src_file->f_mode & FMODE_READ))
+		goto out;
+	error = -EXDEV;
+	if (src_file->f_path.mnt != filp->f_path.mnt)
+		goto out;
+	error = mnt_want_write_file(filp);
+	if (error)
+		goto out;
+	if (copy)
+		error = uxfs_copy_range(filp, src_file, off, len, destoff);
+	else
+		error = uxfs_clone_range(filp, src_file, off, len, destoff);
+	mnt_drop_write_file(filp);
+      out:
+	fput(src_file);
+	return error;
+}
+
+long uxfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct file_clone_range range;
+	struct uxfs_copy_range copy;
+	struct uxfs_frag frag;
+	struct uxfs_snapinfo snap;
+	__u32 nblocks;
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct uxfs_inode_info *uxi = uxfs_i(inode);
+	unsigned int flags;
+	int error, on;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		flags = uxfs_flags_to_user(uxi->i_flags);
+		return put_user(flags, (int __user *)arg);
+
+	case FS_IOC_SETFLAGS:
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+		if (get_user(flags, (int __user *)arg))
+			return -EFAULT;
+		if (flags & ~FS_COMPR_FL)
+			return -EOPNOTSUPP;
+		error = mnt_want_write_file(filp);
+		if (error)
+			return error;
+		mutex_lock(&inode->i_mutex);
+		error = uxfs_set_compr(inode, flags & FS_COMPR_FL);
+		mutex_unlock(&inode->i_mutex);
+		mnt_drop_write_file(filp);
+		return error;
+
+	case FICLONE:
+		return uxfs_ioctl_clone(filp, arg, 0, 0, 0, 0);
+
+	case FICLONERANGE:
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		return uxfs_ioctl_clone(filp, range.src_fd, range.src_offset,
+					range.src_length, range.dest_offset, 0);
+
+	case UXFS_IOC_COPY_RANGE:
+		if (copy_from_user(&copy, (void __user *)arg, sizeof(copy)))
+			return -EFAULT;
+		return uxfs_ioctl_clone(filp, copy.src_fd, copy.src_offset,
+					copy.length, copy.dest_offset, 1);
+
+	case UXFS_IOC_GETFRAG:
+		uxfs_frag_count(inode->i_sb, uxi->i_addr, &frag);
+		if (copy_to_user((void __user *)arg, &frag, sizeof(frag)))
+			return -EFAULT;
+		return 0;
+
+	case UXFS_IOC_DEFRAG:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		error = mnt_want_write_file(filp);
+		if (error)
+			return error;
+		error = uxfs_defrag(inode, &frag);
+		mnt_drop_write_file(filp);
+		if (error)
+			return error;
+		if (copy_to_user((void __user *)arg, &frag, sizeof(frag)))
+			return -EFAULT;
+		return 0;
+
+	case UXFS_IOC_SNAP_CREATE:
+	case UXFS_IOC_SNAP_DELETE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		error = mnt_want_write_file(filp);
+		if (error)
+			return error;
+		if (cmd == UXFS_IOC_SNAP_CREATE)
+			error = uxfs_snap_create(inode->i_sb);
+		else
+			error = uxfs_snap_delete(inode->i_sb);
+		mnt_drop_write_file(filp);
+		return error;
+
+	case UXFS_IOC_SNAP_INFO:
+		uxfs_snap_info(inode->i_sb, &snap);
+		if (copy_to_user((void __user *)arg, &snap, sizeof(snap)))
+			return -EFAULT;
+		return 0;
+
+	case UXFS_IOC_GROW:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (get_user(nblocks, (__u32 __user *)arg))
+			return -EFAULT;
+		error = mnt_want_write_file(filp);
+		if (error)
+			return error;
+		error = uxfs_grow(inode->i_sb, &nblocks);
+		mnt_drop_write_file(filp);
+		if (error)
+			return error;
+		return put_user(nblocks, (__u32 __user *)arg);
+
+	case UXFS_IOC_DIR_COMPACT:
+		if (!inode_owner_or_capable(inode))
+			return -EACCES;
+		error = mnt_want_write_file(filp);
+		if (error)
+			return error;
+		error = uxfs_dir_compact(inode, filp);
+		mnt_drop_write_file(filp);
+		return error;
+
+	case UXFS_IOC_NOWAIT:
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (get_user(on, (int __user *)arg))
+			return -EFAULT;
+		uxfs_set_nowait(filp, on);
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
@@ -0,0 +1,353 @@
+/*--------------------------------------------------------------*/
+/*-------------------------- uxfs_ncache.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/dcache.h>
+#include <linux/buffer_head.h>
+#include "uxfs.h"
+
+/*
+ * An in-core copy of a directory: every name it holds, which inode
+ * that name refers to and the slot it lives in on disk, plus a map
+ * of the used slots. It is built from disk the first time a
+ * directory is searched and afterwards kept in step by
+ * uxfs_diradd() and uxfs_dirdel(), so that lookups - including
+ * those for names that do not exist - and the search for a free
+ * slot never have to read the directory blocks again.
+ *
+ * A cache is searched with the directory's i_dir_sem held shared
+ * and changed with it held exclusively. uxfs_ncache_lock only
+ * protects the LRU list of directories with a cache and the
+ * i_ncache pointers, so that the shrinker can take caches away
+ * under memory pressure.
+ */
+
+#define UXFS_NCACHE_SIZE	(1 << UXFS_NCACHE_BITS)
+#define UXFS_DIR_SLOTS		(UXFS_DIRECT_BLOCKS * UXFS_DIRS_PER_BLOCK)
+
+struct uxfs_nentry {
+	struct hlist_node n_hash;
+	__u32 n_ino;
+	int n_slot;
+	int n_len;
+	char n_name[UXFS_NAMELEN];
+};
+
+struct uxfs_ncache {
+	struct hlist_head nc_hash[UXFS_NCACHE_SIZE];
+	DECLARE_BITMAP(nc_used, UXFS_DIR_SLOTS);
+	struct list_head nc_lru;
+	struct inode *nc_dir;
+	int nc_count;
+};
+
+static LIST_HEAD(uxfs_ncache_lru);
+static DEFINE_SPINLOCK(uxfs_ncache_lock);
+static atomic_t uxfs_ncache_entries = ATOMIC_INIT(0);
+
+static struct hlist_head *nc_bucket(struct uxfs_ncache *nc,
+				    const char *name, int len)
+{
+	return &nc->nc_hash[full_name_hash(name, len) &
+			    (UXFS_NCACHE_SIZE - 1)];
+}
+
+static struct uxfs_nentry *nc_find(struct uxfs_ncache *nc,
+				   const char *name, int len)
+{
+	struct uxfs_nentry *ne;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(ne, pos, nc_bucket(nc, name, len), n_hash) {
+		if (ne->n_len == len && !memcmp(ne->n_name, name, len))
+			return ne;
+	}
+	return NULL;
+}
+
+static int nc_insert(struct uxfs_ncache *nc, const char *name, __u32 ino,
+		     int slot)
+{
+	struct uxfs_nentry *ne;
+	int len = strnlen(name, UXFS_NAMELEN);
+
+	ne = kmalloc(sizeof(*ne), GFP_NOFS);
+	if (!ne)
+		return -ENOMEM;
+	ne->n_ino = ino;
+	ne->n_slot = slot;
+	ne->n_len = len;
+	memcpy(ne->n_name, name, len);
+	hlist_add_head(&ne->n_hash, nc_bucket(nc, name, len));
+	__set_bit(slot, nc->nc_used);
+	nc->nc_count++;
+	atomic_inc(&uxfs_ncache_entries);
+	return 0;
+}
+
+static void nc_free(struct uxfs_ncache *nc)
+{
+	struct uxfs_nentry *ne;
+	struct hlist_node *pos, *tmp;
+	int i;
+
+	for (i = 0; i < UXFS_NCACHE_SIZE; i++) {
+		hlist_for_each_entry_safe(ne, pos, tmp, &nc->nc_hash[i],
+					  n_hash) {
+			hlist_del(&ne->n_hash);
+			kfree(ne);
+		}
+	}
+	atomic_sub(nc->nc_count, &uxfs_ncache_entries);
+	kfree(nc);
+}
+
+/*
+ * Read every block of the directory and build its cache. Readers
+ * may race to do this; the first cache installed is kept.
+ */
+
+static struct uxfs_ncache *nc_build(struct inode *dip)
+{
+	struct super_block *sb = dip->i_sb;
+	struct uxfs_ncache *nc, *built;
+	struct uxfs_dirent *dirent;
+	struct page *page = NULL;
+	int blk, i;
+
+	nc = kzalloc(sizeof(*nc), GFP_NOFS);
+	if (!nc)
+		return NULL;
+	nc->nc_dir = dip;
+	uxfs_dir_readahead(dip, NULL, 0);
+	for (blk = 0; blk < dip->i_blocks; blk++) {
+		dirent = uxfs_dir_block(dip, blk, &page);
+		if (!dirent)
+			goto fail;
+		uxfs_stat_inc(sb, UXFS_STAT_FIND_BLOCKS);
+		for (i = 0; i < UXFS_DIRS_PER_BLOCK; i++, dirent++) {
+			if (dirent->d_ino == 0)
+				continue;
+			if (nc_insert(nc, dirent->d_name, dirent->d_ino,
+				      blk * UXFS_DIRS_PER_BLOCK + i))
+				goto fail;
+		}
+	}
+	uxfs_dir_put_page(page);
+	uxfs_stat_inc(sb, UXFS_STAT_NCACHE_BUILD);
+
+	spin_lock(&uxfs_ncache_lock);
+	if (uxfs_i(dip)->i_ncache) {
+		built = nc;
+		nc = uxfs_i(dip)->i_ncache;
+		spin_unlock(&uxfs_ncache_lock);
+		nc_free(built);
+		return nc;
+	}
+	uxfs_i(dip)->i_ncache = nc;
+	list_add(&nc->nc_lru, &uxfs_ncache_lru);
+	spin_unlock(&uxfs_ncache_lock);
+	return nc;
+
+      fail:
+	uxfs_dir_put_page(page);
+	nc_free(nc);
+	return NULL;
+}
+
+/*
+ * Return the cache of a directory, building it if need be, and
+ * mark it recently used. NULL means we could not build one and the
+ * caller has to go to disk.
+ */
+
+static struct uxfs_ncache *nc_get(struct inode *dip, int build)
+{
+	struct uxfs_ncache *nc;
+
+	spin_lock(&uxfs_ncache_lock);
+	nc = uxfs_i(dip)->i_ncache;
+	if (nc)
+		list_move(&nc->nc_lru, &uxfs_ncache_lru);
+	spin_unlock(&uxfs_ncache_lock);
+	if (!nc && build)
+		nc = nc_build(dip);
+	return nc;
+}
+
+/*
+ * Look up "name" in the cache of directory "dip". Returns its inode
+ * number, 0 if the directory holds no such name, or -1 if there is
+ * no cache and the directory has to be searched on disk.
+ */
+
+int uxfs_ncache_find(struct inode *dip, const char *name)
+{
+	struct uxfs_ncache *nc = nc_get(dip, 1);
+	struct uxfs_nentry *ne;
+
+	if (!nc)
+		return -1;
+	ne = nc_find(nc, name, strnlen(name, UXFS_NAMELEN));
+	uxfs_stat_inc(dip->i_sb, ne ? UXFS_STAT_NCACHE_HIT :
+		      UXFS_STAT_NCACHE_NEG);
+	return ne ? ne->n_ino : 0;
+}
+
+/*
+ * Return the on-disk slot holding "name", or -1 if it is not
+ * cached.
+ */
+
+int uxfs_ncache_slot(struct inode *dip, const char *name)
+{
+	struct uxfs_ncache *nc = nc_get(dip, 0);
+	struct uxfs_nentry *ne;
+
+	if (!nc)
+		return -1;
+	ne = nc_find(nc, name, strnlen(name, UXFS_NAMELEN));
+	return ne ? ne->n_slot : -1;
+}
+
+/*
+ * Return the first free directory slot. If every slot in the
+ * directory's blocks is in use this is the first slot of the next
+ * block. -1 means there is no cache to ask.
+ */
+
+int uxfs_ncache_free_slot(struct inode *dip)
+{
+	struct uxfs_ncache *nc = nc_get(dip, 1);
+
+	if (!nc)
+		return -1;
+	return find_first_zero_bit(nc->nc_used,
+				   dip->i_blocks * UXFS_DIRS_PER_BLOCK);
+}
+
+/*
+ * A name was written to "slot" on disk. If we cannot keep track of
+ * it the whole cache has to go, it would no longer be complete.
+ */
+
+void uxfs_ncache_add(struct inode *dip, const char *name, __u32 ino,
+		     int slot)
+{
+	struct uxfs_ncache *nc = nc_get(dip, 0);
+
+	if (nc && nc_insert(nc, name, ino, slot))
+		uxfs_ncache_drop(dip);
+}
+
+void uxfs_ncache_del(struct inode *dip, const char *name)
+{
+	struct uxfs_ncache *nc = nc_get(dip, 0);
+	struct uxfs_nentry *ne;
+
+	if (!nc)
+		return;
+	ne = nc_find(nc, name, strnlen(name, UXFS_NAMELEN));
+	if (!ne)
+		return;
+	__clear_bit(ne->n_slot, nc->nc_used);
+	hlist_del(&ne->n_hash);
+	kfree(ne);
+	nc->nc_count--;
+	atomic_dec(&uxfs_ncache_entries);
+}
+
+/*
+ * How many names the directory holds, or -1 if it has no cache.
+ */
+
+int uxfs_ncache_count(struct inode *dip)
+{
+	struct uxfs_ncache *nc = nc_get(dip, 0);
+
+	return nc ? nc->nc_count : -1;
+}
+
+/*
+ * Throw away the cache of a directory, if it has one.
+ */
+
+void uxfs_ncache_drop(struct inode *dip)
+{
+	struct uxfs_ncache *nc;
+
+	spin_lock(&uxfs_ncache_lock);
+	nc = uxfs_i(dip)->i_ncache;
+	if (nc) {
+		list_del(&nc->nc_lru);
+		uxfs_i(dip)->i_ncache = NULL;
+	}
+	spin_unlock(&uxfs_ncache_lock);
+	if (nc)
+		nc_free(nc);
+}
+
+/*
+ * Free caches, least recently used first. A directory that is
+ * being searched or changed (its i_dir_sem is held) is skipped.
+ */
+
+static int uxfs_ncache_shrink(struct shrinker *shrink,
+			      struct shrink_control *sc)
+{
+	int nr = sc->nr_to_scan, tries = 0;
+	struct uxfs_ncache *nc;
+	struct inode *dip;
+
+	if (nr && !(sc->gfp_mask & __GFP_FS))
+		return -1;
+
+	spin_lock(&uxfs_ncache_lock);
+	while (nr > 0 && !list_empty(&uxfs_ncache_lru) &&
+	       tries++ < UXFS_MAXFILES) {
+		nc = list_entry(uxfs_ncache_lru.prev, struct uxfs_ncache,
+				nc_lru);
+		dip = igrab(nc->nc_dir);
+		if (!dip || !down_write_trylock(&uxfs_i(dip)->i_dir_sem)) {
+			list_move(&nc->nc_lru, &uxfs_ncache_lru);
+			spin_unlock(&uxfs_ncache_lock);
+			if (dip)
+				iput(dip);
+			spin_lock(&uxfs_ncache_lock);
+			continue;
+		}
+		list_del(&nc->nc_lru);
+		uxfs_i(dip)->i_ncache = NULL;
+		spin_unlock(&uxfs_ncache_lock);
+
+		nr -= nc->nc_count;
+		uxfs_stat_inc(dip->i_sb, UXFS_STAT_NCACHE_RECLAIM);
+		nc_free(nc);
+		up_write(&uxfs_i(dip)->i_dir_sem);
+		iput(dip);
+		spin_lock(&uxfs_ncache_lock);
+	}
+	spin_unlock(&uxfs_ncache_lock);
+
+	return (atomic_read(&uxfs_ncache_entries) / 100) *
+	    sysctl_vfs_cache_pressure;
+}
+
+static struct shrinker uxfs_ncache_shrinker = {
+	.shrink = uxfs_ncache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+void uxfs_ncache_init(void)
+{
+	register_shrinker(&uxfs_ncache_shrinker);
+}
+
+void uxfs_ncache_exit(void)
+{
+	unregister_shrinker(&uxfs_ncache_shrinker);
+}
@@ -0,0 +1,125 @@
+/*--------------------------------------------------------------*/
+/*---------------------------- uxfs_rsv.c ------------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include "uxfs.h"
+
+/*
+ * Reservation windows. Files being written at the same time would
+ * otherwise take turns at the free space and end up interleaved
+ * block by block. Instead, a file that allocates gets a window: a
+ * run of free blocks taken out of the free extent index for it
+ * alone, from which its following appends are served. A window
+ * that gets used up is replaced by one twice its size, up to what
+ * the file can still hold.
+ *
+ * Blocks in a window stay free in the block map and in s_nbfree,
+ * nothing about windows is on disk. A window goes back into the
+ * index when the last writer of its file closes it or the file
+ * leaves the cache, and all of them do when an allocation finds no
+ * other free space.
+ *
+ * Windows are only looked at with u_alloc_lock held.
+ */
+
+#define UXFS_RSV_MIN	2
+
+/*
+ * Allocate block "iblock" of a regular file, from its window if
+ * the block is the next one the window would hand out.
+ */
+
+__u32 uxfs_rsv_alloc(struct inode *inode, sector_t iblock)
+{
+	struct super_block *sb = inode->i_sb;
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_inode_info *ui = uxfs_i(inode);
+	__u32 goal = uxfs_block_goal(inode, iblock), blk;
+	unsigned n, max = UXFS_DIRECT_BLOCKS - iblock;
+
+	mutex_lock(&fs->u_alloc_lock);
+	if (ui->i_rsv_len && ui->i_rsv_start != goal)
+		goto nowindow;
+	if (!ui->i_rsv_len) {
+		n = ui->i_rsv_size ? ui->i_rsv_size * 2 : UXFS_RSV_MIN;
+		n = min(n, max);
+		ui->i_rsv_size = n;
+		blk = uxfs_fext_alloc(sb, goal, &n, 1);
+		if (!blk)
+			goto nowindow;
+		ui->i_rsv_start = blk;
+		ui->i_rsv_len = n;
+		list_add(&ui->i_rsv_list, &fs->u_rsv_list);
+		uxfs_stat_inc(sb, UXFS_STAT_RSV_WINDOWS);
+	}
+	blk = ui->i_rsv_start++;
+	if (--ui->i_rsv_len == 0)
+		list_del_init(&ui->i_rsv_list);
+	uxfs_blocks_taken(sb, blk, 1);
+	mutex_unlock(&fs->u_alloc_lock);
+
+	uxfs_stat_inc(sb, UXFS_STAT_BALLOC);
+	uxfs_stat_inc(sb, UXFS_STAT_RSV_BLOCKS);
+	if (blk == goal)
+		uxfs_stat_inc(sb, UXFS_STAT_BALLOC_GOAL);
+	return blk;
+
+	/*
+	 * Not an append, or no room for a window: allocate the usual
+	 * way, which also takes care of reclaiming windows when space
+	 * runs short.
+	 */
+
+      nowindow:
+	mutex_unlock(&fs->u_alloc_lock);
+	n = 1;
+	return uxfs_alloc_blocks(sb, goal, &n, 1);
+}
+
+static void rsv_drop(struct super_block *sb, struct uxfs_inode_info *ui,
+		     int give_back)
+{
+	if (give_back)
+		uxfs_fext_free(sb, ui->i_rsv_start, ui->i_rsv_len);
+	ui->i_rsv_len = 0;
+	list_del_init(&ui->i_rsv_list);
+}
+
+/*
+ * Give back the window of an inode.
+ */
+
+void uxfs_rsv_discard(struct inode *inode)
+{
+	struct uxfs_fs *fs = uxfs_sb(inode->i_sb);
+	struct uxfs_inode_info *ui = uxfs_i(inode);
+
+	mutex_lock(&fs->u_alloc_lock);
+	if (ui->i_rsv_len)
+		rsv_drop(inode->i_sb, ui, 1);
+	mutex_unlock(&fs->u_alloc_lock);
+}
+
+/*
+ * Drop every window on the filesystem, returning the blocks to the
+ * index if "give_back" is set; the index is about to be rebuilt
+ * from the block map otherwise. Called with u_alloc_lock held.
+ * Returns the number of windows dropped.
+ */
+
+int uxfs_rsv_drop_all(struct super_block *sb, int give_back)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_inode_info *ui, *tmp;
+	int n = 0;
+
+	list_for_each_entry_safe(ui, tmp, &fs->u_rsv_list, i_rsv_list) {
+		rsv_drop(sb, ui, give_back);
+		n++;
+	}
+	if (n && give_back)
+		uxfs_stat_add(sb, UXFS_STAT_RSV_RECLAIM, n);
+	return n;
+}
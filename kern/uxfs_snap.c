@@ -0,0 +1,445 @@
+/*--------------------------------------------------------------*/
+/*---------------------------- uxfs_snap.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/dcache.h>
+#include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include "uxfs.h"
+
+/*
+ * Read-only snapshots of the whole volume. Nothing is copied when
+ * one is taken: the filesystem is synced and frozen for a moment,
+ * the inode map is remembered in the snapshot table and from then
+ * on the snapshot owns every data block and inode as they were.
+ *
+ * Data blocks. A block the snapshot owns is one that is in use and
+ * was not allocated since (t_born). uxfs_block_shared() counts
+ * such blocks as shared, so that write(2), shared mappings,
+ * compressed clusters and directory updates all replace them
+ * instead of writing in place, exactly as for blocks shared by
+ * clones (uxfs_clone.c). When the live filesystem lets go of one
+ * it stays allocated, marked in t_held, until the snapshot goes.
+ *
+ * Inodes. Before an inode is first written after the snapshot was
+ * taken, its old contents are copied to the save area (t_saved).
+ * The snapshot's copy of an inode is thus in the save area if the
+ * bit is set and in the inode table if not. Snapshot inodes are
+ * copied to the save area before they are read, so that they can't
+ * change under a reader, except on a read-only mount, which must
+ * not write and where nothing changes them anyway.
+ *
+ * The snapshot is browsed under UXFS_SNAP_NAME in the root
+ * directory, or mounted by itself with "-o ro,snapshot". Its inodes
+ * are in the same inode cache as the others, numbered from
+ * UXFS_SNAP_INO on, and are read-only. Neither they nor their
+ * dentries are cached once unused, so that a snapshot that nobody
+ * is looking at can be deleted.
+ *
+ * Deleting a snapshot marks it UXFS_SNAP_DELETING and drops its
+ * reference to the blocks in t_held from a work item. Files in the
+ * snapshot can be copied but not cloned, so no file gets to share a
+ * held block and have it freed under it. A deletion interrupted
+ * by an unmount is finished at the next mount.
+ *
+ * The state only changes with both u_snap_lock and u_alloc_lock
+ * held, so either is enough to look at it. The block maps are
+ * covered by u_alloc_lock, t_saved and the save area by
+ * u_snap_lock.
+ */
+
+static int snap_test(const __u8 *map, __u32 i)
+{
+	return map[i >> 3] & (1 << (i & 7));
+}
+
+static void snap_set(__u8 *map, __u32 i)
+{
+	map[i >> 3] |= 1 << (i & 7);
+}
+
+static void snap_clear(__u8 *map, __u32 i)
+{
+	map[i >> 3] &= ~(1 << (i & 7));
+}
+
+/*
+ * Is "blk", which is allocated, the snapshot's, so that it must not
+ * be written in place?
+ */
+
+int uxfs_snap_owns(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	__u32 i = blk - UXFS_FIRST_DATA_BLOCK;
+
+	return fs->u_snap->t_state == UXFS_SNAP_ACTIVE &&
+	    !snap_test(fs->u_snap->t_born, i);
+}
+
+/*
+ * "count" blocks from "blk" were allocated. Called with u_alloc_lock
+ * held.
+ */
+
+void uxfs_snap_taken(struct super_block *sb, __u32 blk, unsigned count)
+{
+	struct uxfs_snaptab *t = uxfs_sb(sb)->u_snap;
+
+	if (t->t_state != UXFS_SNAP_ACTIVE)
+		return;
+	while (count--)
+		snap_set(t->t_born, blk++ - UXFS_FIRST_DATA_BLOCK);
+}
+
+/*
+ * The last reference to "blk" is gone. Returns 1 if the snapshot
+ * keeps it, in which case it stays allocated. Called with
+ * u_alloc_lock held.
+ */
+
+int uxfs_snap_hold(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_snaptab *t = uxfs_sb(sb)->u_snap;
+	__u32 i = blk - UXFS_FIRST_DATA_BLOCK;
+
+	if (t->t_state != UXFS_SNAP_ACTIVE)
+		return 0;
+	if (snap_test(t->t_born, i)) {
+		snap_clear(t->t_born, i);
+		return 0;
+	}
+	snap_set(t->t_held, i);
+	return 1;
+}
+
+/*
+ * Copy inode "ino" to the save area unless it is there already or
+ * the snapshot has no use for it. Called with u_snap_lock held.
+ */
+
+static int snap_save(struct super_block *sb, unsigned long ino)
+{
+	struct uxfs_snaptab *t = uxfs_sb(sb)->u_snap;
+	struct buffer_head *bh, *sbh;
+
+	if (t->t_state != UXFS_SNAP_ACTIVE || (t->t_saved & (1 << ino)) ||
+	    t->t_inode[ino] == UXFS_INODE_FREE)
+		return 0;
+	bh = sb_bread(sb, UXFS_INODE_BLOCK + ino);
+	if (!bh)
+		return -EIO;
+	sbh = sb_bread(sb, UXFS_SNAP_IBLOCK + ino / UXFS_SNAP_IPB);
+	if (!sbh) {
+		brelse(bh);
+		return -EIO;
+	}
+	lock_buffer(sbh);
+	memcpy(sbh->b_data + ino % UXFS_SNAP_IPB * sizeof(struct uxfs_inode),
+	       bh->b_data, sizeof(struct uxfs_inode));
+	unlock_buffer(sbh);
+	mark_buffer_dirty(sbh);
+	brelse(sbh);
+	brelse(bh);
+	t->t_saved |= 1 << ino;
+	uxfs_dirty_super(sb);
+	uxfs_stat_inc(sb, UXFS_STAT_SNAP_SAVED);
+	return 0;
+}
+
+/*
+ * Called by uxfs_write_inode() before inode "ino" is changed on
+ * disk.
+ */
+
+int uxfs_snap_save_inode(struct super_block *sb, unsigned long ino)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	int error;
+
+	if (fs->u_snap->t_state != UXFS_SNAP_ACTIVE)
+		return 0;
+	mutex_lock(&fs->u_snap_lock);
+	error = snap_save(sb, ino);
+	mutex_unlock(&fs->u_snap_lock);
+	return error;
+}
+
+/*
+ * Bring snapshot inode "inode" in. Every call is matched by one of
+ * uxfs_snap_iput(), from uxfs_destroy_inode(), whether it fails or
+ * not. A read-only mount writes nothing, and nothing can change the
+ * live inode under the reader, so the copy is left where it is.
+ */
+
+int uxfs_snap_iget(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	unsigned long ino = inode->i_ino - UXFS_SNAP_INO;
+	int error = -ENOENT;
+
+	mutex_lock(&fs->u_snap_lock);
+	atomic_inc(&fs->u_snap_inodes);
+	if (fs->u_snap->t_state == UXFS_SNAP_ACTIVE &&
+	    fs->u_snap->t_inode[ino] != UXFS_INODE_FREE)
+		error = (sb->s_flags & MS_RDONLY) ? 0 : snap_save(sb, ino);
+	mutex_unlock(&fs->u_snap_lock);
+	return error;
+}
+
+void uxfs_snap_iput(struct inode *inode)
+{
+	atomic_dec(&uxfs_sb(inode->i_sb)->u_snap_inodes);
+}
+
+/*
+ * Read the snapshot's copy of inode "ino": the saved one, or on a
+ * read-only mount the inode table's if it was never saved. Only
+ * for inodes that uxfs_snap_iget() let in.
+ */
+
+struct buffer_head *uxfs_snap_bread(struct super_block *sb,
+				    unsigned long ino, struct uxfs_inode **di)
+{
+	struct buffer_head *bh;
+
+	if (!(uxfs_sb(sb)->u_snap->t_saved & (1 << ino))) {
+		bh = sb_bread(sb, UXFS_INODE_BLOCK + ino);
+		if (bh)
+			*di = (struct uxfs_inode *)bh->b_data;
+		return bh;
+	}
+	bh = sb_bread(sb, UXFS_SNAP_IBLOCK + ino / UXFS_SNAP_IPB);
+	if (bh)
+		*di = (struct uxfs_inode *)(bh->b_data + ino % UXFS_SNAP_IPB *
+					    sizeof(struct uxfs_inode));
+	return bh;
+}
+
+/*
+ * Snapshot inodes can be looked at but not changed.
+ */
+
+void uxfs_snap_init_inode(struct inode *inode)
+{
+	if (S_ISDIR(inode->i_mode)) {
+		inode->i_op = &uxfs_snap_dir_inops;
+		inode->i_fop = &uxfs_snap_dir_operations;
+	} else if (S_ISREG(inode->i_mode))
+		inode->i_fop = &uxfs_snap_file_operations;
+	inode->i_flags |= S_IMMUTABLE | S_NOATIME | S_NOCMTIME;
+}
+
+static int uxfs_snap_d_delete(const struct dentry *dentry)
+{
+	return 1;
+}
+
+const struct dentry_operations uxfs_snap_dops = {
+	.d_delete = uxfs_snap_d_delete,
+};
+
+/*
+ * Look up UXFS_SNAP_NAME in the root directory. The dentry is never
+ * cached, so a snapshot taken later is found too.
+ */
+
+struct dentry *uxfs_snap_lookup(struct inode *dip, struct dentry *dentry)
+{
+	struct inode *inode = NULL;
+
+	d_set_d_op(dentry, &uxfs_snap_dops);
+	if (uxfs_sb(dip->i_sb)->u_snap->t_state == UXFS_SNAP_ACTIVE) {
+		inode = uxfs_iget(dip->i_sb, UXFS_SNAP_INO + UXFS_ROOT_INO);
+		if (IS_ERR(inode)) {
+			if (PTR_ERR(inode) != -ENOENT)
+				return ERR_CAST(inode);
+			inode = NULL;
+		}
+	}
+	d_add(dentry, inode);
+	return NULL;
+}
+
+/*
+ * Take a snapshot. Freezing the filesystem writes out everything
+ * that is dirty and holds off writers while the state changes.
+ */
+
+int uxfs_snap_create(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_snaptab *t = fs->u_snap;
+	int error;
+
+	error = freeze_super(sb);
+	if (error)
+		return error;
+	mutex_lock(&fs->u_snap_lock);
+	if (t->t_state == UXFS_SNAP_NONE) {
+		mutex_lock(&fs->u_alloc_lock);
+		memcpy(t->t_inode, fs->u_sb->s_inode, UXFS_MAXFILES);
+		memset(t->t_born, 0, UXFS_SNAP_MAPSIZE);
+		memset(t->t_held, 0, UXFS_SNAP_MAPSIZE);
+		t->t_saved = 0;
+		t->t_time = get_seconds();
+		t->t_state = UXFS_SNAP_ACTIVE;
+		mutex_unlock(&fs->u_alloc_lock);
+	} else
+		error = t->t_state == UXFS_SNAP_ACTIVE ? -EEXIST : -EBUSY;
+	mutex_unlock(&fs->u_snap_lock);
+	thaw_super(sb);
+	if (!error)
+		uxfs_dirty_super(sb);
+	return error;
+}
+
+/*
+ * Drop the deleted snapshot's reference to each block it held.
+ * Those that a clone took from a snapshot file are still in use
+ * afterwards; the rest go back to the free pool as in
+ * uxfs_block_put().
+ */
+
+static void uxfs_snap_worker(struct work_struct *work)
+{
+	struct uxfs_fs *fs = container_of(work, struct uxfs_fs, u_snap_work);
+	struct super_block *sb = fs->u_vfs_sb;
+	struct uxfs_superblock *usb = fs->u_sb;
+	struct uxfs_snaptab *t = fs->u_snap;
+	__u32 i, nblocks, freed = 0;
+	char *ref;
+
+	mutex_lock(&fs->u_snap_lock);
+	mutex_lock(&fs->u_alloc_lock);
+	nblocks = uxfs_nblocks(usb);
+	for (i = 0; i < nblocks; i++) {
+		if (!snap_test(t->t_held, i))
+			continue;
+		ref = uxfs_map_entry(sb, i);
+		if (!ref || *ref == UXFS_BLOCK_FREE)
+			continue;
+		uxfs_map_dirty(sb, i);
+		if (--(*ref) != UXFS_BLOCK_FREE)
+			continue;
+		usb->s_nbfree++;
+		fs->u_rfree[i / UXFS_REGION_BLOCKS]++;
+		uxfs_fext_free(sb, UXFS_FIRST_DATA_BLOCK + i, 1);
+		freed++;
+	}
+	memset(t->t_held, 0, UXFS_SNAP_MAPSIZE);
+	t->t_saved = 0;
+	t->t_state = UXFS_SNAP_NONE;
+	mutex_unlock(&fs->u_alloc_lock);
+	mutex_unlock(&fs->u_snap_lock);
+	uxfs_dirty_super(sb);
+	uxfs_stat_add(sb, UXFS_STAT_SNAP_FREED, freed);
+}
+
+int uxfs_snap_delete(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_snaptab *t = fs->u_snap;
+	int error = 0;
+
+	mutex_lock(&fs->u_snap_lock);
+	if (t->t_state != UXFS_SNAP_ACTIVE)
+		error = t->t_state == UXFS_SNAP_NONE ? -ENOENT : -EBUSY;
+	else if (atomic_read(&fs->u_snap_inodes))
+		error = -EBUSY;
+	else {
+		mutex_lock(&fs->u_alloc_lock);
+		t->t_state = UXFS_SNAP_DELETING;
+		mutex_unlock(&fs->u_alloc_lock);
+		schedule_work(&fs->u_snap_work);
+	}
+	mutex_unlock(&fs->u_snap_lock);
+	if (!error)
+		uxfs_dirty_super(sb);
+	return error;
+}
+
+void uxfs_snap_info(struct super_block *sb, struct uxfs_snapinfo *si)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_snaptab *t = fs->u_snap;
+	__u32 i;
+
+	memset(si, 0, sizeof(*si));
+	mutex_lock(&fs->u_snap_lock);
+	si->s_state = t->t_state;
+	if (t->t_state != UXFS_SNAP_NONE) {
+		si->s_time = t->t_time;
+		si->s_saved = hweight32(t->t_saved);
+		for (i = 0; i < UXFS_MAXBLOCKS; i++)
+			si->s_held += !!snap_test(t->t_held, i);
+	}
+	mutex_unlock(&fs->u_snap_lock);
+}
+
+/*
+ * Read the snapshot table at mount time. Volumes made before
+ * snapshots existed have a zeroed block there, or no table at all.
+ */
+
+int uxfs_snap_load(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_snaptab *t;
+	struct buffer_head *bh;
+
+	BUILD_BUG_ON(sizeof(struct uxfs_snaptab) > UXFS_BSIZE);
+	BUILD_BUG_ON(UXFS_SNAP_IBLOCK + DIV_ROUND_UP(UXFS_MAXFILES,
+						     UXFS_SNAP_IPB) >
+		     UXFS_FIRST_DATA_BLOCK);
+
+	bh = sb_bread(sb, UXFS_SNAP_BLOCK);
+	if (!bh)
+		return -EIO;
+	t = (struct uxfs_snaptab *)bh->b_data;
+	if (t->t_magic != UXFS_SNAP_MAGIC) {
+		memset(t, 0, sizeof(*t));
+		t->t_magic = UXFS_SNAP_MAGIC;
+	}
+	if (t->t_state > UXFS_SNAP_DELETING) {
+		printk(KERN_ERR "uxfs: Bad snapshot table on %s\n", sb->s_id);
+		brelse(bh);
+		return -EINVAL;
+	}
+	fs->u_snap = t;
+	fs->u_snapbh = bh;
+	mutex_init(&fs->u_snap_lock);
+	atomic_set(&fs->u_snap_inodes, 0);
+	INIT_WORK(&fs->u_snap_work, uxfs_snap_worker);
+	return 0;
+}
+
+/*
+ * Finish a deletion the last mount didn't get to.
+ */
+
+void uxfs_snap_resume(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+
+	if (fs->u_snap->t_state == UXFS_SNAP_DELETING)
+		schedule_work(&fs->u_snap_work);
+}
+
+/*
+ * At unmount, before the final sync. A deletion that hasn't
+ * started yet is left for the next mount.
+ */
+
+void uxfs_snap_stop(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+
+	if (!fs->u_snapbh)
+		return;
+	cancel_work_sync(&fs->u_snap_work);
+}
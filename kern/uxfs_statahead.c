@@ -0,0 +1,189 @@
+/*--------------------------------------------------------------*/
+/*------------------------ uxfs_statahead.c ----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/buffer_head.h>
+#include "uxfs.h"
+
+/*
+ * Stat-ahead. "ls -l" and friends read a directory and then look up
+ * and stat every name it returned, and each of those lookups reads
+ * one inode block synchronously in uxfs_iget().
+ *
+ * uxfs_readdir() remembers the inode numbers of the entries it has
+ * just handed out (the window). Once uxfs_lookup() has seen
+ * UXFS_SA_TRIGGER of them asked for, we start reads of the inode
+ * blocks of the whole window and queue a work item that brings the
+ * inodes into core, so the remaining lookups find them in the inode
+ * cache. While lookups keep following readdir, later windows of the
+ * same directory are prefetched as soon as readdir fills them.
+ *
+ * A window lives in the directory's uxfs_inode_info as long as the
+ * directory does. Readers of a directory can run at once (see
+ * uxfs_dir.c), so whoever works on the window takes sa_busy first;
+ * a readdir or lookup that finds it taken just goes without
+ * stat-ahead.
+ */
+
+#define UXFS_SA_MAX		64
+#define UXFS_SA_TRIGGER		2
+
+struct uxfs_statahead {
+	unsigned long sa_busy;	/* bit 0 locks the window */
+	int sa_active;		/* lookups followed the last window */
+	int sa_issued;		/* this window was prefetched */
+	int sa_hits;		/* lookups that hit this window */
+	int sa_n;
+	__u32 sa_ino[UXFS_SA_MAX];
+};
+
+struct uxfs_sa_work {
+	struct work_struct w_work;
+	struct super_block *w_sb;
+	int w_n;
+	__u32 w_ino[UXFS_SA_MAX];
+};
+
+static struct workqueue_struct *uxfs_sa_wq;
+
+static void uxfs_sa_worker(struct work_struct *work)
+{
+	struct uxfs_sa_work *w = container_of(work, struct uxfs_sa_work,
+					      w_work);
+	struct inode *inode;
+	int i;
+
+	for (i = 0; i < w->w_n; i++) {
+		inode = uxfs_iget(w->w_sb, w->w_ino[i]);
+		if (!IS_ERR(inode))
+			iput(inode);
+	}
+	kfree(w);
+}
+
+static void uxfs_sa_issue(struct inode *dip, struct uxfs_statahead *sa)
+{
+	struct super_block *sb = dip->i_sb;
+	struct uxfs_sa_work *w;
+	int i;
+
+	sa->sa_issued = 1;
+	if (!sa->sa_n)
+		return;
+	for (i = 0; i < sa->sa_n; i++)
+		sb_breadahead(sb, UXFS_INODE_BLOCK + sa->sa_ino[i]);
+	uxfs_stat_inc(sb, UXFS_STAT_SA_WINDOWS);
+	uxfs_stat_add(sb, UXFS_STAT_SA_INODES, sa->sa_n);
+
+	/*
+	 * The reads are on their way, instantiating the inodes is a
+	 * bonus and not worth failing anything for.
+	 */
+
+	w = kmalloc(sizeof(*w), GFP_NOFS);
+	if (!w)
+		return;
+	INIT_WORK(&w->w_work, uxfs_sa_worker);
+	w->w_sb = sb;
+	w->w_n = sa->sa_n;
+	memcpy(w->w_ino, sa->sa_ino, sa->sa_n * sizeof(__u32));
+	queue_work(uxfs_sa_wq, &w->w_work);
+}
+
+/*
+ * Called by uxfs_readdir() before it hands out entries. Decide if
+ * the last window was worth it and start a new one.
+ */
+
+struct uxfs_statahead *uxfs_sa_readdir_begin(struct inode *dip)
+{
+	struct uxfs_statahead *sa = uxfs_i(dip)->i_sa, *new;
+
+	if (!sa) {
+		new = kzalloc(sizeof(*new), GFP_KERNEL);
+		if (!new)
+			return NULL;
+		sa = cmpxchg(&uxfs_i(dip)->i_sa, NULL, new);
+		if (sa)
+			kfree(new);
+		else
+			sa = new;
+	}
+	if (test_and_set_bit_lock(0, &sa->sa_busy))
+		return NULL;
+	if (sa->sa_issued)
+		sa->sa_active = sa->sa_hits >= sa->sa_n / 2;
+	sa->sa_issued = 0;
+	sa->sa_hits = 0;
+	sa->sa_n = 0;
+	return sa;
+}
+
+void uxfs_sa_note(struct uxfs_statahead *sa, __u32 ino)
+{
+	if (sa && sa->sa_n < UXFS_SA_MAX)
+		sa->sa_ino[sa->sa_n++] = ino;
+}
+
+void uxfs_sa_readdir_end(struct inode *dip, struct uxfs_statahead *sa)
+{
+	if (!sa)
+		return;
+	if (sa->sa_active)
+		uxfs_sa_issue(dip, sa);
+	clear_bit_unlock(0, &sa->sa_busy);
+}
+
+/*
+ * uxfs_lookup() found "ino" in directory "dip".
+ */
+
+void uxfs_sa_lookup(struct inode *dip, __u32 ino)
+{
+	struct uxfs_statahead *sa = uxfs_i(dip)->i_sa;
+	int i;
+
+	if (!sa || test_and_set_bit_lock(0, &sa->sa_busy))
+		return;
+	for (i = 0; i < sa->sa_n; i++) {
+		if (sa->sa_ino[i] == ino)
+			break;
+	}
+	if (i < sa->sa_n && ++sa->sa_hits >= UXFS_SA_TRIGGER &&
+	    !sa->sa_issued)
+		uxfs_sa_issue(dip, sa);
+	clear_bit_unlock(0, &sa->sa_busy);
+}
+
+void uxfs_sa_free(struct inode *inode)
+{
+	kfree(uxfs_i(inode)->i_sa);
+	uxfs_i(inode)->i_sa = NULL;
+}
+
+/*
+ * Wait for queued work to finish, it holds inode references and
+ * must be done before the filesystem goes away.
+ */
+
+void uxfs_sa_flush(void)
+{
+	flush_workqueue(uxfs_sa_wq);
+}
+
+int __init uxfs_sa_init(void)
+{
+	uxfs_sa_wq = alloc_workqueue("uxfs_statahead", WQ_UNBOUND, 0);
+	if (!uxfs_sa_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void uxfs_sa_exit(void)
+{
+	destroy_workqueue(uxfs_sa_wq);
+}
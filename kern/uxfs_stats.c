@@ -0,0 +1,221 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- uxfs_stats.c -----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include "uxfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "uxfs_trace.h"
+
+/*
+ * Every mounted uxfs filesystem gets a directory /sys/fs/uxfs/<dev>
+ * with these files:
+ *
+ *   stats    - one "name value" pair per line
+ *   latency  - one line per operation, each a histogram with
+ *              UXFS_LAT_BUCKETS columns, see enum uxfs_lat
+ *   frag     - free space and file fragmentation, as "name value"
+ *              pairs, see uxfs_defrag.c
+ *
+ * Writing anything to stats or latency resets all counters.
+ */
+
+static const char *uxfs_stat_names[UXFS_STAT_NR] = {
+	[UXFS_STAT_LOOKUP] = "lookups",
+	[UXFS_STAT_FIND_ENTRY] = "find_entry",
+	[UXFS_STAT_FIND_BLOCKS] = "find_entry_blocks",
+	[UXFS_STAT_DIRADD] = "diradd",
+	[UXFS_STAT_DIRADD_BLOCKS] = "diradd_blocks",
+	[UXFS_STAT_IALLOC] = "ialloc",
+	[UXFS_STAT_IALLOC_SCAN] = "ialloc_scanned",
+	[UXFS_STAT_BALLOC] = "block_alloc",
+	[UXFS_STAT_BALLOC_BLOCKS] = "block_alloc_blocks",
+	[UXFS_STAT_BALLOC_GOAL] = "block_alloc_goal_hits",
+	[UXFS_STAT_INODE_READ] = "inode_reads",
+	[UXFS_STAT_INODE_WRITE] = "inode_writes",
+	[UXFS_STAT_INODE_LAZY] = "inode_writes_deferred",
+	[UXFS_STAT_IMAP_LOAD] = "block_maps_loaded",
+	[UXFS_STAT_GET_BLOCK] = "get_block",
+	[UXFS_STAT_GET_BLOCK_MAPPED] = "get_block_mapped",
+	[UXFS_STAT_GET_BLOCK_ALLOC] = "get_block_alloc",
+	[UXFS_STAT_SUPER_DIRTY] = "super_dirtied",
+	[UXFS_STAT_SUPER_WRITE] = "write_super",
+	[UXFS_STAT_NCACHE_HIT] = "ncache_hits",
+	[UXFS_STAT_NCACHE_NEG] = "ncache_negative_hits",
+	[UXFS_STAT_NCACHE_BUILD] = "ncache_builds",
+	[UXFS_STAT_NCACHE_RECLAIM] = "ncache_reclaimed",
+	[UXFS_STAT_SA_WINDOWS] = "statahead_windows",
+	[UXFS_STAT_SA_INODES] = "statahead_inodes",
+	[UXFS_STAT_CLONE_BLOCKS] = "clone_blocks",
+	[UXFS_STAT_COW_BLOCKS] = "cow_blocks",
+	[UXFS_STAT_RSV_WINDOWS] = "reservation_windows",
+	[UXFS_STAT_RSV_BLOCKS] = "reservation_blocks",
+	[UXFS_STAT_RSV_RECLAIM] = "reservations_reclaimed",
+	[UXFS_STAT_DEFRAG_FILES] = "defrag_files",
+	[UXFS_STAT_DEFRAG_BLOCKS] = "defrag_blocks",
+	[UXFS_STAT_NOWAIT_AGAIN] = "nowait_eagain",
+	[UXFS_STAT_SNAP_SAVED] = "snap_inodes_saved",
+	[UXFS_STAT_SNAP_FREED] = "snap_blocks_freed",
+	[UXFS_STAT_DIR_COMPACT] = "dir_compactions",
+	[UXFS_STAT_DIR_COMPACT_BLOCKS] = "dir_compact_blocks",
+	[UXFS_STAT_FREE_QUEUED] = "deferred_frees",
+	[UXFS_STAT_FREE_BATCHES] = "deferred_free_batches",
+	[UXFS_STAT_MAP_LOADS] = "map_regions_loaded",
+};
+
+static const char *uxfs_lat_names[UXFS_LAT_NR] = {
+	[UXFS_LAT_IGET] = "iget",
+	[UXFS_LAT_FIND_ENTRY] = "find_entry",
+	[UXFS_LAT_DIRADD] = "diradd",
+	[UXFS_LAT_GET_BLOCK] = "get_block",
+	[UXFS_LAT_WRITE_INODE] = "write_inode",
+};
+
+static struct kset *uxfs_kset;
+
+struct uxfs_attr {
+	struct attribute attr;
+	 ssize_t(*show) (struct uxfs_fs *, char *);
+};
+
+static ssize_t stats_show(struct uxfs_fs *fs, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < UXFS_STAT_NR; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %ld\n",
+				 uxfs_stat_names[i],
+				 atomic_long_read(&fs->u_stats[i]));
+	return len;
+}
+
+static ssize_t latency_show(struct uxfs_fs *fs, char *buf)
+{
+	ssize_t len = 0;
+	int i, b;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "usecs");
+	for (b = 0; b < UXFS_LAT_BUCKETS - 1; b++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, " <%lu",
+				 1UL << b);
+	len += scnprintf(buf + len, PAGE_SIZE - len, " more\n");
+	for (i = 0; i < UXFS_LAT_NR; i++) {
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s",
+				 uxfs_lat_names[i]);
+		for (b = 0; b < UXFS_LAT_BUCKETS; b++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %ld",
+					 atomic_long_read(&fs->u_lat[i][b]));
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+	return len;
+}
+
+static ssize_t frag_show(struct uxfs_fs *fs, char *buf)
+{
+	return uxfs_frag_show(fs->u_vfs_sb, buf);
+}
+
+static struct uxfs_attr uxfs_attr_stats = {
+	.attr = {.name = "stats",.mode = S_IRUGO | S_IWUSR},
+	.show = stats_show,
+};
+
+static struct uxfs_attr uxfs_attr_latency = {
+	.attr = {.name = "latency",.mode = S_IRUGO | S_IWUSR},
+	.show = latency_show,
+};
+
+static struct uxfs_attr uxfs_attr_frag = {
+	.attr = {.name = "frag",.mode = S_IRUGO},
+	.show = frag_show,
+};
+
+static struct attribute *uxfs_attrs[] = {
+	&uxfs_attr_stats.attr,
+	&uxfs_attr_latency.attr,
+	&uxfs_attr_frag.attr,
+	NULL,
+};
+
+static ssize_t uxfs_attr_show(struct kobject *kobj, struct attribute *attr,
+			      char *buf)
+{
+	struct uxfs_fs *fs = container_of(kobj, struct uxfs_fs, u_kobj);
+	struct uxfs_attr *a = container_of(attr, struct uxfs_attr, attr);
+
+	return a->show(fs, buf);
+}
+
+static ssize_t uxfs_attr_store(struct kobject *kobj, struct attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct uxfs_fs *fs = container_of(kobj, struct uxfs_fs, u_kobj);
+	int i, b;
+
+	for (i = 0; i < UXFS_STAT_NR; i++)
+		atomic_long_set(&fs->u_stats[i], 0);
+	for (i = 0; i < UXFS_LAT_NR; i++)
+		for (b = 0; b < UXFS_LAT_BUCKETS; b++)
+			atomic_long_set(&fs->u_lat[i][b], 0);
+	return len;
+}
+
+static void uxfs_kobj_release(struct kobject *kobj)
+{
+	struct uxfs_fs *fs = container_of(kobj, struct uxfs_fs, u_kobj);
+
+	complete(&fs->u_kobj_unregister);
+}
+
+static const struct sysfs_ops uxfs_sysfs_ops = {
+	.show = uxfs_attr_show,
+	.store = uxfs_attr_store,
+};
+
+static struct kobj_type uxfs_ktype = {
+	.default_attrs = uxfs_attrs,
+	.sysfs_ops = &uxfs_sysfs_ops,
+	.release = uxfs_kobj_release,
+};
+
+int uxfs_sysfs_register(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+
+	fs->u_kobj.kset = uxfs_kset;
+	init_completion(&fs->u_kobj_unregister);
+	return kobject_init_and_add(&fs->u_kobj, &uxfs_ktype, NULL, "%s",
+				    sb->s_id);
+}
+
+/*
+ * The uxfs_fs structure must not be freed before sysfs is done
+ * with it, so wait for the last reference to go away.
+ */
+
+void uxfs_sysfs_unregister(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+
+	kobject_put(&fs->u_kobj);
+	wait_for_completion(&fs->u_kobj_unregister);
+}
+
+int __init uxfs_stats_init(void)
+{
+	uxfs_kset = kset_create_and_add("uxfs", NULL, fs_kobj);
+	if (!uxfs_kset)
+		return -ENOMEM;
+	return 0;
+}
+
+void uxfs_stats_exit(void)
+{
+	kset_unregister(uxfs_kset);
+}
@@ -0,0 +1,228 @@
+/*--------------------------------------------------------------*/
+/*--------------------------- uxfs_stripe.c ----------------------*/
+/*--------------------------------------------------------------*/
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "uxfs.h"
+
+/*
+ * Volumes striped over several block devices. The layout is in
+ * uxfs.h: member 0 is the device that was mounted and holds all the
+ * metadata, data blocks go round robin over the members a stripe
+ * unit at a time. Since the block map numbers data blocks across
+ * the whole volume, the allocator needs to know nothing about this:
+ * consecutive blocks of a file are spread over the members by
+ * their addresses alone.
+ *
+ * Everything that does I/O on data blocks goes through
+ * uxfs_map_block() to find the member and the block on it. The
+ * mpage routines assume a single device for a whole bio, so files
+ * of striped volumes use uxfs_stripe_aops, which do I/O a buffer
+ * at a time, each to its own device.
+ */
+
+struct block_device *uxfs_map_block(struct super_block *sb, __u32 blk,
+				    sector_t *phys)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	__u32 member;
+
+	*phys = uxfs_stripe_map(&fs->u_devtab, blk, &member);
+	return fs->u_bdev[member];
+}
+
+/*
+ * How many blocks from "blk" on are contiguous on the same member.
+ */
+
+unsigned uxfs_stripe_run(struct super_block *sb, __u32 blk)
+{
+	struct uxfs_devtab *dt = &uxfs_sb(sb)->u_devtab;
+
+	if (dt->d_ndevs <= 1 || blk < UXFS_FIRST_DATA_BLOCK)
+		return UXFS_MAXBLOCKS;
+	return dt->d_stripe - (blk - UXFS_FIRST_DATA_BLOCK) % dt->d_stripe;
+}
+
+void uxfs_map_bh(struct buffer_head *bh, struct super_block *sb, __u32 blk)
+{
+	struct block_device *bdev;
+	sector_t phys;
+
+	bdev = uxfs_map_block(sb, blk, &phys);
+	map_bh(bh, sb, phys);
+	bh->b_bdev = bdev;
+}
+
+struct buffer_head *uxfs_bread(struct super_block *sb, __u32 blk)
+{
+	struct block_device *bdev;
+	sector_t phys;
+
+	bdev = uxfs_map_block(sb, blk, &phys);
+	return __bread(bdev, phys, UXFS_BSIZE);
+}
+
+struct buffer_head *uxfs_getblk(struct super_block *sb, __u32 blk)
+{
+	struct block_device *bdev;
+	sector_t phys;
+
+	bdev = uxfs_map_block(sb, blk, &phys);
+	return __getblk(bdev, phys, UXFS_BSIZE);
+}
+
+/*
+ * Make sure "bdev" is member "index" of the volume described by
+ * "dt" and big enough.
+ */
+
+static int uxfs_member_check(struct block_device *bdev,
+			     struct uxfs_devtab *dt, int index, __u32 nblocks)
+{
+	struct uxfs_devtab *mdt;
+	struct buffer_head *bh;
+	int error = -EINVAL;
+
+	if (set_blocksize(bdev, UXFS_BSIZE))
+		return -EINVAL;
+	if (i_size_read(bdev->bd_inode) >> UXFS_BSIZE_BITS <
+	    uxfs_member_blocks(dt, nblocks))
+		return -ENOSPC;
+	bh = __bread(bdev, UXFS_DEVTAB_BLOCK, UXFS_BSIZE);
+	if (!bh)
+		return -EIO;
+	mdt = (struct uxfs_devtab *)bh->b_data;
+	if (mdt->d_magic == UXFS_DEVTAB_MAGIC &&
+	    mdt->d_volid == dt->d_volid && mdt->d_ndevs == dt->d_ndevs &&
+	    mdt->d_stripe == dt->d_stripe && mdt->d_index == index)
+		error = 0;
+	brelse(bh);
+	return error;
+}
+
+/*
+ * Read the device table from the mounted device and open the other
+ * members, from the "devices=" mount option if there was one, else
+ * from the names recorded by mkfs.
+ */
+
+int uxfs_devs_open(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	struct uxfs_devtab *dt = &fs->u_devtab;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	char *names = fs->u_devopt, *path;
+	int i, error;
+
+	fs->u_bdev[0] = sb->s_bdev;
+	bh = sb_bread(sb, UXFS_DEVTAB_BLOCK);
+	if (!bh)
+		return -EIO;
+	memcpy(dt, bh->b_data, sizeof(*dt));
+	brelse(bh);
+
+	if (dt->d_magic != UXFS_DEVTAB_MAGIC) {
+		memset(dt, 0, sizeof(*dt));
+		dt->d_ndevs = 1;
+		dt->d_stripe = UXFS_STRIPE_DEFAULT;
+	}
+	if (dt->d_ndevs < 1 || dt->d_ndevs > UXFS_MAXDEVS ||
+	    dt->d_index != 0 || dt->d_stripe == 0) {
+		printk(KERN_ERR "uxfs: Bad device table on %s\n", sb->s_id);
+		return -EINVAL;
+	}
+	if (dt->d_ndevs == 1)
+		return 0;
+
+	fs->u_devmode = FMODE_READ | FMODE_EXCL;
+	if (!(sb->s_flags & MS_RDONLY))
+		fs->u_devmode |= FMODE_WRITE;
+	for (i = 1; i < dt->d_ndevs; i++) {
+		path = names ? strsep(&names, ":") : NULL;
+		if (!path || !*path) {
+			dt->d_names[i][UXFS_DEVNAMELEN - 1] = '\0';
+			path = dt->d_names[i];
+		}
+		bdev = blkdev_get_by_path(path, fs->u_devmode, sb);
+		if (IS_ERR(bdev)) {
+			error = PTR_ERR(bdev);
+			goto fail;
+		}
+		fs->u_bdev[i] = bdev;
+		error = uxfs_member_check(bdev, dt, i,
+					  uxfs_nblocks(fs->u_sb));
+		if (error)
+			goto fail;
+	}
+	return 0;
+
+      fail:
+	printk(KERN_ERR "uxfs: Unable to use %s as member %d of %s\n",
+	       path, i, sb->s_id);
+	uxfs_devs_close(sb);
+	return error;
+}
+
+void uxfs_devs_close(struct super_block *sb)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	int i;
+
+	for (i = 1; i < UXFS_MAXDEVS; i++) {
+		if (!fs->u_bdev[i])
+			continue;
+		sync_blockdev(fs->u_bdev[i]);
+		blkdev_put(fs->u_bdev[i], fs->u_devmode);
+		fs->u_bdev[i] = NULL;
+	}
+	kfree(fs->u_devopt);
+	fs->u_devopt = NULL;
+}
+
+/*
+ * Are all members big enough for a volume of "nblocks" data blocks?
+ */
+
+int uxfs_devs_fit(struct super_block *sb, __u32 nblocks)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	__u32 need = uxfs_member_blocks(&fs->u_devtab, nblocks);
+	int i;
+
+	for (i = 0; i < fs->u_devtab.d_ndevs; i++) {
+		if (i_size_read(fs->u_bdev[i]->bd_inode) >> UXFS_BSIZE_BITS <
+		    need)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * The VFS only writes out the buffers of the mounted device, those
+ * of the other members are ours to write.
+ */
+
+int uxfs_devs_sync(struct super_block *sb, int wait)
+{
+	struct uxfs_fs *fs = uxfs_sb(sb);
+	int i, error, ret = 0;
+
+	for (i = 1; i < UXFS_MAXDEVS; i++) {
+		if (!fs->u_bdev[i])
+			continue;
+		if (wait)
+			error = sync_blockdev(fs->u_bdev[i]);
+		else
+			error = filemap_fdatawrite(fs->u_bdev[i]->bd_inode->
+						   i_mapping);
+		if (error && !ret)
+			ret = error;
+	}
+	return ret;
+}
@@ -0,0 +1,214 @@
+/*--------------------------------------------------------------*/
+/*------------------------- uxfs_trace.h -----------------------*/
+/*--------------------------------------------------------------*/
+
+/*
+ * Static tracepoints, visible under /sys/kernel/debug/tracing/
+ * events/uxfs/. Each event carries the time the operation took so
+ * that individual slow calls can be picked out; the aggregated
+ * histograms are in /sys/fs/uxfs/<dev>/latency.
+ *
+ * The uxfs_op_* events are the stream of VFS operations instead,
+ * with names and sizes, for bench/uxreplay to play back. "ret" is
+ * the inode the name refers to (0 for a negative lookup) or a
+ * negative errno for the namespace operations, the byte count or a
+ * negative errno for reads and writes.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM uxfs
+
+#if !defined(_UXFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _UXFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(uxfs_iget,
+	TP_PROTO(struct super_block *sb, unsigned long ino, int cached,
+		 u64 ns),
+	TP_ARGS(sb, ino, cached, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(int, cached)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->cached = cached;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d,%d ino %lu cached %d ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->cached, __entry->ns)
+);
+
+TRACE_EVENT(uxfs_find_entry,
+	TP_PROTO(struct inode *dip, const char *name, int ino, int nblocks,
+		 u64 ns),
+	TP_ARGS(dip, name, ino, nblocks, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__string(name, name)
+		__field(int, ino)
+		__field(int, nblocks)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = dip->i_sb->s_dev;
+		__entry->dir = dip->i_ino;
+		__assign_str(name, name);
+		__entry->ino = ino;
+		__entry->nblocks = nblocks;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %d blocks %d ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->nblocks,
+		  __entry->ns)
+);
+
+TRACE_EVENT(uxfs_diradd,
+	TP_PROTO(struct inode *dip, const char *name, int ino, int nblocks,
+		 u64 ns),
+	TP_ARGS(dip, name, ino, nblocks, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__string(name, name)
+		__field(int, ino)
+		__field(int, nblocks)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = dip->i_sb->s_dev;
+		__entry->dir = dip->i_ino;
+		__assign_str(name, name);
+		__entry->ino = ino;
+		__entry->nblocks = nblocks;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d,%d dir %lu name %s ino %d blocks %d ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->nblocks,
+		  __entry->ns)
+);
+
+TRACE_EVENT(uxfs_get_block,
+	TP_PROTO(struct inode *inode, sector_t iblock, u32 blk, int create,
+		 u64 ns),
+	TP_ARGS(inode, iblock, blk, create, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(sector_t, iblock)
+		__field(u32, blk)
+		__field(int, create)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->iblock = iblock;
+		__entry->blk = blk;
+		__entry->create = create;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d,%d ino %lu iblock %llu blk %u create %d ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long long)__entry->iblock, __entry->blk,
+		  __entry->create, __entry->ns)
+);
+
+TRACE_EVENT(uxfs_write_inode,
+	TP_PROTO(struct inode *inode, u64 ns),
+	TP_ARGS(inode, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d,%d ino %lu ns %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->ns)
+);
+
+DECLARE_EVENT_CLASS(uxfs_op_name,
+	TP_PROTO(struct inode *dip, struct dentry *dentry, long ret),
+	TP_ARGS(dip, dentry, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__string(name, dentry->d_name.name)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = dip->i_sb->s_dev;
+		__entry->dir = dip->i_ino;
+		__assign_str(name, dentry->d_name.name);
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d dir %lu name %s ret %ld",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ret)
+);
+
+DEFINE_EVENT(uxfs_op_name, uxfs_op_create,
+	TP_PROTO(struct inode *dip, struct dentry *dentry, long ret),
+	TP_ARGS(dip, dentry, ret));
+DEFINE_EVENT(uxfs_op_name, uxfs_op_lookup,
+	TP_PROTO(struct inode *dip, struct dentry *dentry, long ret),
+	TP_ARGS(dip, dentry, ret));
+DEFINE_EVENT(uxfs_op_name, uxfs_op_unlink,
+	TP_PROTO(struct inode *dip, struct dentry *dentry, long ret),
+	TP_ARGS(dip, dentry, ret));
+DEFINE_EVENT(uxfs_op_name, uxfs_op_mkdir,
+	TP_PROTO(struct inode *dip, struct dentry *dentry, long ret),
+	TP_ARGS(dip, dentry, ret));
+DEFINE_EVENT(uxfs_op_name, uxfs_op_rmdir,
+	TP_PROTO(struct inode *dip, struct dentry *dentry, long ret),
+	TP_ARGS(dip, dentry, ret));
+
+DECLARE_EVENT_CLASS(uxfs_op_rw,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+	TP_ARGS(inode, pos, len, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(size_t, len)
+		__field(ssize_t, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("dev %d,%d ino %lu pos %lld len %zu ret %zd",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (long long)__entry->pos, __entry->len, __entry->ret)
+);
+
+DEFINE_EVENT(uxfs_op_rw, uxfs_op_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+	TP_ARGS(inode, pos, len, ret));
+DEFINE_EVENT(uxfs_op_rw, uxfs_op_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+	TP_ARGS(inode, pos, len, ret));
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE uxfs_trace
+#include <trace/define_trace.h>